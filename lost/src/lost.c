@@ -24,6 +24,8 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  ******************************************************************************/
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -40,6 +42,12 @@
 #include <time.h>
 
 #include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lost.h"
 
 #define LOST_VERSION "0.83"
 #define MAX_REAL 0
@@ -153,6 +161,10 @@ void atm_inc(volatile double *value, double inc) {
 	if (pthread_join(t, NULL))                                   \
 		fatal("failed to join thread");                      \
 } while (0);
+#define thread_detach(t) do {                                        \
+	if (pthread_detach(t))                                       \
+		fatal("failed to detach thread");                    \
+} while (0)
 
 #define mtx_t pthread_mutex_t
 #define mtx_init(m)   do {                        \
@@ -194,6 +206,48 @@ void atm_inc(volatile double *value, double inc) {
 		fatal("failed to broadcast cond"); \
 } while (0);
 
+/* bar_t:
+ *   A simple reusable barrier built on top of the mutex and condition above.
+ *   All the [nth] threads must call bar_wait before any of them can continue.
+ *   The generation counter make it safe to reuse the barrier immediately.
+ */
+typedef struct bar_s bar_t;
+struct bar_s {
+	mtx_t  mtx;
+	cond_t cnd;
+	int    nth, cnt, gen;
+};
+
+static
+void bar_init(bar_t *bar, int nth) {
+	mtx_init(&bar->mtx);
+	cond_init(&bar->cnd);
+	bar->nth = nth;
+	bar->cnt = 0;
+	bar->gen = 0;
+}
+
+static
+void bar_clear(bar_t *bar) {
+	mtx_clear(&bar->mtx);
+	cond_clear(&bar->cnd);
+}
+
+static
+void bar_wait(bar_t *bar) {
+	mtx_lock(&bar->mtx);
+	const int gen = bar->gen;
+	if (++bar->cnt == bar->nth) {
+		bar->cnt = 0;
+		bar->gen++;
+		cond_broadcast(&bar->cnd);
+	} else {
+		while (gen == bar->gen)
+			cond_wait(&bar->cnd, &bar->mtx);
+	}
+	mtx_unlock(&bar->mtx);
+}
+
 /*******************************************************************************
  * Spooky hash
  *
@@ -888,6 +942,49 @@ void *map_next(map_t *map, void *last) {
 	return nd;
 }
 
+/* map_itr_t:
+ *   Iterator over a shard of the table. As the items are sorted by their bit
+ *   reversed key, splitting the key space in 2^n ranges on the highest bits is
+ *   the same as splitting the list at the heads of the first 2^n buckets. So
+ *   each shard is a contiguous part of the list, starting at a bucket head,
+ *   which can be walked independently of the other ones.
+ */
+typedef struct map_itr_s map_itr_t;
+struct map_itr_s {
+	lst_t *nd;   // Current node
+	hsh_t  beg;  // First key of the shard
+	hsh_t  end;  // Key following the shard or 0 for the last one
+};
+
+/* map_shard:
+ *   Setup [itr] to walk the shard [j] of the table split in 2^[lg] shards. The
+ *   shards must be at most as much as the current number of buckets so there
+ *   is a head for each of them.
+ */
+static
+void map_shard(map_t *map, int lg, uint64_t j, map_itr_t *itr) {
+	assert(map != NULL && itr != NULL);
+	assert(lg > 0 && lg < 32 && ((size_t)1 << lg) <= map->size);
+	itr->beg = j << (64 - lg);
+	itr->end = (j + 1) << (64 - lg);
+	itr->nd  = map_getbkt(map, bit_reverse(itr->beg));
+}
+
+/* map_inext:
+ *   Return the next item of the shard or NULL if the shard is done. It is safe
+ *   to remove the returned item from the table once the next one is fetched.
+ */
+static
+void *map_inext(map_itr_t *itr) {
+	lst_t *nd = itr->nd;
+	do {
+		nd = nd->next;
+		if (nd == NULL || (itr->end != 0 && nd->key >= itr->end))
+			return itr->nd = NULL;
+	} while (key_ismark(nd->key) || nd->key < itr->beg);
+	return itr->nd = nd;
+}
+
 /* map_gethsh:
  *   Return the hash of a value returned by the iterator.
  */
@@ -1018,13 +1115,13 @@ int voc_splay(voc_t *voc, const char *key) {
  *   modified nor freed by the caller and remain valid for the lifetime of the
  *   vocab object. Return NULL if the identifier is invalid.
  */
-/*static
+static
 const char *voc_id2str(const voc_t *voc, int id) {
 	assert(voc != NULL);
 	if (id < 0 || id >= voc->count)
 		return NULL;
 	return voc->vect[id]->key;
-}*/
+}
 
 /* voc_newnode:
  *   Create a new node object with given key, value and no childs. The key
@@ -1531,10 +1628,12 @@ int ssp_save(ssp_t *ssp, const char *fn) {
  */
 typedef struct lbl_s lbl_t;
 struct lbl_s {
-	lst_t lst;    // List item for insertion in hash table
-	hsh_t raw;    // Hash of raw unparsed string of the label
-	int   cnt;    // Number of tokens in the label
-	hsh_t tok[];  // List of tokens hash values
+	lst_t       lst;    // List item for insertion in hash table
+	hsh_t       raw;    // Hash of raw unparsed string of the label
+	const char *str;    // String of the label once resolved by mdl_lblstr
+	int         tmp;    // True if not in the vocabulary of a frozen model
+	int         cnt;    // Number of tokens in the label
+	hsh_t       tok[];  // List of tokens hash values
 };
 
 /* ftr_t:
@@ -1551,6 +1650,32 @@ struct ftr_s {
 	float  stp;  // Current step value on this dimension
 	float  dlt;  // Value of the previous update that can be undone
 	int    frq;  // Feature frequency
+	int    dor;  // Iteration where it became dormant or 0 if active
+	int    stm;  // Last stochastic step it was updated, negated if used
+};
+
+/* pair_t:
+ *   Shared score of a pair of target labels for the bigram patterns testing
+ *   only the target side of the two arcs. These features are the same for all
+ *   the states where the pair occurs, so their weights are summed once per
+ *   iteration here instead of at each state. The expectations and frequencies
+ *   are also accumulated here and given back to the features at the end of the
+ *   gradient computation.
+ *   A pair is only modified by the thread creating it before it is inserted
+ *   in the table, and else by a single thread between the gradient passes. A
+ *   slot is left NULL if its feature cannot be created yet, this is tried
+ *   again at the start of the next pass.
+ */
+typedef struct pair_s pair_t;
+struct pair_s {
+	lst_t  lst;    // List item for insertion in hash table
+	lbl_t *trg[2]; // Target labels of the two arcs
+	double psi;    // Sum of the weights of the features
+	double g;      // Expectation accumulated by the gradient
+	int    frq;    // Occurrences counted for the frequency filter
+	int    miss;   // Number of empty slots
+	int    cnt;    // Number of slots
+	ftr_t *ftr[];  // [cnt] Features of the label-only patterns
 };
 
 typedef struct mdl_s mdl_t;
@@ -1559,12 +1684,27 @@ struct mdl_s {
 	ssp_t *ssp;  // Shared string pool
 	map_t *src;  // Source label vocabulary <str,lbl_t>
 	map_t *trg;  // Target label vocabulary <str,lbl_t>
+	map_t *pair; // Shared label-only bigram scores <hsh,pair_t>
+	int    nclr; // Number of times the shared pairs were dropped
+	int    frz;  // True if the model is only used for decoding
 	ftr_t *real[MAX_REAL];
 	int    itr;
 	int    frq;
 	int    stt[128];
 	int    rem[128];
 	FILE  *dump;
+	int    nval;       // True if the counts below are up to date
+	long   ntot[128];  // Number of features per tag
+	long   nact[128];  // Number of active features per tag
+	long   ndor[128];  // Number of dormant features per tag
+	int    stp;        // Current step of the stochastic optimizer or 0
+	// Active set of the optimizer: all features not dormant, maintained
+	// only if [act] is not NULL. The dormant features are ignored by the
+	// gradient and the optimizer unless [full] is set.
+	int     full;
+	ftr_t **act;
+	long    nlst, slst;
+	mtx_t   amtx;
 };
 
 /* mdl_new:
@@ -1581,8 +1721,9 @@ mdl_t *mdl_new(ssp_t *ssp) {
 	mdl->ssp  = ssp;
 	mdl->src  = map_new();
 	mdl->trg  = map_new();
+	mdl->pair = map_new();
 	mdl->ftrs = map_new();
-	if (mdl->ftrs == NULL) {
+	if (mdl->ftrs == NULL || mdl->pair == NULL) {
 		free(mdl);
 		return NULL;
 	}
@@ -1592,7 +1733,17 @@ mdl_t *mdl_new(ssp_t *ssp) {
 	}
 	mdl->itr  = 0;
 	mdl->frq  = 0;
+	mdl->nclr = 0;
+	mdl->frz  = 0;
 	mdl->dump = NULL;
+	mdl->nval = 0;
+	memset(mdl->ndor, 0, sizeof(mdl->ndor));
+	mdl->stp  = 0;
+	mdl->full = 1;
+	mdl->act  = NULL;
+	mdl->nlst = 0;
+	mdl->slst = 0;
+	mtx_init(&mdl->amtx);
 	for (int i = 1; i < MAX_REAL; i++) {
 		hsh_t idx = i;
 		idx &= ((hsh_t)-1        >> (hsh_t)8);
@@ -1605,15 +1756,32 @@ mdl_t *mdl_new(ssp_t *ssp) {
 	return mdl;
 }
 
+/* mdl_free:
+ *   Free a model with all its features and labels. The string pool is shared
+ *   so it is left untouched.
+ */
+static
+void mdl_free(mdl_t *mdl) {
+	map_free(mdl->ftrs, free);
+	map_free(mdl->src, free);
+	map_free(mdl->trg, free);
+	map_free(mdl->pair, free);
+	free(mdl->act);
+	mtx_clear(&mdl->amtx);
+	free(mdl);
+}
+
 /* mdl_newlbl:
  *   Build a new label object from the given string. This assume that the given
  *   string is non-empty and trimed if needed.
  *   The allocation of the object is done with care so a single free of the
  *   object will free all the associated memory leaving out the need for a
  *   dedicated function.
+ *   If [tmp] is true, the strings are not stored in the pool and the label keep
+ *   its own copy of the string instead.
  */
 static
-lbl_t *mdl_newlbl(mdl_t *mdl, const char *str, int md) {
+lbl_t *mdl_newlbl(mdl_t *mdl, const char *str, int md, int tmp) {
 	assert(mdl != NULL && str != NULL && *str != '\0');
 	// First pass: We just count the number of tokens in the input label so
 	// we can allocate the label object in one block.
@@ -1624,18 +1792,32 @@ lbl_t *mdl_newlbl(mdl_t *mdl, const char *str, int md) {
 	// Now we can allocate the object in one malloc call and start filling
 	// the object. There is no alignement problems here as only string are
 	// put after the structure itself.
-	lbl_t *lbl = malloc(sizeof(lbl_t) + sizeof(hsh_t) * n);
+	const size_t len = tmp ? strlen(str) + 1 : 0;
+	lbl_t *lbl = malloc(sizeof(lbl_t) + sizeof(hsh_t) * n + len);
 	if (lbl == NULL) {
 		errno = ENOMEM;
 		return NULL;
 	}
 	lbl->cnt = n;
-	lbl->raw = ssp_string(mdl->ssp, str, md);
+	lbl->tmp = tmp;
+	if (tmp) {
+		char *cpy = (char *)(lbl->tok + n);
+		memcpy(cpy, str, len);
+		lbl->raw = hsh_string(str);
+		lbl->str = cpy;
+	} else {
+		lbl->raw = ssp_string(mdl->ssp, str, md);
+		lbl->str = NULL;
+	}
 	// Next, we do the second pass on the string computing the hash values
 	// of the tokens and filling the label object.
 	for (int i = 0, l = 0, t = 0; ; i++) {
 		if (str[i] == '|' || str[i] == '\0') {
-			lbl->tok[t] = ssp_buffer(mdl->ssp, str + l, i - l, md);
+			if (tmp)
+				lbl->tok[t] = hsh_buffer(str + l, i - l);
+			else
+				lbl->tok[t] = ssp_buffer(mdl->ssp, str + l,
+					i - l, md);
 			t++; l = i + 1;
 		}
 		if (str[i] == '\0')
@@ -1661,7 +1843,7 @@ lbl_t *mdl_maplbl(mdl_t *mdl, map_t *voc, const char *str, int md) {
 	// The label is not already in the table so create a new one and try to
 	// insert it. We have to take some care here as another thread may have
 	// inserted the same label in the mean time.
-	lbl_t *tmp = mdl_newlbl(mdl, str, md);
+	lbl_t *tmp = mdl_newlbl(mdl, str, md, 0);
 	if (tmp == NULL)
 		return NULL;
 	lbl = map_insert(voc, hsh, tmp);
@@ -1670,6 +1852,53 @@ lbl_t *mdl_maplbl(mdl_t *mdl, map_t *voc, const char *str, int md) {
 	return lbl;
 }
 
+/* mdl_lookup:
+ *   Map a label like [mdl_maplbl] but without growing a frozen model. The
+ *   labels not in its vocabulary are then built apart, with their own copy of
+ *   the string, and kept in the [unk] table which is created on first need and
+ *   owned by the caller. So a long running decoder fed with an open vocabulary
+ *   keep a bounded memory. This table must not be shared between threads.
+ */
+static
+lbl_t *mdl_lookup(mdl_t *mdl, map_t *voc, const char *str, int md,
+		map_t **unk) {
+	if (!mdl->frz)
+		return mdl_maplbl(mdl, voc, str, md);
+	const hsh_t hsh = hsh_string(str);
+	lbl_t *lbl = map_find(voc, hsh);
+	if (lbl != NULL)
+		return lbl;
+	if (*unk == NULL && (*unk = map_new()) == NULL)
+		return NULL;
+	lbl = map_find(*unk, hsh);
+	if (lbl != NULL)
+		return lbl;
+	lbl = mdl_newlbl(mdl, str, md, 1);
+	if (lbl == NULL)
+		return NULL;
+	map_insert(*unk, hsh, lbl);
+	return lbl;
+}
+
+/* mdl_lblstr:
+ *   Return the string of a label from the pool. The string is searched only
+ *   the first time and next taken from the label itself, as strings are never
+ *   removed from the pool, many threads can race here as they will all store
+ *   the same pointer. Unknown strings are not cached as they may be loaded in
+ *   the pool later.
+ */
+static
+const char *mdl_lblstr(ssp_t *ssp, lbl_t *lbl) {
+	const char *str = lbl->str;
+	if (str != NULL)
+		return str;
+	ist_t *ist = map_find(ssp->map, lbl->raw);
+	if (ist == NULL)
+		return ssp_get(ssp, lbl->raw);
+	lbl->str = ist->str;
+	return ist->str;
+}
+
 /* mdl_map*:
  *   Small wrappers around mdl_maplbl for simple mapping in source or target
  *   vocabulary.
@@ -1685,22 +1914,76 @@ lbl_t *mdl_maptrg(mdl_t *mdl, const char *str) {
 	return mdl_maplbl(mdl, mdl->trg, str, 1);
 }
 
+/* mdl_gettag:
+ *   Return the tag of the given feature. This allow caller to retrieve tag
+ *   parameter for any given feature.
+ */
+static
+int mdl_gettag(ftr_t *ftr) {
+	assert(ftr != NULL);
+	return map_gethsh(ftr) >> (hsh_t)56;
+}
+
+/* mdl_addact:
+ *   Append features to the active set if it is maintained. This may be called
+ *   concurrently by several threads.
+ */
+static
+void mdl_addact(mdl_t *mdl, ftr_t *lst[], long n) {
+	if (mdl->act == NULL || n == 0)
+		return;
+	mtx_lock(&mdl->amtx);
+	if (mdl->nlst + n > mdl->slst) {
+		const long size = max(mdl->slst * 2, mdl->nlst + n);
+		ftr_t **tmp = realloc(mdl->act, sizeof(ftr_t *) * size);
+		if (tmp == NULL)
+			fatal("out of memory");
+		mdl->act  = tmp;
+		mdl->slst = size;
+	}
+	memcpy(mdl->act + mdl->nlst, lst, sizeof(ftr_t *) * n);
+	mdl->nlst += n;
+	mtx_unlock(&mdl->amtx);
+}
+
+/* mdl_touch:
+ *   Mark a feature as used by the current step of the stochastic optimizer and
+ *   add it to the active set. The mark is the bitwise not of its last update
+ *   step so only the first thread to use it will add it.
+ */
+static
+void mdl_touch(mdl_t *mdl, ftr_t *ftr) {
+	const int old = ftr->stm;
+	if (old >= 0 && atm_cas(&ftr->stm, old, ~old))
+		mdl_addact(mdl, &ftr, 1);
+}
+
+/* mdl_ftrid:
+ *   Compute the feature identifier by combining the group tag and the hash
+ *   values in a single hash.
+ */
+static inline
+hsh_t mdl_ftrid(int tag, int n, const hsh_t hsh[n]) {
+	hsh_t idx = hsh_buffer(hsh, sizeof(hsh_t) * n);
+	idx &= ((hsh_t)-1  >> (hsh_t)8);
+	idx |= ((hsh_t)tag << (hsh_t)56);
+	return idx;
+}
+
 static
 ftr_t *mdl_addftr(mdl_t *mdl, int tag, int n, hsh_t hsh[n], int frq) {
 	assert(mdl != NULL);
 	assert(tag >= 0 && tag < 128);
 	assert(n > 0 && hsh != NULL);
-	// First, compute the feature identifier by combining the group tag and
-	// the hash values in a single hash.
-	hsh_t idx = hsh_buffer(hsh, sizeof(hsh_t) * n);
-	idx &= ((hsh_t)-1  >> (hsh_t)8);
-	idx |= ((hsh_t)tag << (hsh_t)56);
+	const hsh_t idx = mdl_ftrid(tag, n, hsh);
 	// Search the table for the feature. If it is already present, just
 	// return the associated object and increment frequency.
 	ftr_t *ftr = map_find(mdl->ftrs, idx);
 	if (ftr != NULL) {
-		if (frq)
+		if (frq && (ftr->dor == 0 || mdl->full))
 			atm_add(&ftr->frq, 1);
+		if (mdl->stp != 0 && ftr->stm >= 0)
+			mdl_touch(mdl, ftr);
 		return ftr;
 	}
 	// Check if the feature insertion is currently enabled for this tag, if
@@ -1716,6 +1999,8 @@ ftr_t *mdl_addftr(mdl_t *mdl, int tag, int n, hsh_t hsh[n], int frq) {
 		return NULL;
 	}
 	memset(tmp, 0, sizeof(ftr_t));
+	if (mdl->stp != 0)
+		tmp->stm = ~(mdl->stp - 1);
 	ftr = map_insert(mdl->ftrs, idx, tmp);
 	if (ftr != tmp) {
 		free(tmp);
@@ -1731,19 +2016,35 @@ ftr_t *mdl_addftr(mdl_t *mdl, int tag, int n, hsh_t hsh[n], int frq) {
 			fprintf(mdl->dump, " %016"PRIx64, hsh[i]);
 		fprintf(mdl->dump, "\n");
 	}
+	mdl_addact(mdl, &ftr, 1);
 	if (frq)
 		atm_add(&ftr->frq, 1);
 	return ftr;
 }
 
-/* mdl_gettag:
- *   Return the tag of the given feature. This allow caller to retrieve tag
- *   parameter for any given feature.
+/* mdl_getftr:
+ *   Return the feature with the given identifier, creating it if needed. This
+ *   bypass the tags rules and is used for features coming from elsewhere than
+ *   the generator. On error, return NULL and set errno.
  */
 static
-int mdl_gettag(ftr_t *ftr) {
-	assert(ftr != NULL);
-	return map_gethsh(ftr) >> (hsh_t)56;
+ftr_t *mdl_getftr(mdl_t *mdl, hsh_t idx) {
+	ftr_t *ftr = map_find(mdl->ftrs, idx);
+	if (ftr != NULL)
+		return ftr;
+	ftr_t *tmp = malloc(sizeof(ftr_t));
+	if (tmp == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(tmp, 0, sizeof(ftr_t));
+	ftr = map_insert(mdl->ftrs, idx, tmp);
+	if (ftr != tmp) {
+		free(tmp);
+		return ftr;
+	}
+	mdl_addact(mdl, &ftr, 1);
+	return ftr;
 }
 
 /* mdl_next:
@@ -1772,12 +2073,73 @@ ftr_t *mdl_remove(mdl_t *mdl, ftr_t *last) {
 	return nxt;
 }
 
+/* mdl_pairclr:
+ *   Drop all the shared pair scores so they are built again by the generator.
+ *   This must be done once features are removed from the model as the pairs
+ *   refer to them. The features lists cached in the FSTs refer to the pairs so
+ *   their users must drop them when [nclr] change.
+ */
+static
+void mdl_pairclr(mdl_t *mdl) {
+	map_t *pair = map_new();
+	if (pair == NULL)
+		fatal("out of memory");
+	map_free(mdl->pair, free);
+	mdl->pair = pair;
+	mdl->nclr++;
+}
+
+/* mdl_pairupd:
+ *   Sum again the weights of the features of all the shared pairs. This must be
+ *   called each time the weights of the model are changed before using it.
+ */
+static
+void mdl_pairupd(mdl_t *mdl) {
+	pair_t *pr = map_next(mdl->pair, NULL);
+	for ( ; pr != NULL; pr = map_next(mdl->pair, pr)) {
+		double psi = 0.0;
+		for (int i = 0; i < pr->cnt; i++)
+			if (pr->ftr[i] != NULL)
+				psi += pr->ftr[i]->x;
+		pr->psi = psi;
+	}
+}
+
+/* mdl_pairacc:
+ *   Give back the expectations and frequencies accumulated in the shared pairs
+ *   to their features and reset them. Like for the features generated directly,
+ *   the dormant ones only get them during the full sweeps.
+ */
+static
+void mdl_pairacc(mdl_t *mdl) {
+	pair_t *pr = map_next(mdl->pair, NULL);
+	for ( ; pr != NULL; pr = map_next(mdl->pair, pr)) {
+		if (pr->g == 0.0 && pr->frq == 0)
+			continue;
+		for (int i = 0; i < pr->cnt; i++) {
+			ftr_t *ftr = pr->ftr[i];
+			if (ftr == NULL || (ftr->dor != 0 && !mdl->full))
+				continue;
+			ftr->g   += pr->g;
+			ftr->frq += pr->frq;
+		}
+		pr->g   = 0.0;
+		pr->frq = 0;
+	}
+}
+
 /* mdl_shrink:
  *   Remove from the model all the features with a zero weight. For now, this
  *   code should only be called if no other threads are accesing the model.
+ *   The optimizer active set is dropped as it may refer to removed features.
  */
 static
 void mdl_shrink(mdl_t *mdl) {
+	free(mdl->act);
+	mdl->act  = NULL;
+	mdl->nlst = 0;
+	mdl->slst = 0;
+	mdl_pairclr(mdl);
 	ftr_t *ftr = mdl_next(mdl, NULL);
 	while (ftr != NULL) {
 		if (ftr->x == 0.0)
@@ -1787,6 +2149,42 @@ void mdl_shrink(mdl_t *mdl) {
 	}
 }
 
+/* mdl_snapshot:
+ *   Copy the weights of [src] and its tags settings to [dst] so it can be used
+ *   for decoding while [src] is modified. The features of a previous snapshot
+ *   are reused, the ones no longer present in [src] being set to zero.
+ */
+static
+void mdl_snapshot(mdl_t *dst, mdl_t *src) {
+	dst->itr = src->itr;
+	memcpy(dst->stt, src->stt, sizeof(dst->stt));
+	memcpy(dst->rem, src->rem, sizeof(dst->rem));
+	ftr_t *ftr = mdl_next(dst, NULL);
+	for ( ; ftr != NULL; ftr = mdl_next(dst, ftr))
+		ftr->x = 0.0;
+	ftr = mdl_next(src, NULL);
+	for ( ; ftr != NULL; ftr = mdl_next(src, ftr)) {
+		ftr_t *cpy = mdl_getftr(dst, map_gethsh(ftr));
+		if (cpy == NULL)
+			fatal("out of memory");
+		cpy->x = ftr->x;
+	}
+	mdl_pairupd(dst);
+}
+
+/* mdl_freeze:
+ *   Prevent any new feature to be added to the model, this is used when it is
+ *   only used for decoding so unseen inputs don't grow it with features which
+ *   would have a null weight anyway. The unseen labels are no more added to
+ *   the vocabularies either, see [mdl_lookup].
+ */
+static
+void mdl_freeze(mdl_t *mdl) {
+	for (int i = 0; i < 128; i++)
+		mdl->rem[i] = mdl->itr;
+	mdl->frz = 1;
+}
+
 /* mdl_save:
  *   Save the model to the given file. The format is simple, one line per
  *   feature with the hash in hexadecimal followed by the feature value.
@@ -1821,40 +2219,44 @@ int mdl_load(mdl_t *mdl, const char *fname) {
 			fclose(file);
 			return 0;
 		}
-		ftr_t *ftr = map_find(mdl->ftrs, hsh);
+		ftr_t *ftr = mdl_getftr(mdl, hsh);
 		if (ftr == NULL) {
-			ftr = malloc(sizeof(ftr_t));
-			if (ftr == NULL) {
-				errno = ENOMEM;
-				fclose(file);
-				return 0;
-			}
-			memset(ftr, 0, sizeof(ftr_t));
-			map_insert(mdl->ftrs, hsh, ftr);
+			fclose(file);
+			return 0;
 		}
 		ftr->x = wgh;
 	}
 	fclose(file);
+	mdl_pairupd(mdl);
 	return 1;
 }
 
 /* mdl_stats:
  *   Display stats about total and active count of features. In verbose mode,
- *   stats per tag are displayed.
+ *   stats per tag are displayed. If the counts were computed by the last
+ *   optimizer step they are used directly, else the model is walked.
  */
 static
 void mdl_stats(mdl_t *mdl, int verb) {
 	long tot[128], act[128];
 	long t = 0, a = 0;
-	memset(tot, 0, sizeof(tot));
-	memset(act, 0, sizeof(act));
-	ftr_t *ftr = mdl_next(mdl, NULL);
-	while (ftr != NULL) {
-		int tag = mdl_gettag(ftr);
-		if (ftr->x != 0.0)
-			act[tag]++, a++;
-		tot[tag]++, t++;
-		ftr = mdl_next(mdl, ftr);
+	if (mdl->nval) {
+		memcpy(tot, mdl->ntot, sizeof(tot));
+		memcpy(act, mdl->nact, sizeof(act));
+		for (int i = 0; i < 128; i++)
+			t += tot[i], a += act[i];
+		mdl->nval = 0;
+	} else {
+		memset(tot, 0, sizeof(tot));
+		memset(act, 0, sizeof(act));
+		ftr_t *ftr = mdl_next(mdl, NULL);
+		while (ftr != NULL) {
+			int tag = mdl_gettag(ftr);
+			if (ftr->x != 0.0)
+				act[tag]++, a++;
+			tot[tag]++, t++;
+			ftr = mdl_next(mdl, ftr);
+		}
 	}
 	if (verb) {
 		for (int i = 0; i < 128; i++)
@@ -1874,6 +2276,7 @@ typedef struct arc_s arc_t;
 typedef struct state_s state_t;
 struct fst_s {
 	int   acceptor;
+	int   path;     // True if the FST is a single path
 	float mult;
 	int   narcs, nstates;
 	int   final;
@@ -1902,20 +2305,29 @@ struct fst_s {
 		int ocnt, *olst;
 		int       **bcnt; // [NI][NO] --> NF
 		ftr_t   ****blst; // [NI][NO][NF]
+		pair_t   ***bpr;  // [NI][NO] Shared label-only pair or NULL
 		double    **psi;
 	} *states;
 	int *s2t, *t2s;
+	int *cpos;  // [S] Arcs offset of each position for linear chains
+	map_t *unk; // Labels unknown to a frozen model <str,lbl_t> or NULL
 	int     *raw_lst;
 	void   **raw_ptr;
 	int     *raw_cnt;
 	ftr_t  **raw_ftr;
 	double **raw_gptr;
 	double  *raw_gval;
+	double  *raw_cval;
 };
 
 fst_t *fst_new(void) {
 	fst_t *fst = malloc(sizeof(fst_t));
+	if (fst == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
 	fst->acceptor =  0;
+	fst->path     =  0;
 	fst->narcs    =  0;
 	fst->nstates  =  0;
 	fst->final    = -1;
@@ -1923,12 +2335,15 @@ fst_t *fst_new(void) {
 	fst->states   = NULL;
 	fst->s2t      = NULL;
 	fst->t2s      = NULL;
+	fst->cpos     = NULL;
+	fst->unk      = NULL;
 	fst->raw_lst  = NULL;
 	fst->raw_ptr  = NULL;
 	fst->raw_cnt  = NULL;
 	fst->raw_ftr  = NULL;
 	fst->raw_gptr = NULL;
 	fst->raw_gval = NULL;
+	fst->raw_cval = NULL;
 	return fst;
 }
 
@@ -1980,13 +2395,28 @@ void fst_remstates(fst_t *fst) {
 	free(fst->raw_lst); fst->raw_lst = NULL;
 }
 
+/* fst_free:
+ *   Free an FST with its arcs, chain positions, and own labels. All the other
+ *   derived data must have been removed before.
+ */
+void fst_free(fst_t *fst) {
+	free(fst->arcs);
+	free(fst->cpos);
+	if (fst->unk != NULL)
+		map_free(fst->unk, free);
+	free(fst);
+}
+
 /* fst_toposort:
  *   Perform a topological sort of the states on the given FST and put the list
  *   of sorted states in the lst array. If the rev variable is true, the sort is
  *   performed from the final state instead of the initial one. This also check
  *   that their is a uniq extremum node and no cycles.
+ *   If [cls] is not NULL, it receive the offset in [lst] of each topological
+ *   class followed by the number of states. The states of a class only depend
+ *   on states of the previous ones. Return the number of classes or 0 on error.
  */
-int fst_toposort(const fst_t *fst, int *lst, int rev) {
+int fst_toposort(const fst_t *fst, int *lst, int *cls, int rev) {
 	assert(fst != NULL && fst->states != NULL);
 	assert(lst != NULL);
 	const int N = fst->nstates;
@@ -2003,10 +2433,13 @@ int fst_toposort(const fst_t *fst, int *lst, int rev) {
 	// Next the main loop of the classical topological sort algorithm. We
 	// search for state of degree 0, put them at the start of the list and
 	// reduce the degrees.
-	int done = 0;
+	int done = 0, ncls = 0;
 	while (done < N) {
 		// First put the states with no incoming edges at the start of
 		// the list.
+		if (cls != NULL)
+			cls[ncls] = done;
+		ncls++;
 		int last = done;
 		for (int n = done; n < N; n++) {
 			if (deg[lst[n]] != 0)
@@ -2043,7 +2476,9 @@ int fst_toposort(const fst_t *fst, int *lst, int rev) {
 		}
 		done = last;
 	}
-	return 1;
+	if (cls != NULL)
+		cls[ncls] = N;
+	return ncls;
 }
 
 /* fst_addsort:
@@ -2069,7 +2504,7 @@ int fst_addsort(fst_t *fst) {
 	// First we sort in initial to final node. This is done by sorting the
 	// nodes first and next using the outgoing edges lists to build the list
 	// of sorted edges taking care of not duplicating them.
-	fst_toposort(fst, lst, 0);
+	fst_toposort(fst, lst, NULL, 0);
 	for (int is = 0, p = 0; is < S; is++) {
 		state_t *s = &fst->states[lst[is]];
 		for (int ai = 0; ai < s->ocnt; ai++) {
@@ -2082,7 +2517,7 @@ int fst_addsort(fst_t *fst) {
 	}
 	// Next we do the reverse, from final node to initial one using the same
 	// principle.
-	fst_toposort(fst, lst, 1);
+	fst_toposort(fst, lst, NULL, 1);
 	for (int is = 0, p = 0; is < S; is++) {
 		state_t *s = &fst->states[lst[is]];
 		for (int ai = 0; ai < s->icnt; ai++) {
@@ -2101,6 +2536,85 @@ void fst_remsort(fst_t *fst) {
 	free(fst->t2s); fst->t2s = NULL;
 }
 
+/* fst_addchain:
+ *   Detect if the FST is a linear chain, so if each state is only connected to
+ *   the next one with a set of parallel arcs, one for each possible label at
+ *   this position. This is the shape of most sequence labeling lattices.
+ *   If this is the case, the arcs are reordered by position and the [cpos]
+ *   array is filled with the offset of the first arc of each position, so the
+ *   labels of position p are the arcs in [cpos[p], cpos[p + 1]) and the last
+ *   entry is the number of arcs. This allow the gradient and the decoder to use
+ *   dense code paths instead of following the arcs lists.
+ *   This must be called before the states lists are built and return true if
+ *   the FST is a chain. Failing to allocate memory is not an error, the FST is
+ *   just handled by the generic code.
+ */
+static
+int fst_addchain(fst_t *fst) {
+	assert(fst != NULL && fst->states == NULL);
+	const int S = fst->nstates, A = fst->narcs;
+	if (S < 2 || A == 0 || fst->cpos != NULL)
+		return fst->cpos != NULL;
+	int   *nxt = malloc(sizeof(int) * S * 4);
+	arc_t *tmp = malloc(sizeof(arc_t) * A);
+	if (nxt == NULL || tmp == NULL)
+		goto fail;
+	int *prv = nxt + S, *pos = prv + S, *cur = pos + S;
+	// First, check that every state have a single successor and a single
+	// predecessor. Parallel arcs are allowed so we just have to check that
+	// all the arcs leaving or reaching a state agree on the other end.
+	for (int is = 0; is < S; is++)
+		nxt[is] = prv[is] = -1;
+	for (int ia = 0; ia < A; ia++) {
+		const int src = fst->arcs[ia].src;
+		const int trg = fst->arcs[ia].trg;
+		if (nxt[src] != -1 && nxt[src] != trg)
+			goto fail;
+		if (prv[trg] != -1 && prv[trg] != src)
+			goto fail;
+		nxt[src] = trg;
+		prv[trg] = src;
+	}
+	// Next, follow the chain from the initial state and check that all the
+	// states are visited with the final one the last.
+	int is = 0, np = 0;
+	if (prv[0] != -1)
+		goto fail;
+	pos[0] = 0;
+	while (is != fst->final) {
+		if (nxt[is] == -1 || np == S - 1)
+			goto fail;
+		is = nxt[is];
+		pos[is] = ++np;
+	}
+	if (np != S - 1 || nxt[is] != -1)
+		goto fail;
+	// This is a chain, so we just have to sort the arcs by position of
+	// their source state. A counting sort keep the input order of the arcs
+	// for a given position.
+	int *cpos = malloc(sizeof(int) * S);
+	if (cpos == NULL)
+		goto fail;
+	for (int ip = 0; ip < S; ip++)
+		cpos[ip] = 0;
+	for (int ia = 0; ia < A; ia++)
+		cpos[pos[fst->arcs[ia].src] + 1]++;
+	for (int ip = 1; ip < S; ip++)
+		cpos[ip] += cpos[ip - 1];
+	memcpy(cur, cpos, sizeof(int) * S);
+	for (int ia = 0; ia < A; ia++)
+		tmp[cur[pos[fst->arcs[ia].src]]++] = fst->arcs[ia];
+	memcpy(fst->arcs, tmp, sizeof(arc_t) * A);
+	fst->cpos = cpos;
+	free(tmp);
+	free(nxt);
+	return 1;
+    fail:
+	free(tmp);
+	free(nxt);
+	return 0;
+}
+
 /*******************************************************************************
  * Dataset loader
  ******************************************************************************/
@@ -2110,6 +2624,11 @@ struct dat_s {
 	int     nfst;
 	int     sfst;
 	fst_t **fst;
+	int     nbat;   // Number of batches
+	int     bwin;   // Window size used for the batches
+	int     bfst;   // Number of FSTs when the batches were built
+	int    *bat;    // [B+1] Offset of each batch in bidx
+	int    *bidx;   // [N] FSTs index in batch order
 };
 
 /* dat_new:
@@ -2125,6 +2644,11 @@ dat_t *dat_new(void) {
 	dat->nfst = 0;
 	dat->sfst = 0;
 	dat->fst  = NULL;
+	dat->nbat = 0;
+	dat->bwin = 0;
+	dat->bfst = 0;
+	dat->bat  = NULL;
+	dat->bidx = NULL;
 	return dat;
 }
 
@@ -2136,8 +2660,10 @@ dat_t *dat_new(void) {
 void dat_free(dat_t *dat) {
 	if (dat != NULL) {
 		for (int i = 0; i < dat->nfst; i++)
-			free(dat->fst[i]);
+			fst_free(dat->fst[i]);
 		free(dat->fst);
+		free(dat->bat);
+		free(dat->bidx);
 		free(dat);
 	}
 }
@@ -2154,8 +2680,9 @@ fst_t *dat_parse(char **lns, mdl_t *mdl) {
 	while (lns[cnt] != NULL)
 		cnt++;
 	fst_t *fst = fst_new();
-	fst->arcs = malloc(sizeof(arc_t) * cnt);
-	if (fst->arcs == NULL) {
+	if (fst != NULL)
+		fst->arcs = malloc(sizeof(arc_t) * cnt);
+	if (fst == NULL || fst->arcs == NULL) {
 		errno = ENOMEM;
 		goto error;
 	}
@@ -2206,8 +2733,8 @@ fst_t *dat_parse(char **lns, mdl_t *mdl) {
 		const int trg = voc_str2id(sts, toks[1]);
 		fst->nstates = max(fst->nstates, src + 1);
 		fst->nstates = max(fst->nstates, trg + 1);
-		lbl_t *ilbl = mdl_mapsrc(mdl, toks[2]);
-		lbl_t *olbl = mdl_maptrg(mdl, toks[3]);
+		lbl_t *ilbl = mdl_lookup(mdl, mdl->src, toks[2], 0, &fst->unk);
+		lbl_t *olbl = mdl_lookup(mdl, mdl->trg, toks[3], 1, &fst->unk);
 		const int ia = fst->narcs++;
 		fst->arcs[ia].src  = src;
 		fst->arcs[ia].trg  = trg;
@@ -2215,23 +2742,167 @@ fst_t *dat_parse(char **lns, mdl_t *mdl) {
 		fst->arcs[ia].olbl = olbl;
 		memcpy(fst->arcs[ia].wgh, wgh, sizeof(wgh));
 	}
-	if (final == NULL) {
+	if (final == NULL || fst->narcs == 0) {
 		errno = EZEPFMT;
 		goto error;
 	}
 	fst->final = voc_str2id(sts, final);
-	// And finally, we just cleanup the vocab and return the parsed FST
-	// object.
+	// Linear chains are detected here so they can use the dense code
+	// paths, single paths like most references are a special case of them
+	// which doesn't need a lattice at all. We just cleanup the vocab and
+	// return the parsed FST object.
+	if (fst_addchain(fst))
+		fst->path = fst->narcs == fst->nstates - 1;
 	voc_free(sts);
 	return fst;
     error:
 	if (sts != NULL)
 		voc_free(sts);
-	if (fst != NULL) {
-		if (fst->arcs != NULL)
-			free(fst->arcs);
-		free(fst);
+	if (fst != NULL)
+		fst_free(fst);
+	return NULL;
+}
+
+/* dat_tbl_t:
+ *   Label table of a binary file. The labels are defined in the file just
+ *   before the first lattice using them and are mapped to the model only when
+ *   used, as the same string may be needed on each side.
+ */
+#define DAT_MAGIC  "LOSTSPC1"
+#define DAT_MAXBIN (INT_MAX / (int)sizeof(arc_t))
+typedef struct dat_tbl_s dat_tbl_t;
+struct dat_tbl_s {
+	int     cnt, size;
+	char  **str;
+	lbl_t **src;
+	lbl_t **trg;
+};
+
+/* dat_readu32:
+ *   Read [n] 32 bits values from a binary file, return false if they cannot be
+ *   fully read.
+ */
+static
+int dat_readu32(FILE *file, uint32_t val[], int n) {
+	return fread(val, sizeof(uint32_t), n, file) == (size_t)n;
+}
+
+/* dat_readbin:
+ *   Read the next FST of a binary file as written by [dec_dumpbin]. Each one
+ *   start with the definition of its new labels, next come the number of
+ *   states and arcs and the final state, the offsets of the outgoing arcs of
+ *   each states, and the arcs themselves with their target state, labels ids
+ *   and score in compressed sparse rows. Like for text files, the score become
+ *   the first real value of the arc if they are enabled. At the end of the
+ *   file, this return NULL with errno set to zero, else on error errno is set
+ *   appropriately. The counts and lengths read are bounded by [DAT_MAXBIN] so
+ *   a corrupted file cannot make the sizes overflow.
+ */
+static
+fst_t *dat_readbin(FILE *file, dat_tbl_t *tbl, mdl_t *mdl) {
+	uint32_t hdr[3];
+	errno = 0;
+	if (!dat_readu32(file, hdr, 1))
+		return NULL;
+	errno = EZEPFMT;
+	for (uint32_t i = 0; i < hdr[0]; i++) {
+		uint32_t len;
+		if (!dat_readu32(file, &len, 1) || len > DAT_MAXBIN)
+			return NULL;
+		if (tbl->cnt == tbl->size) {
+			const int size = tbl->size == 0 ? 1024 : tbl->size * 2;
+			char  **str = realloc(tbl->str, sizeof(char *) * size);
+			if (str != NULL)
+				tbl->str = str;
+			lbl_t **src = realloc(tbl->src, sizeof(lbl_t *) * size);
+			if (src != NULL)
+				tbl->src = src;
+			lbl_t **trg = realloc(tbl->trg, sizeof(lbl_t *) * size);
+			if (trg != NULL)
+				tbl->trg = trg;
+			if (str == NULL || src == NULL || trg == NULL) {
+				errno = ENOMEM;
+				return NULL;
+			}
+			tbl->size = size;
+		}
+		char *str = malloc(len + 1);
+		if (str == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		if (fread(str, 1, len, file) != len) {
+			free(str);
+			return NULL;
+		}
+		str[len] = '\0';
+		tbl->str[tbl->cnt] = str;
+		tbl->src[tbl->cnt] = NULL;
+		tbl->trg[tbl->cnt] = NULL;
+		tbl->cnt++;
+	}
+	if (!dat_readu32(file, hdr, 3))
+		return NULL;
+	const uint32_t S = hdr[0], A = hdr[1];
+	if (S < 2 || A == 0 || hdr[2] >= S || S > DAT_MAXBIN || A > DAT_MAXBIN)
+		return NULL;
+	uint32_t *off = malloc(sizeof(uint32_t) * (S + 1));
+	uint32_t *raw = malloc(sizeof(uint32_t) * 4 * A);
+	fst_t *fst = fst_new();
+	if (fst == NULL) {
+		free(off);
+		free(raw);
+		return NULL;
+	}
+	fst->arcs = malloc(sizeof(arc_t) * A);
+	if (off == NULL || raw == NULL || fst->arcs == NULL) {
+		errno = ENOMEM;
+		goto error;
+	}
+	if (!dat_readu32(file, off, S + 1))
+		goto error;
+	if (!dat_readu32(file, raw, 4 * A))
+		goto error;
+	if (off[0] != 0 || off[S] != A)
+		goto error;
+	fst->mult    = 0.0;
+	fst->nstates = S;
+	fst->final   = hdr[2];
+	for (uint32_t s = 0; s < S; s++) {
+		if (off[s] > off[s + 1])
+			goto error;
+		for (uint32_t a = off[s]; a < off[s + 1]; a++) {
+			const uint32_t *rec = raw + a * 4;
+			if (rec[0] >= S || rec[1] >= (uint32_t)tbl->cnt
+			                || rec[2] >= (uint32_t)tbl->cnt)
+				goto error;
+			const uint32_t li = rec[1], lo = rec[2];
+			if (tbl->src[li] == NULL)
+				tbl->src[li] = mdl_mapsrc(mdl, tbl->str[li]);
+			if (tbl->trg[lo] == NULL)
+				tbl->trg[lo] = mdl_maptrg(mdl, tbl->str[lo]);
+			float sc;
+			memcpy(&sc, &rec[3], sizeof(float));
+			arc_t *arc = &fst->arcs[fst->narcs++];
+			arc->src  = s;
+			arc->trg  = rec[0];
+			arc->ilbl = tbl->src[li];
+			arc->olbl = tbl->trg[lo];
+			for (int r = 0; r < MAX_REAL; r++)
+				arc->wgh[r] = 0.0;
+			if (MAX_REAL > 0)
+				arc->wgh[0] = sc;
+		}
 	}
+	if (fst_addchain(fst))
+		fst->path = fst->narcs == fst->nstates - 1;
+	free(off);
+	free(raw);
+	return fst;
+    error:
+	free(off);
+	free(raw);
+	fst_free(fst);
 	return NULL;
 }
 
@@ -2240,6 +2911,8 @@ fst_t *dat_parse(char **lns, mdl_t *mdl) {
  *   acceptors. If the multiplier is not zero, the default one is overriden with
  *   the providen one. On success, return 0, else return an approximate line
  *   number where the error was encountered.
+ *   Files starting with [DAT_MAGIC] are binary spaces as dumped by the decoder
+ *   and for them the number of the FST is returned on error instead.
  */
 int dat_load(dat_t *dat, const char *fn, mdl_t *mdl, float mult, int ticks) {
 	prg_t *prg = prg_new(ticks);
@@ -2247,26 +2920,44 @@ int dat_load(dat_t *dat, const char *fn, mdl_t *mdl, float mult, int ticks) {
 	FILE *file = fopen(fn, "r");
 	if (file == NULL)
 		return 1;
-	int ln = 1;
+	char mgc[sizeof(DAT_MAGIC) - 1];
+	const int bin = fread(mgc, 1, sizeof(mgc), file) == sizeof(mgc)
+	             && !memcmp(mgc, DAT_MAGIC, sizeof(mgc));
+	if (!bin)
+		rewind(file);
+	dat_tbl_t tbl = {0, 0, NULL, NULL, NULL};
+	int ln = 1, res = 0;
 	prg_start(prg);
 	while (!feof(file)) {
-		char **lns = str_readeos(file);
-		if (lns == NULL)
+		fst_t *fst = NULL;
+		if (bin) {
+			fst = dat_readbin(file, &tbl, mdl);
+			if (fst == NULL && errno == 0)
+				break;
+		} else {
+			char **lns = str_readeos(file);
+			if (lns == NULL)
+				break;
+			fst = dat_parse(lns, mdl);
+			for (int i = 0; lns[i] != NULL; i++, ln++)
+				free(lns[i]);
+			free(lns);
+		}
+		if (fst == NULL) {
+			res = ln;
 			break;
-		fst_t *fst = dat_parse(lns, mdl);
+		}
+		if (bin)
+			ln++;
 		fst->mult = mult;
-		for (int i = 0; lns[i] != NULL; i++, ln++)
-			free(lns[i]);
-		free(lns);
-		if (fst == NULL)
-			return ln;
 		if (dat->nfst == dat->sfst) {
 			int size = dat->sfst == 0 ? 128 : dat->sfst * 2;
 			fst_t **tmp = realloc(dat->fst, sizeof(fst_t *) * size);
 			if (tmp == NULL) {
-				free(fst);
+				fst_free(fst);
 				errno = ENOMEM;
-				return ln;
+				res = ln;
+				break;
 			}
 			dat->sfst = size;
 			dat->fst  = tmp;
@@ -2274,8 +2965,157 @@ int dat_load(dat_t *dat, const char *fn, mdl_t *mdl, float mult, int ticks) {
 		dat->fst[dat->nfst++] = fst;
 		prg_next(prg);
 	}
-	prg_end(prg);
-	return 0;
+	// Cleanup is the same on success and on error, but in the later case
+	// errno must be preserved for the caller.
+	const int err = errno;
+	if (res == 0)
+		prg_end(prg);
+	prg_free(prg);
+	for (int i = 0; i < tbl.cnt; i++)
+		free(tbl.str[i]);
+	free(tbl.str);
+	free(tbl.src);
+	free(tbl.trg);
+	fclose(file);
+	errno = err;
+	return res;
+}
+
+/* dat_shard:
+ *   Keep only the part of a training dataset owned by process [rank] out of
+ *   [size]. Spaces and references are numbered separately so the i-th space
+ *   stay with the i-th reference, and the samples are dealt in turn to each
+ *   process. The other FSTs are freed.
+ */
+static
+void dat_shard(dat_t *dat, int rank, int size) {
+	int ns = 0, nr = 0, n = 0;
+	for (int i = 0; i < dat->nfst; i++) {
+		fst_t *fst = dat->fst[i];
+		const int idx = fst->mult > 0.0 ? ns++ : nr++;
+		if (idx % size == rank)
+			dat->fst[n++] = fst;
+		else
+			fst_free(fst);
+	}
+	dat->nfst = n;
+	free(dat->bat);  dat->bat  = NULL;
+	free(dat->bidx); dat->bidx = NULL;
+	dat->nbat = dat->bwin = 0;
+}
+
+typedef struct {fst_t *fst; int idx;} dat_ent_t;
+
+/* dat_cmpshape:
+ *   Comparison function for sorting FSTs by shape: first the linear chains
+ *   before the other FSTs, next by number of positions and by number of labels
+ *   at each position. Equal shapes are kept in input order.
+ */
+static
+int dat_cmpshape(const void *a, const void *b) {
+	const dat_ent_t *ea = a, *eb = b;
+	const fst_t *fa = ea->fst, *fb = eb->fst;
+	int res = (fa->cpos == NULL) - (fb->cpos == NULL);
+	if (res == 0 && fa->cpos != NULL) {
+		res = fa->nstates - fb->nstates;
+		if (res == 0)
+			res = memcmp(fa->cpos, fb->cpos,
+				sizeof(int) * fa->nstates);
+	}
+	if (res == 0)
+		res = ea->idx - eb->idx;
+	return res;
+}
+
+/* dat_addbatch:
+ *   Group the FSTs of the dataset in batches of at most [DAT_LANES] linear
+ *   chains of the same shape so they can be processed together with one FST
+ *   per vector lane. Other FSTs go in batches of their own.
+ *   The grouping is done independently inside windows of [win] consecutive
+ *   FSTs, so a caller who has to produce results in order, like the decoder,
+ *   only need to keep a window of FSTs in memory. On success, the batch [ib]
+ *   is made of the FSTs bidx[bat[ib]..bat[ib + 1]) and the batches of each
+ *   window are consecutive.
+ *   The batches are kept until the window or the number of FSTs change, a
+ *   caller replacing FSTs in place must reset [bwin] to build them again.
+ */
+#define DAT_LANES 8
+static
+int dat_addbatch(dat_t *dat, int win) {
+	assert(dat != NULL && win > 0);
+	if (dat->bat != NULL && dat->bwin == win && dat->bfst == dat->nfst)
+		return 1;
+	free(dat->bat);  dat->bat  = NULL;
+	free(dat->bidx); dat->bidx = NULL;
+	const int N = dat->nfst;
+	dat_ent_t *ent = malloc(sizeof(dat_ent_t) * max(N, 1));
+	int *bat  = malloc(sizeof(int) * (N + 1));
+	int *bidx = malloc(sizeof(int) * max(N, 1));
+	if (ent == NULL || bat == NULL || bidx == NULL) {
+		free(ent); free(bat); free(bidx);
+		errno = ENOMEM;
+		return 0;
+	}
+	int nb = 0;
+	for (int w = 0; w < N; w += win) {
+		const int W = min(N - w, win);
+		for (int i = 0; i < W; i++) {
+			ent[i].fst = dat->fst[w + i];
+			ent[i].idx = w + i;
+		}
+		qsort(ent, W, sizeof(dat_ent_t), dat_cmpshape);
+		// The FSTs are now sorted by shape so we just have to cut the
+		// list each time the shape change or the batch is full.
+		for (int i = 0, cnt = 0; i < W; i++) {
+			const fst_t *f = ent[i].fst, *p = ent[i - cnt].fst;
+			int same = cnt != 0 && cnt < DAT_LANES;
+			same = same && f->cpos != NULL && p->cpos != NULL;
+			same = same && f->nstates == p->nstates;
+			same = same && !memcmp(f->cpos, p->cpos,
+			                       sizeof(int) * f->nstates);
+			if (!same)
+				bat[nb++] = w + i, cnt = 0;
+			bidx[w + i] = ent[i].idx;
+			cnt++;
+		}
+	}
+	bat[nb] = N;
+	free(ent);
+	dat->nbat = nb;
+	dat->bwin = win;
+	dat->bfst = N;
+	dat->bat  = bat;
+	dat->bidx = bidx;
+	return 1;
+}
+
+/* dat_pair:
+ *   Pair the i-th space of the dataset with the i-th reference, whatever the
+ *   files they come from, and store in [ref] the index of the reference paired
+ *   with each space or -1 for the other FSTs. If the numbers of spaces and of
+ *   references differ, nothing is paired and false is returned.
+ */
+static
+int dat_pair(const dat_t *dat, int ref[]) {
+	const int N = dat->nfst;
+	int ns = 0, nr = 0;
+	for (int i = 0; i < N; i++) {
+		ref[i] = -1;
+		if (dat->fst[i]->mult > 0.0)
+			ns++;
+		else if (dat->fst[i]->mult < 0.0)
+			nr++;
+	}
+	if (ns != nr)
+		return 0;
+	for (int i = 0, r = 0; i < N; i++) {
+		if (dat->fst[i]->mult <= 0.0)
+			continue;
+		while (dat->fst[r]->mult >= 0.0)
+			r++;
+		ref[i] = r++;
+	}
+	return 1;
 }
 
 /*******************************************************************************
@@ -2296,8 +3136,8 @@ struct pat_s {
 typedef struct gen_s gen_t;
 struct gen_s {
 	ssp_t  *ssp;
-	int     nupat,   nbpat;
-	pat_t **lupat, **lbpat;
+	int     nupat,   nbpat,   nlpat;
+	pat_t **lupat, **lbpat, **llpat;
 	hsh_t   htrue,   hfalse;
 	int     onref;
 };
@@ -2313,6 +3153,8 @@ gen_t *gen_new(ssp_t *ssp, int onref) {
 	gen->lupat  = NULL;
 	gen->nbpat  = 0;
 	gen->lbpat  = NULL;
+	gen->nlpat  = 0;
+	gen->llpat  = NULL;
 	gen->htrue  = ssp_string(ssp, "true", 0);
 	gen->hfalse = ssp_string(ssp, "false", 0);
 	gen->onref  = onref;
@@ -2329,13 +3171,17 @@ void gen_free(gen_t *gen) {
 	for (int i = 0; i < gen->nbpat; i++)
 		free(gen->lbpat[i]);
 	free(gen->lbpat);
+	for (int i = 0; i < gen->nlpat; i++)
+		free(gen->llpat[i]);
+	free(gen->llpat);
 	free(gen);
 }
 
 /* gen_addpat:
  *   Add a new pattern in the generator, return false in case of syntactic
  *   error. This detect if the pattern in uni/bi-gram automaticaly and if it
- *   have a tag.
+ *   have a tag. The bigram patterns testing only the target labels are kept
+ *   apart as they are scored by the shared pairs of the model.
  */
 int gen_addpat(gen_t *gen, const char *str) {
 	int tag = 0, pos;
@@ -2405,10 +3251,18 @@ int gen_addpat(gen_t *gen, const char *str) {
 		p[0] = p[1];
 		p[1] = 0;
 	}
+	int trg = 1;
+	for (int i = 0; i < cnt; i++)
+		if (!pat->itm[i].s1 || pat->itm[i].s2 == 0)
+			trg = 0;
 	if (p[1] == 0) {
 		gen->nupat += 1;
 		gen->lupat = realloc(gen->lupat, sizeof(pat_t *) * gen->nupat);
 		gen->lupat[gen->nupat - 1] = pat;
+	} else if (trg) {
+		gen->nlpat += 1;
+		gen->llpat = realloc(gen->llpat, sizeof(pat_t *) * gen->nlpat);
+		gen->llpat[gen->nlpat - 1] = pat;
 	} else {
 		gen->nbpat += 1;
 		gen->lbpat = realloc(gen->lbpat, sizeof(pat_t *) * gen->nbpat);
@@ -2439,11 +3293,12 @@ void gen_ftralloc(gen_t *gen, fst_t *fst) {
 		state_t *nd = &fst->states[is];
 		const int NI = nd->icnt;
 		const int NO = nd->ocnt;
-		ptr += NI * 2 + NI * NO;
+		ptr += NI * 3 + NI * NO * 2;
 		nb  += NI * NO;
 	}
+	const int nbp = gen->nbpat + gen->nlpat;
 	const int cnt = nu + nb;
-	const int ftr = nu * gen->nupat + nb * gen->nbpat;
+	const int ftr = nu * gen->nupat + nb * nbp;
 	void  **rp = malloc(sizeof(void  *) * ptr);
 	int    *rc = malloc(sizeof(int    ) * cnt);
 	ftr_t **rf = malloc(sizeof(ftr_t *) * ftr);
@@ -2465,13 +3320,16 @@ void gen_ftralloc(gen_t *gen, fst_t *fst) {
 		const int NO = nd->ocnt;
 		nd->bcnt = (int     **)rp; rp += NI;
 		nd->blst = (ftr_t ****)rp; rp += NI;
+		nd->bpr  = (pair_t ***)rp; rp += NI;
 		for (int ni = 0; ni < NI; ni++) {
 			nd->bcnt[ni] = (int     *)rc; rc += NO;
 			nd->blst[ni] = (ftr_t ***)rp; rp += NO;
+			nd->bpr[ni]  = (pair_t **)rp; rp += NO;
 			for (int no = 0; no < NO; no++) {
 				nd->bcnt[ni][no] = 0;
 				nd->blst[ni][no] = rf;
-				rf += gen->nbpat;
+				nd->bpr[ni][no]  = NULL;
+				rf += nbp;
 			}
 		}
 	}
@@ -2502,12 +3360,42 @@ hsh_t gen_get(gen_t *gen, itm_t *itm, lbl_t *lbl[]) {
 	else          return gen->hfalse;
 }
 
-/* gen_uftr:
+/* gen_ftr:
+ *   Return the feature of the pattern for the given label array, or NULL if it
+ *   cannot be added to the model.
+ */
+static inline
+ftr_t *gen_ftr(gen_t *gen, mdl_t *mdl, pat_t *pat, lbl_t *lbl[], int frq) {
+	hsh_t hsh[pat->cnt + 1];
+	hsh[0] = pat->id;
+	int off = hsh[0] != 0;
+	for (int j = 0; j < pat->cnt; j++)
+		hsh[j + off] = gen_get(gen, &pat->itm[j], lbl);
+	return mdl_addftr(mdl, pat->tag, pat->cnt + off, hsh, frq);
+}
+
+/* gen_uftr:
  *   Generate the unigram feature list for the given label array.
  */
 static
 int gen_uftr(gen_t *gen, mdl_t *mdl, lbl_t *lbl[], ftr_t *lst[], int frq) {
 	int cnt = 0;
+	for (int i = 0; i < gen->nupat; i++) {
+		ftr_t *ftr = gen_ftr(gen, mdl, gen->lupat[i], lbl, frq);
+		if (ftr != NULL)
+			lst[cnt++] = ftr;
+	}
+	return cnt;
+}
+
+/* gen_uscr:
+ *   Return the sum of the weights of the unigram features for the given label
+ *   array. The features are only searched in the model, so unseen ones are not
+ *   added and just have a null weight.
+ */
+static
+double gen_uscr(gen_t *gen, const mdl_t *mdl, lbl_t *lbl[]) {
+	double scr = 0.0;
 	for (int i = 0; i < gen->nupat; i++) {
 		pat_t *pat = gen->lupat[i];
 		hsh_t hsh[pat->cnt + 1];
@@ -2515,45 +3403,129 @@ int gen_uftr(gen_t *gen, mdl_t *mdl, lbl_t *lbl[], ftr_t *lst[], int frq) {
 		int off = hsh[0] != 0;
 		for (int j = 0; j < pat->cnt; j++)
 			hsh[j + off] = gen_get(gen, &pat->itm[j], lbl);
-		ftr_t *ftr;
-		ftr = mdl_addftr(mdl, pat->tag, pat->cnt + off, hsh, frq);
+		const hsh_t idx = mdl_ftrid(pat->tag, pat->cnt + off, hsh);
+		const ftr_t *ftr = map_find(mdl->ftrs, idx);
 		if (ftr != NULL)
-			lst[cnt++] = ftr;
+			scr += ftr->x;
 	}
-	return cnt;
+	return scr;
 }
 
 /* gen_bftr:
- *   Generate the bigram feature list for the given label array.
+ *   Generate the bigram feature list for the given label array. The label-only
+ *   patterns are included only if [all] is true, else they are left to the
+ *   shared pairs.
  */
 static
-int gen_bftr(gen_t *gen, mdl_t *mdl, lbl_t *lbl[], ftr_t *lst[], int frq) {
+int gen_bftr(gen_t *gen, mdl_t *mdl, lbl_t *lbl[], ftr_t *lst[], int frq,
+		int all) {
 	int cnt = 0;
 	for (int i = 0; i < gen->nbpat; i++) {
-		pat_t *pat = gen->lbpat[i];
-		hsh_t hsh[pat->cnt + 1];
-		hsh[0] = pat->id;
-		int off = hsh[0] != 0;
-		for (int j = 0; j < pat->cnt; j++)
-			hsh[j + off] = gen_get(gen, &pat->itm[j], lbl);
-		ftr_t *ftr;
-		ftr = mdl_addftr(mdl, pat->tag, pat->cnt + off, hsh, frq);
+		ftr_t *ftr = gen_ftr(gen, mdl, gen->lbpat[i], lbl, frq);
+		if (ftr != NULL)
+			lst[cnt++] = ftr;
+	}
+	for (int i = 0; all && i < gen->nlpat; i++) {
+		ftr_t *ftr = gen_ftr(gen, mdl, gen->llpat[i], lbl, frq);
 		if (ftr != NULL)
 			lst[cnt++] = ftr;
 	}
 	return cnt;
 }
 
+/* gen_pfill:
+ *   Try to fill the empty slots of a shared pair and sum again its score. This
+ *   must only be done by a thread owning the pair.
+ */
+static
+void gen_pfill(gen_t *gen, mdl_t *mdl, pair_t *pr) {
+	lbl_t *lbl[4] = {NULL, pr->trg[0], NULL, pr->trg[1]};
+	double psi = 0.0;
+	int miss = 0;
+	for (int i = 0; i < pr->cnt; i++) {
+		if (pr->ftr[i] == NULL)
+			pr->ftr[i] = gen_ftr(gen, mdl, gen->llpat[i], lbl, 0);
+		if (pr->ftr[i] == NULL)
+			miss++;
+		else
+			psi += pr->ftr[i]->x;
+	}
+	pr->psi  = psi;
+	pr->miss = miss;
+}
+
+/* gen_pair:
+ *   Return the shared pair for the target labels of the given label array. On
+ *   first encounter it is built with all its features before being inserted in
+ *   the model so other threads never see it partially filled.
+ */
+static
+pair_t *gen_pair(gen_t *gen, mdl_t *mdl, lbl_t *lbl[], int frq) {
+	const hsh_t key[2] = {lbl[1]->raw, lbl[3]->raw};
+	const hsh_t idx = hsh_buffer(key, sizeof(key));
+	pair_t *pr = map_find(mdl->pair, idx);
+	if (pr == NULL) {
+		const int n = gen->nlpat;
+		pair_t *tmp = malloc(sizeof(pair_t) + sizeof(ftr_t *) * n);
+		if (tmp == NULL)
+			fatal("out of memory");
+		tmp->trg[0] = lbl[1];
+		tmp->trg[1] = lbl[3];
+		tmp->g      = 0.0;
+		tmp->frq    = 0;
+		tmp->cnt    = n;
+		for (int i = 0; i < n; i++)
+			tmp->ftr[i] = NULL;
+		gen_pfill(gen, mdl, tmp);
+		pr = map_insert(mdl->pair, idx, tmp);
+		if (pr != tmp)
+			free(tmp);
+	}
+	if (frq)
+		atm_add(&pr->frq, 1);
+	return pr;
+}
+
+/* gen_pupd:
+ *   Prepare the shared pairs for a new gradient pass: the empty slots are
+ *   filled if their features can be created now, as a tag may be enabled by
+ *   the new iteration, and the scores are summed again. This must be called
+ *   when no other thread use the pairs.
+ */
+static
+void gen_pupd(gen_t *gen, mdl_t *mdl) {
+	pair_t *pr = map_next(mdl->pair, NULL);
+	for ( ; pr != NULL; pr = map_next(mdl->pair, pr))
+		if (pr->miss != 0)
+			gen_pfill(gen, mdl, pr);
+	mdl_pairupd(mdl);
+}
+
+/* gen_getfrq:
+ *   Return true if the features generated on the given FST should be counted
+ *   for the frequency filter. This depend on the kind of FST and on the side
+ *   selected for counting.
+ */
+static
+int gen_getfrq(const gen_t *gen, const fst_t *fst) {
+	if (fst->mult < 0 &&  gen->onref) return 1;
+	if (fst->mult > 0 && !gen->onref) return 1;
+	return 0;
+}
+
 /* gen_addftr:
  *   Add features list on the given FST. This can be costly but also take quite
  *   some memory, so there is a tradeoff in generating them at each iterations.
  *   Remember that they should be regenerated if some features are removed from
  *   the model.
+ *   The label-only bigram features go through the shared pairs except for the
+ *   stochastic optimizer which need all the used features to be touched by the
+ *   generator at each mini-batch. The lists are always generated again even if
+ *   they are cached, so they never keep pairs dropped since the last call.
  */
 void gen_addftr(gen_t *gen, mdl_t *mdl, fst_t *fst) {
-	int frq = 0;
-	if (fst->mult < 0 &&  gen->onref) frq = 1;
-	if (fst->mult > 0 && !gen->onref) frq = 1;
+	const int frq = gen_getfrq(gen, fst);
+	const int shr = gen->nlpat != 0 && mdl->stp == 0;
 	gen_ftralloc(gen, fst);
 	for (int ia = 0; ia < fst->narcs; ia++) {
 		arc_t  *a  = &fst->arcs[ia];
@@ -2569,18 +3541,653 @@ void gen_addftr(gen_t *gen, mdl_t *mdl, fst_t *fst) {
 			lbl_t *lbl[4] = {
 				ai->ilbl, ai->olbl,
 				ao->ilbl, ao->olbl};
+			// Pairs of labels unknown to a frozen model are not
+			// shared so they don't grow it.
+			const int sp = shr && !ai->olbl->tmp && !ao->olbl->tmp;
+			pair_t *pr = sp ? gen_pair(gen, mdl, lbl, frq) : NULL;
 			ftr_t **lst = s->blst[ii][io];
-			s->bcnt[ii][io] = gen_bftr(gen, mdl, lbl, lst, frq);
+			s->bcnt[ii][io] = gen_bftr(gen, mdl, lbl, lst, frq,
+				pr == NULL);
+			s->bpr[ii][io] = pr;
+		}
+		}
+	}
+}
+
+
+/*******************************************************************************
+ * Vectorized math kernels
+ *
+ *   The forward-backward and the expectations computation spend most of their
+ *   time in exp and log calls over the incoming or outgoing arcs of a state.
+ *   Here we provide kernels working on a full row of values at once: a vector
+ *   exponential and a log-sum-exp reduction.
+ *
+ *   The kernels are written once with the GCC vector extensions and compiled
+ *   for several vector width: SSE2 which is the x86-64 baseline, AVX2, and
+ *   AVX-512. The best one supported by the CPU is selected at startup by the
+ *   [vec_init] function, other architectures use the plain scalar code.
+ *
+ *   The exponential use the classical Cody-Waite range reduction followed by a
+ *   polynomial approximation. The accurate version is within a couple of ulp
+ *   of the libm one, the fast version use a shorter polynomial with a relative
+ *   error bounded by about 2e-7 which is more than enough for training.
+ *
+ *   The result is scaled by building 2^n directly, so this is only valid while
+ *   n stay in the normal exponents range [-1022,1023]. Out of it, the values
+ *   which underflow to zero or overflow to infinity are set directly, and the
+ *   few ones left, giving subnormals or the last finite values, are computed
+ *   by the libm, except in the log-sum-exp where they cannot change the sum.
+ *
+ *   The results are not bitwise identical to the scalar code: the rows are
+ *   summed in another order and the exponentials can differ by a few ulp. The
+ *   training can so take a slightly different path, for example when the
+ *   gradient of a feature is exactly on its l1 threshold at the first step.
+ ******************************************************************************/
+
+#define VEC_LOG2E  1.44269504088896340736
+#define VEC_LN2HI  6.93147180369123816490e-01
+#define VEC_LN2LO  1.90821492927058770002e-10
+#define VEC_MAGIC  6755399441055744.0
+#define VEC_EXPMIN (-1022.0 * VEC_LN2HI)
+#define VEC_EXPMAX ( 1023.0 * VEC_LN2HI)
+#define VEC_EXPUFL -746.0
+#define VEC_EXPOFL  710.0
+
+/* vec_t:
+ *   The dispatch table of the kernels. This is filled once by [vec_init] before
+ *   any computation and then only read so it can be shared by all threads.
+ */
+typedef struct vec_s vec_t;
+struct vec_s {
+	const char *name;
+	int         fast;
+	void      (*exp)(double *dst, const double *src, int n, int fast);
+	double    (*lse)(const double *src, int n, int fast);
+};
+
+/* vec_scl*:
+ *   Scalar version of the kernels used when no vector unit is available. These
+ *   are also the reference for the accuracy of the vectorized ones.
+ */
+static
+void vec_sclexp(double *dst, const double *src, int n, int fast) {
+	for (int i = 0; i < n; i++)
+		dst[i] = exp(src[i]);
+	(void)fast;
+}
+static
+double vec_scllse(const double *src, int n, int fast) {
+	double m = -DBL_MAX;
+	for (int i = 0; i < n; i++)
+		if (src[i] > m)
+			m = src[i];
+	if (m == -DBL_MAX)
+		return -DBL_MAX;
+	double sum = 0.0;
+	for (int i = 0; i < n; i++)
+		sum += exp(src[i] - m);
+	return m + log(sum);
+	(void)fast;
+}
+
+#if defined(__x86_64) && defined(__GNUC__)
+
+/* VEC_KERNELS:
+ *   Instantiate the vector kernels for a given vector width [W] in number of
+ *   doubles and a given target. The body is the same for all widths, only the
+ *   compiler is allowed to use different instructions sets.
+ *   The tail of the rows is handled by copying it in a padded temporary vector
+ *   so we never read or write out of the given arrays.
+ */
+#define VEC_KERNELS(SFX, W, TGT)                                               \
+typedef double  vd_##SFX __attribute__((vector_size(W * 8)));                  \
+typedef int64_t vi_##SFX __attribute__((vector_size(W * 8)));                  \
+                                                                               \
+__attribute__((target(TGT))) static inline                                     \
+vd_##SFX vec_sel_##SFX(vi_##SFX m, vd_##SFX a, vd_##SFX b) {                   \
+	return (vd_##SFX)(((vi_##SFX)a & m) | ((vi_##SFX)b & ~m));             \
+}                                                                              \
+                                                                               \
+__attribute__((target(TGT), noinline, cold)) static                            \
+vd_##SFX vec_slow_##SFX(vd_##SFX p, vd_##SFX x, vi_##SFX m) {                  \
+	for (int j = 0; j < W; j++)                                            \
+		if (m[j])                                                      \
+			p[j] = exp(x[j]);                                      \
+	return p;                                                              \
+}                                                                              \
+                                                                               \
+__attribute__((target(TGT))) static inline                                     \
+vd_##SFX vec_exp1_##SFX(vd_##SFX x, int fast, int edge) {                      \
+	const vd_##SFX z = {0}, x0 = x;                                        \
+	const vi_##SFX lo = x < VEC_EXPMIN, hi = x > VEC_EXPMAX;               \
+	x = vec_sel_##SFX(lo, z + VEC_EXPMIN, x);                              \
+	x = vec_sel_##SFX(hi, z + VEC_EXPMAX, x);                              \
+	/* Range reduction: x = n * ln(2) + r with |r| <= ln(2) / 2. The    */ \
+	/* rounding of n is done with the magic number trick so the integer */ \
+	/* value is directly available in the low bits of t.               */ \
+	const vd_##SFX t = x * VEC_LOG2E + VEC_MAGIC;                          \
+	const vd_##SFX k = t - VEC_MAGIC;                                      \
+	const vd_##SFX r = x - k * VEC_LN2HI - k * VEC_LN2LO;                  \
+	vd_##SFX p;                                                            \
+	if (fast) {                                                            \
+		p = z +     1.0 / 720.0;                                       \
+		p = p * r + 1.0 / 120.0;                                       \
+		p = p * r + 1.0 / 24.0;                                        \
+		p = p * r + 1.0 / 6.0;                                         \
+		p = p * r + 1.0 / 2.0;                                         \
+		p = p * r + 1.0;                                               \
+		p = p * r + 1.0;                                               \
+	} else {                                                               \
+		p = z +     1.0 / 6227020800.0;                                \
+		p = p * r + 1.0 / 479001600.0;                                 \
+		p = p * r + 1.0 / 39916800.0;                                  \
+		p = p * r + 1.0 / 3628800.0;                                   \
+		p = p * r + 1.0 / 362880.0;                                    \
+		p = p * r + 1.0 / 40320.0;                                     \
+		p = p * r + 1.0 / 5040.0;                                      \
+		p = p * r + 1.0 / 720.0;                                       \
+		p = p * r + 1.0 / 120.0;                                       \
+		p = p * r + 1.0 / 24.0;                                        \
+		p = p * r + 1.0 / 6.0;                                         \
+		p = p * r + 1.0 / 2.0;                                         \
+		p = p * r + 1.0;                                               \
+		p = p * r + 1.0;                                               \
+	}                                                                      \
+	/* Scale by 2^n by building the double directly from its bits, the */ \
+	/* clamping above ensure the exponent is never out of range.        */ \
+	const vd_##SFX mg = z + VEC_MAGIC;                                     \
+	const vi_##SFX n  = (vi_##SFX)t - (vi_##SFX)mg;                        \
+	p = p * (vd_##SFX)((n + 1023) << 52);                                  \
+	p = vec_sel_##SFX(x0 < VEC_EXPUFL, z, p);                              \
+	p = vec_sel_##SFX(x0 > VEC_EXPOFL, z + HUGE_VAL, p);                   \
+	/* The clamped values still representable go to the libm.          */ \
+	const vi_##SFX sl = (lo | hi) & (x0 >= VEC_EXPUFL)                     \
+	                              & (x0 <= VEC_EXPOFL), zi = {0};          \
+	if (edge && __builtin_expect(memcmp(&sl, &zi, sizeof(sl)) != 0, 0))    \
+		p = vec_slow_##SFX(p, x0, sl);                                 \
+	return vec_sel_##SFX(x0 == x0, p, x0);                                 \
+}                                                                              \
+                                                                               \
+__attribute__((target(TGT))) static                                            \
+void vec_exp_##SFX(double *dst, const double *src, int n, int fast) {          \
+	int i = 0;                                                             \
+	for ( ; i + W <= n; i += W) {                                          \
+		vd_##SFX x;                                                    \
+		memcpy(&x, src + i, sizeof(x));                                \
+		x = vec_exp1_##SFX(x, fast, 1);                                \
+		memcpy(dst + i, &x, sizeof(x));                                \
+	}                                                                      \
+	if (i < n) {                                                           \
+		vd_##SFX x = {0};                                              \
+		memcpy(&x, src + i, sizeof(double) * (n - i));                 \
+		x = vec_exp1_##SFX(x, fast, 1);                                \
+		memcpy(dst + i, &x, sizeof(double) * (n - i));                 \
+	}                                                                      \
+}                                                                              \
+                                                                               \
+__attribute__((target(TGT))) static                                            \
+double vec_lse_##SFX(const double *src, int n, int fast) {                     \
+	if (n == 1)                                                            \
+		return src[0];                                                 \
+	/* First pass, search for the maximum value so the exponentials  */   \
+	/* can be safely computed relative to it.                         */   \
+	const vd_##SFX z = {0};                                                \
+	vd_##SFX vm = z - DBL_MAX, x;                                          \
+	int i = 0;                                                             \
+	for ( ; i + W <= n; i += W) {                                          \
+		memcpy(&x, src + i, sizeof(x));                                \
+		vm = vec_sel_##SFX(x > vm, x, vm);                             \
+	}                                                                      \
+	double m = -DBL_MAX;                                                   \
+	for (int j = 0; j < W; j++)                                            \
+		m = max(m, vm[j]);                                             \
+	for (int j = i; j < n; j++)                                            \
+		m = max(m, src[j]);                                            \
+	if (m == -DBL_MAX)                                                     \
+		return -DBL_MAX;                                               \
+	/* Second pass, sum the exponentials. The padding of the tail use */  \
+	/* the log(0) value which give zero terms. As the sum is at least  */  \
+	/* one, the subnormal terms are not worth the libm.                */  \
+	vd_##SFX vs = {0};                                                     \
+	for (i = 0; i + W <= n; i += W) {                                      \
+		memcpy(&x, src + i, sizeof(x));                                \
+		vs += vec_exp1_##SFX(x - m, fast, 0);                          \
+	}                                                                      \
+	if (i < n) {                                                           \
+		x = z - DBL_MAX;                                               \
+		memcpy(&x, src + i, sizeof(double) * (n - i));                 \
+		vs += vec_exp1_##SFX(x - m, fast, 0);                          \
+	}                                                                      \
+	double sum = 0.0;                                                      \
+	for (int j = 0; j < W; j++)                                            \
+		sum += vs[j];                                                  \
+	return m + log(sum);                                                   \
+}
+
+VEC_KERNELS(sse2,   2, "sse2")
+VEC_KERNELS(avx2,   4, "avx2")
+VEC_KERNELS(avx512, 8, "avx512f")
+
+#endif
+
+static vec_t vec = {"scalar", 0, vec_sclexp, vec_scllse};
+
+/* vec_init:
+ *   Select the best kernels for the current CPU. If [fast] is true, the fast
+ *   but less accurate exponential will be used by all kernels.
+ */
+static
+void vec_init(int fast) {
+#if defined(__x86_64) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		vec.name = "avx512";
+		vec.exp  = vec_exp_avx512;
+		vec.lse  = vec_lse_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		vec.name = "avx2";
+		vec.exp  = vec_exp_avx2;
+		vec.lse  = vec_lse_avx2;
+	} else {
+		vec.name = "sse2";
+		vec.exp  = vec_exp_sse2;
+		vec.lse  = vec_lse_sse2;
+	}
+#endif
+	vec.fast = fast;
+}
+
+/* vec_exp:
+ *   Compute the exponential of the [n] values of [src] and store them in [dst].
+ *   The two arrays may be the same.
+ */
+static inline
+void vec_exp(double *dst, const double *src, int n) {
+	vec.exp(dst, src, n, vec.fast);
+}
+
+/* vec_lse:
+ *   Compute the log of the sum of the exponentials of the [n] values of [src].
+ *   The log(0) value is represented by -DBL_MAX as everywhere else in the code
+ *   and is returned if all values are log(0) or if [n] is zero.
+ */
+static inline
+double vec_lse(const double *src, int n) {
+	if (n == 0)
+		return -DBL_MAX;
+	return vec.lse(src, n, vec.fast);
+}
+
+/* vec_bench:
+ *   Small micro-benchmark of the kernels against the libm. This report the
+ *   throughput of all versions and the accuracy of the vectorized ones as the
+ *   maximum relative error and ulp distance to the libm exponential.
+ */
+static
+void vec_bench(void) {
+	const int N = 4096, R = 2000;
+	static const struct {double lo, hi;} rng[] = {
+		{-20.0, 0.0}, {-700.0, 0.0}, {-20.0, 20.0},
+		{-750.0, -700.0}, {700.0, 712.0},
+	};
+	double *src = malloc(sizeof(double) * N);
+	double *ref = malloc(sizeof(double) * N);
+	double *dst = malloc(sizeof(double) * N);
+	if (src == NULL || ref == NULL || dst == NULL)
+		fatal("out of memory");
+	srand(1);
+	fprintf(stderr, "* Benchmark kernels [%s]\n", vec.name);
+	fprintf(stderr, "  - Accuracy against libm exp\n");
+	for (size_t ir = 0; ir < sizeof(rng) / sizeof(rng[0]); ir++) {
+		for (int i = 0; i < N; i++) {
+			const double u = (double)rand() / RAND_MAX;
+			src[i] = rng[ir].lo + u * (rng[ir].hi - rng[ir].lo);
+			ref[i] = exp(src[i]);
+		}
+		for (int fast = 0; fast < 2; fast++) {
+			vec.exp(dst, src, N, fast);
+			double err = 0.0, ulp = 0.0;
+			for (int i = 0; i < N; i++) {
+				if (ref[i] == 0.0 || isinf(ref[i])) {
+					if (dst[i] != ref[i])
+						err = ulp = HUGE_VAL;
+					continue;
+				}
+				const double d = fabs(dst[i] - ref[i]);
+				const double u = nextafter(ref[i], HUGE_VAL);
+				err = max(err, d / ref[i]);
+				ulp = max(ulp, d / (u - ref[i]));
+			}
+			fprintf(stderr, "\t[%7.1f,%5.1f] %s "
+				"rel=%.3e ulp=%.1f\n", rng[ir].lo, rng[ir].hi,
+				fast ? "fast" : "full", err, ulp);
+		}
+	}
+	fprintf(stderr, "  - Throughput in M values per second\n");
+	for (int i = 0; i < N; i++)
+		src[i] = -20.0 * rand() / RAND_MAX;
+	const char *lbl[] = {"libm exp", "vec exp", "vec fast exp",
+	                     "scalar lse", "vec lse", "vec fast lse"};
+	for (int k = 0; k < 6; k++) {
+		volatile double sink = 0.0;
+		const clock_t start = clock();
+		for (int r = 0; r < R; r++) {
+			switch (k) {
+				case 0: vec_sclexp(dst, src, N, 0);      break;
+				case 1: vec.exp(dst, src, N, 0);         break;
+				case 2: vec.exp(dst, src, N, 1);         break;
+				case 3: sink += vec_scllse(src, N, 0);   break;
+				case 4: sink += vec.lse(src, N, 0);      break;
+				case 5: sink += vec.lse(src, N, 1);      break;
+			}
+			sink += dst[r % N];
+		}
+		const double tm = (double)(clock() - start) / CLOCKS_PER_SEC;
+		fprintf(stderr, "\t%-14s %8.1f\n", lbl[k],
+			(double)N * R / max(tm, 1e-9) / 1e6);
+	}
+	free(src);
+	free(ref);
+	free(dst);
+}
+
+/*******************************************************************************
+ * Search space pruning
+ *
+ *   Large search spaces can be pruned once before any feature is generated on
+ *   them, so the bigram blocks of the arcs removed are never allocated. This
+ *   is a coarse pass where the arcs are scored with only the unigram features
+ *   of a first-pass model, the transitions have no score so the forward and
+ *   backward recursions work on the states instead of the arcs pairs. The arcs
+ *   with a too low posterior or rank in their source state are removed.
+ *   Removing arcs must not break the FST so the best path of the coarse model
+ *   is always kept, as well as the reference path in the training spaces, and
+ *   the arcs which are no longer on a full path are removed too.
+ ******************************************************************************/
+
+typedef struct prn_s prn_t;
+struct prn_s {
+	mdl_t *mdl;      // Model used to score the arcs
+	gen_t *gen;      // Generator for the unigram patterns
+	double post;     // Minimum posterior of the arcs kept or 0
+	int    rank;     // Maximum rank of the arcs kept in a state or 0
+	int    nth;      // Number of threads to use
+	// Work sharing between the threads
+	dat_t *dat;
+	int   *ref;      // Reference paired with each FST or -1
+	int    idx;
+	// Statistics on the pruned FSTs
+	double arcs[2];  // Number of arcs before and after pruning
+	double pair[2];  // Same for the arcs pairs of the bigram blocks
+};
+
+/* prn_mark:
+ *   Mark as kept the arcs of [fst] following the path [ref]. The path is
+ *   followed from the initial state and stop at the first arc not found.
+ */
+static
+void prn_mark(fst_t *fst, const fst_t *ref, char keep[]) {
+	int nxt[ref->nstates];
+	for (int s = 0; s < ref->nstates; s++)
+		nxt[s] = -1;
+	for (int a = 0; a < ref->narcs; a++)
+		nxt[ref->arcs[a].src] = a;
+	int s = 0;
+	for (int r = nxt[0]; r != -1; r = nxt[ref->arcs[r].trg]) {
+		const arc_t *rarc = &ref->arcs[r];
+		const state_t *st = &fst->states[s];
+		int n = 0;
+		for ( ; n < st->ocnt; n++) {
+			const arc_t *arc = &fst->arcs[st->olst[n]];
+			if (arc->ilbl == rarc->ilbl && arc->olbl == rarc->olbl)
+				break;
+		}
+		if (n == st->ocnt)
+			return;
+		keep[st->olst[n]] = 1;
+		s = fst->arcs[st->olst[n]].trg;
+	}
+}
+
+/* prn_cmp:
+ *   Comparison function to sort the arcs of a state by decreasing posterior.
+ */
+typedef struct prn_ent_s {
+	double post;
+	int    arc;
+} prn_ent_t;
+static
+int prn_cmp(const void *a, const void *b) {
+	const prn_ent_t *x = a, *y = b;
+	if (x->post != y->post)
+		return x->post < y->post ? 1 : -1;
+	return x->arc - y->arc;
+}
+
+/* prn_fst:
+ *   Prune a single FST, if [ref] is not NULL its path is kept. The FST must not
+ *   have its states lists or any other derived data, it is rebuilt with only
+ *   the arcs kept and the states still used, and the chains detected again.
+ *   If the FST cannot be sorted or the memory allocated, it is left as is.
+ */
+static
+void prn_fst(prn_t *prn, fst_t *fst, const fst_t *ref) {
+	fst_addstates(fst);
+	const int A = fst->narcs, S = fst->nstates;
+	double *val = malloc(sizeof(double) * (A * 2 + S * 3));
+	int    *ord = malloc(sizeof(int) * (S * 3 + A));
+	char   *kpt = malloc(A * 2 + S * 2);
+	if (val == NULL || ord == NULL || kpt == NULL)
+		goto done;
+	double *psi = val, *alp = psi + A;
+	double *sal = alp + A, *sbe = sal + S, *svt = sbe + S;
+	int *sbk = ord + S, *map = sbk + S, *bck = map + S;
+	char *alv = kpt + A, *rch = alv + A, *crc = rch + S;
+	if (fst_toposort(fst, ord, NULL, 0) == 0)
+		goto done;
+	// Score the arcs and do the forward and Viterbi recursions on the
+	// states in topological order.
+	for (int a = 0; a < A; a++) {
+		lbl_t *lbl[2] = {fst->arcs[a].ilbl, fst->arcs[a].olbl};
+		psi[a] = gen_uscr(prn->gen, prn->mdl, lbl);
+	}
+	for (int n = 0; n < S; n++) {
+		const int s = ord[n];
+		const state_t *st = &fst->states[s];
+		sal[s] = svt[s] = 0.0, sbk[s] = -1;
+		if (st->icnt != 0) {
+			double v[st->icnt];
+			svt[s] = -DBL_MAX;
+			for (int ni = 0; ni < st->icnt; ni++) {
+				const int a = st->ilst[ni];
+				const int p = fst->arcs[a].src;
+				v[ni] = alp[a];
+				const double vt = svt[p] + psi[a];
+				if (vt > svt[s])
+					svt[s] = vt, sbk[s] = a;
+			}
+			sal[s] = vec_lse(v, st->icnt);
+		}
+		for (int no = 0; no < st->ocnt; no++)
+			alp[st->olst[no]] = sal[s] + psi[st->olst[no]];
+	}
+	// The backward recursion in reverse order give the posteriors.
+	for (int n = S - 1; n >= 0; n--) {
+		const int s = ord[n];
+		const state_t *st = &fst->states[s];
+		sbe[s] = 0.0;
+		if (s == fst->final || st->ocnt == 0)
+			continue;
+		double v[st->ocnt];
+		for (int no = 0; no < st->ocnt; no++) {
+			const int a = st->olst[no];
+			v[no] = psi[a] + sbe[fst->arcs[a].trg];
+		}
+		sbe[s] = vec_lse(v, st->ocnt);
+	}
+	const double Z = sal[fst->final];
+	double *post = alp;
+	for (int a = 0; a < A; a++)
+		post[a] = alp[a] + sbe[fst->arcs[a].trg] - Z;
+	vec_exp(post, post, A);
+	// Select the arcs to keep: first the ones over the thresholds, next the
+	// best path and the reference.
+	for (int a = 0; a < A; a++)
+		kpt[a] = post[a] >= prn->post;
+	if (prn->rank > 0) {
+		for (int s = 0; s < S; s++) {
+			const state_t *st = &fst->states[s];
+			if (st->ocnt <= prn->rank)
+				continue;
+			prn_ent_t ent[st->ocnt];
+			for (int no = 0; no < st->ocnt; no++) {
+				const int a = st->olst[no];
+				ent[no] = (prn_ent_t){post[a], a};
+			}
+			qsort(ent, st->ocnt, sizeof(prn_ent_t), prn_cmp);
+			for (int no = prn->rank; no < st->ocnt; no++)
+				kpt[ent[no].arc] = 0;
 		}
+	}
+	for (int a = sbk[fst->final]; a != -1; a = sbk[fst->arcs[a].src])
+		kpt[a] = 1;
+	if (ref != NULL)
+		prn_mark(fst, ref, kpt);
+	// Remove the arcs not on a full path anymore: they must be reachable
+	// from the initial state and reach the final one.
+	for (int n = 0; n < S; n++) {
+		const int s = ord[n];
+		const state_t *st = &fst->states[s];
+		rch[s] = s == 0;
+		for (int ni = 0; ni < st->icnt; ni++)
+			rch[s] |= alv[st->ilst[ni]];
+		for (int no = 0; no < st->ocnt; no++)
+			alv[st->olst[no]] = rch[s] && kpt[st->olst[no]];
+	}
+	for (int n = S - 1; n >= 0; n--) {
+		const int s = ord[n];
+		const state_t *st = &fst->states[s];
+		crc[s] = s == fst->final;
+		for (int no = 0; no < st->ocnt; no++) {
+			const int a = st->olst[no];
+			alv[a] = alv[a] && crc[fst->arcs[a].trg];
+			crc[s] |= alv[a];
 		}
 	}
+	// Rebuild the FST with the arcs kept, the states are renumbered in
+	// their original order so the initial one stay the first.
+	double pair[2] = {0.0, 0.0};
+	for (int s = 0; s < S; s++) {
+		const state_t *st = &fst->states[s];
+		int ni = 0, no = 0;
+		for (int i = 0; i < st->icnt; i++)
+			ni += alv[st->ilst[i]];
+		for (int o = 0; o < st->ocnt; o++)
+			no += alv[st->olst[o]];
+		pair[0] += (double)st->icnt * st->ocnt;
+		pair[1] += (double)ni * no;
+		map[s] = -1;
+		if (s == 0 || ni + no != 0)
+			map[s] = 0;
+	}
+	int ns = 0, na = 0;
+	for (int s = 0; s < S; s++)
+		if (map[s] != -1)
+			map[s] = ns++;
+	for (int a = 0; a < A; a++)
+		if (alv[a])
+			bck[na++] = a;
+	fst_remstates(fst);
+	for (int i = 0; i < na; i++) {
+		arc_t *arc = &fst->arcs[i];
+		*arc = fst->arcs[bck[i]];
+		arc->src = map[arc->src];
+		arc->trg = map[arc->trg];
+	}
+	fst->narcs   = na;
+	fst->nstates = ns;
+	fst->final   = map[fst->final];
+	arc_t *tmp = realloc(fst->arcs, sizeof(arc_t) * na);
+	if (tmp != NULL)
+		fst->arcs = tmp;
+	free(fst->cpos);
+	fst->cpos = NULL;
+	if (fst_addchain(fst))
+		fst->path = fst->narcs == fst->nstates - 1;
+	atm_inc(&prn->arcs[0], A);
+	atm_inc(&prn->arcs[1], na);
+	atm_inc(&prn->pair[0], pair[0]);
+	atm_inc(&prn->pair[1], pair[1]);
+    done:
+	fst_remstates(fst);
+	free(val);
+	free(ord);
+	free(kpt);
 }
 
+/* prn_worker:
+ *   Prune the FSTs of the dataset in turn until all are done. The references
+ *   are never pruned.
+ */
+static
+void *prn_worker(void *ud) {
+	prn_t *prn = ud;
+	dat_t *dat = prn->dat;
+	while (1) {
+		const int i = atm_add(&prn->idx, 1) - 1;
+		if (i >= dat->nfst)
+			break;
+		if (dat->fst[i]->mult < 0.0)
+			continue;
+		const int r = prn->ref != NULL ? prn->ref[i] : -1;
+		prn_fst(prn, dat->fst[i], r != -1 ? dat->fst[r] : NULL);
+	}
+	return NULL;
+}
+
+/* prn_dat:
+ *   Prune all the spaces of a dataset using [nth] threads and report how much
+ *   of the arcs and of the bigram blocks was kept. In a training dataset, the
+ *   i-th space is paired with the i-th reference so its path is kept.
+ */
+static
+void prn_dat(prn_t *prn, dat_t *dat, const char *name) {
+	prn->ref = malloc(sizeof(int) * max(dat->nfst, 1));
+	if (prn->ref == NULL)
+		fatal("out of memory");
+	dat_pair(dat, prn->ref);
+	prn->dat = dat;
+	prn->idx = 0;
+	prn->arcs[0] = prn->arcs[1] = 0.0;
+	prn->pair[0] = prn->pair[1] = 0.0;
+	thread_t thrd[prn->nth];
+	for (int n = 0; n < prn->nth; n++)
+		thread_spawn(&thrd[n], prn_worker, prn);
+	for (int n = 0; n < prn->nth; n++)
+		thread_join(thrd[n]);
+	free(prn->ref);
+	prn->ref = NULL;
+	fprintf(stderr, "    [%s] arcs=%.2f%% pairs=%.2f%%\n", name,
+		100.0 * prn->arcs[1] / max(prn->arcs[0], 1.0),
+		100.0 * prn->pair[1] / max(prn->pair[0], 1.0));
+}
 
 /*******************************************************************************
  * Gradient computer
  ******************************************************************************/
 
+/* bms_t:
+ *   Statistics of the beam pruning: number of arcs seen and kept and the sum
+ *   over FSTs of the estimated fraction of the mass kept. They are updated
+ *   with atomic operations so can be shared by all the threads.
+ */
+typedef struct bms_s bms_t;
+struct bms_s {
+	double arcs, kept;
+	double mass, nfst;
+};
+
 typedef struct grd_s grd_t;
 struct grd_s {
 	int    nth;
@@ -2591,6 +4198,11 @@ struct grd_s {
 	mdl_t *mdl;
 	prg_t *prg;
 	int    idx;
+	int    lvl;    // Arcs threshold for the level-synchronous mode
+	double beam;   // Beam width for pruning, disabled if not positive
+	bms_t  bms;    // Beam statistics of the last computation
+	int   *ref;    // [N] Reference paired with each space for the beam
+	int    nclr;   // Pairs generation of the cached features lists
 };
 
 /* grd_new:
@@ -2601,6 +4213,10 @@ static
 grd_t *grd_new(mdl_t *mdl, gen_t *gen, dat_t *dat) {
 	grd_t *grd = malloc(sizeof(grd_t));
 	grd->nth = 1;
+	grd->lvl = 50000;
+	grd->beam = 0.0;
+	grd->ref = NULL;
+	grd->nclr = mdl->nclr;
 	grd->dat = dat;
 	grd->gen = gen;
 	grd->mdl = mdl;
@@ -2612,6 +4228,7 @@ grd_t *grd_new(mdl_t *mdl, gen_t *gen, dat_t *dat) {
  */
 static
 void grd_free(grd_t *grd) {
+	free(grd->ref);
 	free(grd);
 }
 
@@ -2637,6 +4254,10 @@ void grd_addspc(fst_t *fst) {
 	memset(rv, 0, sizeof(double) * nv);
 	fst->raw_gptr = rp;
 	fst->raw_gval = rv;
+	// Linear chains also get the dense emission, alpha, and beta arrays in
+	// position order for the dense recursions.
+	if (fst->cpos != NULL)
+		fst->raw_cval = malloc(sizeof(double) * fst->narcs * 3);
 	// Now we make a second pass on the data to build the multi-dimensional
 	// arrays from the blocks we have prepared just before.
 	for (int is = 0; is < fst->nstates; is++) {
@@ -2655,6 +4276,7 @@ static
 void grd_remspc(fst_t *fst) {
 	free(fst->raw_gptr); fst->raw_gptr = NULL;
 	free(fst->raw_gval); fst->raw_gval = NULL;
+	free(fst->raw_cval); fst->raw_cval = NULL;
 }
 
 /* grd_dopsi:
@@ -2665,7 +4287,8 @@ void grd_remspc(fst_t *fst) {
  *   features we handle. They are stored in the two *psi tables and will be
  *   grouped together later.
  *   To avoid numerical problems we will do all the computations in log-space
- *   so, here, we just skip the exponential and just compute the sums.
+ *   so, here, we just skip the exponential and just compute the sums. The
+ *   label-only part of the bigram sums is already done in the shared pairs.
  */
 static
 void grd_dopsi(const mdl_t *mdl, fst_t *fst) {
@@ -2674,7 +4297,9 @@ void grd_dopsi(const mdl_t *mdl, fst_t *fst) {
 		double sum = 0.0;
 		for (int f = 0; f < a->ucnt; f++)
 			sum += a->ulst[f]->x;
-		a->psi = sum + a->wgh[0];
+		a->psi = sum;
+		if (MAX_REAL > 0)
+			a->psi += a->wgh[0];
 		for (int i = 1; i < MAX_REAL; i++) {
 			// FIXME: hack Nicolas
 			// Only use the real features it they should be included
@@ -2687,7 +4312,8 @@ void grd_dopsi(const mdl_t *mdl, fst_t *fst) {
 		const state_t *s = &fst->states[is];
 		for (int ni = 0; ni < s->icnt; ni++) {
 		for (int no = 0; no < s->ocnt; no++) {
-			double sum = 0.0;
+			const pair_t *pr = s->bpr[ni][no];
+			double sum = pr != NULL ? pr->psi : 0.0;
 			for (int f = 0; f < s->bcnt[ni][no]; f++)
 				sum += s->blst[ni][no][f]->x;
 			s->psi[ni][no] = sum;
@@ -2696,15 +4322,78 @@ void grd_dopsi(const mdl_t *mdl, fst_t *fst) {
 	}
 }
 
-/* logsum:
- *  Compute log(exp(a) + exp(b)) while minimizing precision loss. Main use is
- *  computing the addition of two values in log-space.
+/* grd_chain:
+ *   Dense version of the forward-backward for linear chains. Here the arcs are
+ *   sorted by position so the labels of each position form a dense vector and
+ *   the bigram Ψ block of the state between two positions is a dense [NI][NO]
+ *   matrix. The recursions become log-space matrix-vector products:
+ *       α_p = ψ_p + log(exp(α_{p-1}) × exp(Ψ_p))
+ *       β_p = log(exp(Ψ_{p+1}) × exp(ψ_{p+1} + β_{p+1}))
+ *   The forward one is computed row by row so all the memory access are
+ *   contiguous: first the maximum of each column is found so the exponentials
+ *   can be safely summed in a second pass.
+ *   The results are copied back in the arcs so the rest of the code doesn't
+ *   have to care about the kind of FST.
  */
 static
-double logsum(const double a, const double b) {
-	if (a == -DBL_MAX) return b;
-	else if (a > b)    return a + log(1 + exp(b - a));
-	else               return b + log(1 + exp(a - b));
+void grd_chain(fst_t *fst) {
+	const int A = fst->narcs, P = fst->nstates - 1;
+	const int *cpos = fst->cpos;
+	double *emi = fst->raw_cval, *alp = emi + A, *bet = alp + A;
+	for (int ia = 0; ia < A; ia++)
+		emi[ia] = fst->arcs[ia].psi;
+	// The forward recurence: the first position is just the emission
+	// scores and next each position is computed from the previous one.
+	for (int ia = cpos[0]; ia < cpos[1]; ia++)
+		alp[ia] = emi[ia];
+	for (int ip = 1; ip < P; ip++) {
+		const state_t *st = &fst->states[fst->arcs[cpos[ip]].src];
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		const double *ai = alp + cpos[ip - 1];
+		double *ao = alp + cpos[ip], mx[NO], sm[NO], v[NO];
+		for (int no = 0; no < NO; no++)
+			mx[no] = -DBL_MAX, sm[no] = 0.0;
+		for (int ni = 0; ni < NI; ni++) {
+			const double *psi = st->psi[ni];
+			for (int no = 0; no < NO; no++)
+				mx[no] = max(mx[no], ai[ni] + psi[no]);
+		}
+		for (int ni = 0; ni < NI; ni++) {
+			const double *psi = st->psi[ni];
+			for (int no = 0; no < NO; no++)
+				v[no] = ai[ni] + psi[no] - mx[no];
+			vec_exp(v, v, NO);
+			for (int no = 0; no < NO; no++)
+				sm[no] += v[no];
+		}
+		for (int no = 0; no < NO; no++)
+			ao[no] = emi[cpos[ip] + no] + mx[no] + log(sm[no]);
+	}
+	// The backward recurence: the arcs of the last position reach the
+	// final state and next each position is computed from the next one.
+	// Here the rows of the Ψ block are directly what we need to reduce.
+	for (int ia = cpos[P - 1]; ia < cpos[P]; ia++)
+		bet[ia] = 0.0;
+	for (int ip = P - 1; ip > 0; ip--) {
+		const state_t *st = &fst->states[fst->arcs[cpos[ip]].src];
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		const double *eo = emi + cpos[ip], *bo = bet + cpos[ip];
+		double *bi = bet + cpos[ip - 1], eb[NO], v[NO];
+		for (int no = 0; no < NO; no++)
+			eb[no] = eo[no] + bo[no];
+		for (int ni = 0; ni < NI; ni++) {
+			const double *psi = st->psi[ni];
+			for (int no = 0; no < NO; no++)
+				v[no] = psi[no] + eb[no];
+			bi[ni] = vec_lse(v, NO);
+		}
+	}
+	for (int ia = 0; ia < A; ia++) {
+		fst->arcs[ia].alpha = alp[ia];
+		fst->arcs[ia].beta  = bet[ia];
+	}
 }
 
 /* grd_fwdbwd:
@@ -2717,11 +4406,16 @@ double logsum(const double a, const double b) {
  *       | β_N    (y') = 1
  *       | β_{n-1}(y') = ∑_{y} β_t(y) * Ψ_e(y',y,x)
  *   As we do the computations in log-space, the products are replaced by sums
- *   and the sums by logsums.
+ *   and the sums by log-sum-exp.
  *   This is where we have to sum the two components of the psi function.
+ *   Linear chains are handled by the dense version above.
  */
 static
 void grd_fwdbwd(fst_t *fst) {
+	if (fst->raw_cval != NULL) {
+		grd_chain(fst);
+		return;
+	}
 	const int A = fst->narcs;
 	// The forward recurence: We walk over all the arcs in topological
 	// order so we are sure that all incoming arcs of the source state of
@@ -2745,14 +4439,14 @@ void grd_fwdbwd(fst_t *fst) {
 		for ( ; no < st->ocnt; no++)
 			if (st->olst[no] == o)
 				break;
-		// Next we process all incoming arcs and sum there contribution
-		// to compute the alpha value using the recursion.
-		ao->alpha = -DBL_MAX;
+		// Next we gather the contribution of all incoming arcs and sum
+		// them in one call to compute the alpha value.
+		double v[st->icnt];
 		for (int ni = 0; ni < st->icnt; ni++) {
 			const arc_t *ai = &fst->arcs[st->ilst[ni]];
-			double v = ao->psi + st->psi[ni][no] + ai->alpha;
-			ao->alpha = logsum(ao->alpha, v);
+			v[ni] = st->psi[ni][no] + ai->alpha;
 		}
+		ao->alpha = ao->psi + vec_lse(v, st->icnt);
 	}
 	// The backward recurence: it is done exactly as the forward one except
 	// that we process the state in topological order from the final state
@@ -2774,16 +4468,274 @@ void grd_fwdbwd(fst_t *fst) {
 			if (st->ilst[ni] == i)
 				break;
 		// And finally the recurence itself like in the forward pass.
-		ai->beta = -DBL_MAX;
+		double v[st->ocnt];
 		for (int no = 0; no < st->ocnt; no++) {
 			const arc_t *ao = &fst->arcs[st->olst[no]];
-			double v = ao->psi + st->psi[ni][no] + ao->beta;
-			ai->beta = logsum(ai->beta, v);
+			v[no] = ao->psi + st->psi[ni][no] + ao->beta;
 		}
+		ai->beta = vec_lse(v, st->ocnt);
 	}
 }
 
-/* grd_doupd:
+/* grd_beamfwd:
+ *   Beam-pruned version of the forward pass. The states are processed level by
+ *   level following their topological classes and, once all the outgoing arcs
+ *   of a level are computed, those whose alpha is more than [beam] below the
+ *   best one of the level are pruned. The alpha of a pruned arc is set to the
+ *   log-zero -DBL_MAX so it is ignored by the next levels, by the backward pass
+ *   and by the expectations.
+ *   If [ref] is not NULL, the arcs following its path are never pruned so the
+ *   normalization of the space cannot fall below the score of the reference.
+ *   If [vit] is true, this is done in the tropical semi-ring with the back-
+ *   pointers needed by [dec_backtrack], else this is done in the log one and
+ *   the fraction of the forward mass kept at each level is accumulated, their
+ *   product giving an estimate of the mass kept for the full FST.
+ */
+static
+void grd_beamfwd(fst_t *fst, const fst_t *ref, double beam, bms_t *bms,
+		int vit) {
+	const int A = fst->narcs, S = fst->nstates;
+	int *lst = malloc(sizeof(int) * (S * 2 + 1) + sizeof(double) * A * 2
+	                + A);
+	if (lst == NULL)
+		pfatal("cannot allocate beam levels");
+	int    *cls = lst + S;
+	double *all = (double *)(cls + S + 1), *kpt = all + A;
+	char   *keep = (char *)(kpt + A);
+	memset(keep, 0, A);
+	if (ref != NULL)
+		prn_mark(fst, ref, keep);
+	const int C = fst_toposort(fst, lst, cls, 0);
+	double mass = 0.0;
+	int kept = 0;
+	for (int c = 0; c < C; c++) {
+		// First compute the alpha of all arcs leaving the states of
+		// the level, ignoring the pruned incoming arcs.
+		double mx = -DBL_MAX;
+		int na = 0;
+		for (int i = cls[c]; i < cls[c + 1]; i++) {
+			const state_t *st = &fst->states[lst[i]];
+			double v[st->icnt];
+			int    p[st->icnt], nv = 0;
+			for (int ni = 0; ni < st->icnt; ni++) {
+				const double a = fst->arcs[st->ilst[ni]].alpha;
+				if (a != -DBL_MAX)
+					p[nv] = ni, v[nv++] = a;
+			}
+			for (int no = 0; no < st->ocnt; no++) {
+				arc_t *ao = &fst->arcs[st->olst[no]];
+				if (lst[i] == 0) {
+					ao->alpha = ao->psi;
+				} else if (nv == 0) {
+					ao->alpha = -DBL_MAX;
+					continue;
+				} else if (vit) {
+					double w[nv];
+					for (int n = 0; n < nv; n++)
+						w[n] = v[n] + st->psi[p[n]][no];
+					int bst = 0;
+					for (int n = 1; n < nv; n++)
+						if (w[n] > w[bst])
+							bst = n;
+					ao->alpha = ao->psi + w[bst];
+					ao->eback = st->ilst[p[bst]];
+					ao->yback = 0;
+				} else {
+					double w[nv];
+					for (int n = 0; n < nv; n++)
+						w[n] = v[n] + st->psi[p[n]][no];
+					ao->alpha = ao->psi + vec_lse(w, nv);
+				}
+				mx = max(mx, ao->alpha);
+				all[na++] = ao->alpha;
+			}
+		}
+		// Next prune the arcs out of the beam and gather the ones kept
+		// to estimate the mass lost at this level.
+		int nk = 0;
+		for (int i = cls[c]; i < cls[c + 1]; i++) {
+			const state_t *st = &fst->states[lst[i]];
+			for (int no = 0; no < st->ocnt; no++) {
+				const int ia = st->olst[no];
+				arc_t *ao = &fst->arcs[ia];
+				if (ao->alpha == -DBL_MAX)
+					continue;
+				if (ao->alpha < mx - beam && !keep[ia])
+					ao->alpha = -DBL_MAX;
+				else
+					kpt[nk++] = ao->alpha;
+			}
+		}
+		if (!vit && na != 0)
+			mass += vec_lse(kpt, nk) - vec_lse(all, na);
+		kept += nk;
+	}
+	free(lst);
+	atm_inc(&bms->arcs, A);
+	atm_inc(&bms->kept, kept);
+	atm_inc(&bms->mass, exp(mass));
+	atm_inc(&bms->nfst, 1.0);
+}
+
+/* grd_beambwd:
+ *   Backward pass to use after [grd_beamfwd]. This is the same as the one of
+ *   [grd_fwdbwd] except that only the arcs kept are considered. Their beta is
+ *   set to -DBL_MAX as well as the one of arcs kept but leading only to pruned
+ *   arcs.
+ */
+static
+void grd_beambwd(fst_t *fst) {
+	const int A = fst->narcs;
+	int *t2s = fst->t2s;
+	for (int ii = 0, i = t2s[0]; ii < A; i = t2s[++ii]) {
+		arc_t   *ai = &fst->arcs[i];
+		state_t *st = &fst->states[ai->trg];
+		if (ai->alpha == -DBL_MAX) {
+			ai->beta = -DBL_MAX;
+			continue;
+		}
+		if (ai->trg == fst->final) {
+			ai->beta = 0.0;
+			continue;
+		}
+		int ni = 0;
+		for ( ; ni < st->icnt; ni++)
+			if (st->ilst[ni] == i)
+				break;
+		double v[st->ocnt];
+		int nv = 0;
+		for (int no = 0; no < st->ocnt; no++) {
+			const arc_t *ao = &fst->arcs[st->olst[no]];
+			if (ao->beta != -DBL_MAX)
+				v[nv++] = ao->psi + st->psi[ni][no] + ao->beta;
+		}
+		ai->beta = nv != 0 ? vec_lse(v, nv) : -DBL_MAX;
+	}
+}
+
+/* grd_chains:
+ *   Batched version of [grd_chain] for up to [DAT_LANES] linear chains of the
+ *   same shape. All values are stored lane-major so each step of the recursion
+ *   is done for all the FSTs at once with full width vector operations, and a
+ *   single kernel call compute the exponentials of a full Ψ block.
+ *   Unused lanes just compute a copy of the first FST.
+ */
+static
+void grd_chains(fst_t *fst[], int n) {
+	assert(n > 0 && n <= DAT_LANES);
+	const int L = DAT_LANES;
+	const int A = fst[0]->narcs, P = fst[0]->nstates - 1;
+	const int *cpos = fst[0]->cpos;
+	int mb = 0;
+	for (int ip = 1; ip < P; ip++) {
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		mb = max(mb, NI * NO);
+	}
+	double *emi = malloc(sizeof(double) * L * (A * 3 + mb));
+	if (emi == NULL) {
+		for (int i = 0; i < n; i++)
+			grd_fwdbwd(fst[i]);
+		return;
+	}
+	double *alp = emi + A * L, *bet = alp + A * L, *blk = bet + A * L;
+	fst_t *lf[L];
+	for (int l = 0; l < L; l++)
+		lf[l] = fst[l < n ? l : 0];
+	for (int ia = 0; ia < A; ia++)
+		for (int l = 0; l < L; l++)
+			emi[ia * L + l] = lf[l]->arcs[ia].psi;
+	// The forward recurence: the Ψ blocks of all lanes are first merged
+	// with the previous alpha values, next we do the usual max then sum of
+	// exponentials but on the full block.
+	for (int ia = cpos[0] * L; ia < cpos[1] * L; ia++)
+		alp[ia] = emi[ia];
+	for (int ip = 1; ip < P; ip++) {
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		const double *ai = alp + cpos[ip - 1] * L;
+		double *ao = alp + cpos[ip] * L, mx[NO * L], sm[NO * L];
+		double **psi[L];
+		for (int l = 0; l < L; l++)
+			psi[l] = lf[l]->states[lf[l]->arcs[cpos[ip]].src].psi;
+		for (int i = 0; i < NO * L; i++)
+			mx[i] = -DBL_MAX, sm[i] = 0.0;
+		for (int ni = 0; ni < NI; ni++) {
+			for (int no = 0; no < NO; no++) {
+				double *b = blk + (ni * NO + no) * L;
+				double *m = mx + no * L;
+				for (int l = 0; l < L; l++)
+					b[l] = psi[l][ni][no] + ai[ni * L + l];
+				for (int l = 0; l < L; l++)
+					m[l] = max(m[l], b[l]);
+			}
+		}
+		for (int ni = 0; ni < NI; ni++)
+			for (int i = 0; i < NO * L; i++)
+				blk[ni * NO * L + i] -= mx[i];
+		vec_exp(blk, blk, NI * NO * L);
+		for (int ni = 0; ni < NI; ni++)
+			for (int i = 0; i < NO * L; i++)
+				sm[i] += blk[ni * NO * L + i];
+		const double *eo = emi + cpos[ip] * L;
+		for (int i = 0; i < NO * L; i++)
+			ao[i] = eo[i] + mx[i] + log(sm[i]);
+	}
+	// The backward recurence: same principle but this time the reduction
+	// is done over the outgoing labels of each row.
+	for (int ia = cpos[P - 1] * L; ia < cpos[P] * L; ia++)
+		bet[ia] = 0.0;
+	for (int ip = P - 1; ip > 0; ip--) {
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		const double *eo = emi + cpos[ip] * L, *bo = bet + cpos[ip] * L;
+		double *bi = bet + cpos[ip - 1] * L, mx[NI * L], sm[NI * L];
+		double **psi[L];
+		for (int l = 0; l < L; l++)
+			psi[l] = lf[l]->states[lf[l]->arcs[cpos[ip]].src].psi;
+		for (int i = 0; i < NI * L; i++)
+			mx[i] = -DBL_MAX, sm[i] = 0.0;
+		for (int ni = 0; ni < NI; ni++) {
+			double *m = mx + ni * L;
+			for (int no = 0; no < NO; no++) {
+				double *b = blk + (ni * NO + no) * L;
+				for (int l = 0; l < L; l++)
+					b[l] = psi[l][ni][no] + eo[no * L + l]
+					                      + bo[no * L + l];
+				for (int l = 0; l < L; l++)
+					m[l] = max(m[l], b[l]);
+			}
+		}
+		for (int ni = 0; ni < NI; ni++) {
+			const double *m = mx + ni * L;
+			for (int no = 0; no < NO; no++) {
+				double *b = blk + (ni * NO + no) * L;
+				for (int l = 0; l < L; l++)
+					b[l] -= m[l];
+			}
+		}
+		vec_exp(blk, blk, NI * NO * L);
+		for (int ni = 0; ni < NI; ni++) {
+			double *t = sm + ni * L;
+			for (int no = 0; no < NO; no++) {
+				const double *b = blk + (ni * NO + no) * L;
+				for (int l = 0; l < L; l++)
+					t[l] += b[l];
+			}
+		}
+		for (int i = 0; i < NI * L; i++)
+			bi[i] = mx[i] + log(sm[i]);
+	}
+	for (int l = 0; l < n; l++) {
+		for (int ia = 0; ia < A; ia++) {
+			fst[l]->arcs[ia].alpha = alp[ia * L + l];
+			fst[l]->arcs[ia].beta  = bet[ia * L + l];
+		}
+	}
+	free(emi);
+}
+
+/* grd_doexp:
  *   The normalization constant can be computed with
  *       Z_θ = ∑_y α_n(y) β_n(y)
  *   either at initial or final node. The last one is the easiest as the β_n(y)
@@ -2800,75 +4752,418 @@ void grd_fwdbwd(fst_t *fst) {
  *   all the previous computations. The probabilities are given by:
  *       p_θ(y_n=y|x)            = α_n(y) β_n(y) / Z_θ
  *       p_θ(y_e.s=y',y_e.t=y|x) = α_e.s(y') Ψ_e(y',y,x) β_e.t(y) / Z_θ
+ *   The expectations are added for the arcs in [a0, a1) and the states in
+ *   [s0, s1) so the work can be split. Arcs pruned by the beam have a beta
+ *   of -DBL_MAX and are skipped, as well as the dormant features of the
+ *   optimizer outside of full sweeps.
  */
 static
-double grd_doupd(mdl_t *mdl, fst_t *fst) {
-	const int A = fst->narcs;
-	const int S = fst->nstates;
+void grd_doexp(mdl_t *mdl, fst_t *fst, double Z, int a0, int a1,
+		int s0, int s1) {
 	const double mul = fst->mult;
-	// Computing the normalization constant is quite simple, we just have to
-	// take the sum of all the alpha values of the edges pointing to the
-	// final node. We don't have to care multiplying by the beta values as
-	// they should be equal to 1. The only trickery is that we have to
-	// perform the computation in log-space.
-	double Z = -DBL_MAX;
-	for (int ia = 0; ia < A; ia++) {
-		const arc_t *a = &fst->arcs[ia];
-		if (a->trg == fst->final)
-			Z = logsum(Z, a->alpha);
-	}
-	// Next we have to compute the probability of the edge unigrams features
-	// who are the most simple ones. The expectation of them is just the
-	// product of the corresponding alpha and beta values divided by the
-	// normalization constant. (also computed in log)
-	for (int ia = 0; ia < A; ia++) {
-		arc_t *a = &fst->arcs[ia];
-		const double ex = exp(-Z + a->alpha + a->beta);
-		for (int f = 0; f < a->ucnt; f++)
-			atm_inc(&a->ulst[f]->g, ex * mul);
-		for (int i = 1; i < MAX_REAL; i++)
-			atm_inc(&mdl->real[i]->g, ex * a->wgh[i] * mul);
+	// We have to compute the probability of the edge unigrams features who
+	// are the most simple ones. The expectation of them is just the product
+	// of the corresponding alpha and beta values divided by the
+	// normalization constant. (also computed in log) The exponentials are
+	// computed by blocks of arcs to use the vector kernel. The same buffer
+	// hold the rows of the states below so it cover the widest one.
+	int sex = 256;
+	for (int is = s0; is < s1; is++)
+		sex = max(sex, fst->states[is].ocnt);
+	double ex[sex];
+	for (int ib = a0; ib < a1; ib += 256) {
+		const int B = min(a1 - ib, 256);
+		for (int ia = 0; ia < B; ia++) {
+			const arc_t *a = &fst->arcs[ib + ia];
+			ex[ia] = -Z + a->alpha + a->beta;
+		}
+		vec_exp(ex, ex, B);
+		for (int ia = 0; ia < B; ia++) {
+			arc_t *a = &fst->arcs[ib + ia];
+			if (a->beta == -DBL_MAX)
+				continue;
+			for (int f = 0; f < a->ucnt; f++)
+				if (mdl->full || a->ulst[f]->dor == 0)
+					atm_inc(&a->ulst[f]->g, ex[ia] * mul);
+			for (int i = 1; i < MAX_REAL; i++) {
+				const double w = a->wgh[i];
+				atm_inc(&mdl->real[i]->g, ex[ia] * w * mul);
+			}
+		}
 	}
 	// The node features are a bit more complex as they involve two edges.
 	// We loop over all nodes and for each of them loop over all possible
 	// combination of an incoming and an outgoing edge.
-	for (int is = 0; is < S; is++) {
+	for (int is = s0; is < s1; is++) {
 		const state_t *s = &fst->states[is];
 		for (int ni = 0; ni < s->icnt; ni++) {
-		for (int no = 0; no < s->ocnt; no++) {
-			const arc_t *ai = &fst->arcs[s->ilst[ni]];
-			const arc_t *ao = &fst->arcs[s->olst[no]];
 			// Now, for each of them we have to compute the
 			// expectation which is a bit more complicated as we
-			// have to add the contribution of the current edge.
-			int     nbf = s->bcnt[ni][no];
-			ftr_t **lbf = s->blst[ni][no];
-			double ex = exp(-Z + ai->alpha + ao->beta
-			                   + ao->psi + s->psi[ni][no]);
-			for (int f = 0; f < nbf; f++)
-				atm_inc(&lbf[f]->g, ex * mul);
-		}
+			// have to add the contribution of the current edge. The
+			// exponentials of a full row are computed at once.
+			const arc_t *ai = &fst->arcs[s->ilst[ni]];
+			if (ai->beta == -DBL_MAX)
+				continue;
+			for (int no = 0; no < s->ocnt; no++) {
+				const arc_t *ao = &fst->arcs[s->olst[no]];
+				ex[no] = -Z + ai->alpha + ao->beta
+				            + ao->psi + s->psi[ni][no];
+			}
+			vec_exp(ex, ex, s->ocnt);
+			for (int no = 0; no < s->ocnt; no++) {
+				if (fst->arcs[s->olst[no]].beta == -DBL_MAX)
+					continue;
+				int     nbf = s->bcnt[ni][no];
+				ftr_t **lbf = s->blst[ni][no];
+				for (int f = 0; f < nbf; f++) {
+					ftr_t *ftr = lbf[f];
+					if (mdl->full || ftr->dor == 0)
+						atm_inc(&ftr->g, ex[no] * mul);
+				}
+				pair_t *pr = s->bpr[ni][no];
+				if (pr != NULL)
+					atm_inc(&pr->g, ex[no] * mul);
+			}
 		}
 	}
+}
+
+/* grd_logz:
+ *   Computing the normalization constant is quite simple, we just have to
+ *   take the sum of all the alpha values of the edges pointing to the final
+ *   node. We don't have to care multiplying by the beta values as they should
+ *   be equal to 1. The only trickery is that we have to perform the
+ *   computation in log-space.
+ */
+static
+double grd_logz(const fst_t *fst) {
+	const state_t *sf = &fst->states[fst->final];
+	double v[sf->icnt];
+	for (int ni = 0; ni < sf->icnt; ni++)
+		v[ni] = fst->arcs[sf->ilst[ni]].alpha;
+	return vec_lse(v, sf->icnt);
+}
+
+/* grd_doupd:
+ *   Add the expectations of all the features of the FST to their gradient and
+ *   return the contribution of the FST to the objective.
+ */
+static
+double grd_doupd(mdl_t *mdl, fst_t *fst) {
+	const double Z = grd_logz(fst);
+	grd_doexp(mdl, fst, Z, 0, fst->narcs, 0, fst->nstates);
+	return fst->mult * Z;
+}
+
+/* grd_dopath:
+ *   Closed-form gradient for single path FSTs. There is no lattice here, so the
+ *   normalization constant is just the score of the path and the expectation
+ *   of every feature on it is exactly one. The features are generated on the
+ *   fly, added to the gradient, and their weights summed in the same order
+ *   than the forward pass would do, so none of the lattice data is needed.
+ *   Return the contribution of the FST to the objective.
+ */
+static
+double grd_dopath(gen_t *gen, mdl_t *mdl, fst_t *fst) {
+	const int frq = gen_getfrq(gen, fst);
+	const double mul = fst->mult;
+	ftr_t *lst[max(gen->nupat, gen->nbpat + gen->nlpat) + 1];
+	double Z = 0.0;
+	for (int ia = 0; ia < fst->narcs; ia++) {
+		const arc_t *a = &fst->arcs[ia];
+		double psi = 0.0, bsi = 0.0;
+		lbl_t *lu[2] = {a->ilbl, a->olbl};
+		const int nu = gen_uftr(gen, mdl, lu, lst, frq);
+		for (int f = 0; f < nu; f++) {
+			psi += lst[f]->x;
+			if (mdl->full || lst[f]->dor == 0)
+				atm_inc(&lst[f]->g, mul);
+		}
+		if (MAX_REAL > 0)
+			psi += a->wgh[0];
+		for (int i = 1; i < MAX_REAL; i++) {
+			if (mdl->stt[mdl_gettag(mdl->real[i])] <= mdl->itr)
+				psi += mdl->real[i]->x * a->wgh[i];
+			atm_inc(&mdl->real[i]->g, a->wgh[i] * mul);
+		}
+		if (ia == 0) {
+			Z = psi;
+			continue;
+		}
+		const arc_t *p = &fst->arcs[ia - 1];
+		lbl_t *lb[4] = {p->ilbl, p->olbl, a->ilbl, a->olbl};
+		const int nb = gen_bftr(gen, mdl, lb, lst, frq, 1);
+		for (int f = 0; f < nb; f++) {
+			bsi += lst[f]->x;
+			if (mdl->full || lst[f]->dor == 0)
+				atm_inc(&lst[f]->g, mul);
+		}
+		Z = psi + (bsi + Z);
+	}
 	return mul * Z;
 }
 
+/* lvl_t:
+ *   A single huge FST, like the full space of a document, would be processed
+ *   by a single worker and dominate the time of an iteration. For these, all
+ *   the threads work together on the same FST: the states are grouped in
+ *   topological classes, so the states in a class only depend on the previous
+ *   ones, and each class is split between the threads with a barrier between
+ *   the classes. This is done in both directions for the forward and backward
+ *   pass and the expectations are just split by arcs and states ranges.
+ */
+typedef struct lvl_s lvl_t;
+struct lvl_s {
+	mdl_t  *mdl;
+	fst_t  *fst;
+	int     nth;
+	int     nfwd, *fwd, *fcls;  // Forward classes
+	int     nbwd, *bwd, *bcls;  // Backward classes
+	bar_t   bar;
+};
+
+typedef struct {lvl_t *lvl; int id;} lvl_arg_t;
+
+/* lvl_alpha:
+ *   Compute the alpha value of all the outgoing arcs of the state [is] using
+ *   the same recurence than [grd_fwdbwd].
+ */
+static
+void lvl_alpha(fst_t *fst, int is) {
+	const state_t *st = &fst->states[is];
+	double v[st->icnt];
+	for (int no = 0; no < st->ocnt; no++) {
+		arc_t *ao = &fst->arcs[st->olst[no]];
+		if (is == 0) {
+			ao->alpha = ao->psi;
+			continue;
+		}
+		for (int ni = 0; ni < st->icnt; ni++) {
+			const arc_t *ai = &fst->arcs[st->ilst[ni]];
+			v[ni] = st->psi[ni][no] + ai->alpha;
+		}
+		ao->alpha = ao->psi + vec_lse(v, st->icnt);
+	}
+}
+
+/* lvl_beta:
+ *   Compute the beta value of all the incoming arcs of the state [is].
+ */
+static
+void lvl_beta(fst_t *fst, int is) {
+	const state_t *st = &fst->states[is];
+	double v[st->ocnt];
+	for (int ni = 0; ni < st->icnt; ni++) {
+		arc_t *ai = &fst->arcs[st->ilst[ni]];
+		if (is == fst->final) {
+			ai->beta = 0.0;
+			continue;
+		}
+		for (int no = 0; no < st->ocnt; no++) {
+			const arc_t *ao = &fst->arcs[st->olst[no]];
+			v[no] = ao->psi + st->psi[ni][no] + ao->beta;
+		}
+		ai->beta = vec_lse(v, st->ocnt);
+	}
+}
+
+/* lvl_worker:
+ *   Thread [id] take its share of each class in turn. The share are fixed
+ *   contiguous ranges so no synchronization is needed beside the barriers.
+ */
+static
+void *lvl_worker(void *ud) {
+	lvl_arg_t *arg = ud;
+	lvl_t *lvl = arg->lvl;
+	fst_t *fst = lvl->fst;
+	const int id = arg->id, T = lvl->nth;
+	for (int c = 0; c < lvl->nfwd; c++) {
+		const int lo = lvl->fcls[c], n = lvl->fcls[c + 1] - lo;
+		const int s0 = lo + n * id / T, s1 = lo + n * (id + 1) / T;
+		for (int i = s0; i < s1; i++)
+			lvl_alpha(fst, lvl->fwd[i]);
+		bar_wait(&lvl->bar);
+	}
+	for (int c = 0; c < lvl->nbwd; c++) {
+		const int lo = lvl->bcls[c], n = lvl->bcls[c + 1] - lo;
+		const int s0 = lo + n * id / T, s1 = lo + n * (id + 1) / T;
+		for (int i = s0; i < s1; i++)
+			lvl_beta(fst, lvl->bwd[i]);
+		bar_wait(&lvl->bar);
+	}
+	// All threads compute Z on their own as it is cheap and it avoid one
+	// more barrier.
+	const int A = fst->narcs, S = fst->nstates;
+	const double Z = grd_logz(fst);
+	grd_doexp(lvl->mdl, fst, Z, A * id / T, A * (id + 1) / T,
+	                            S * id / T, S * (id + 1) / T);
+	return NULL;
+}
+
+/* lvl_compute:
+ *   Do the forward-backward and the gradient update of a single FST using
+ *   [nth] threads. The FST must be fully prepared up to the Ψ values. Return
+ *   the contribution of the FST to the objective. If the classes cannot be
+ *   allocated, this fallback to the serial code.
+ */
+static
+double lvl_compute(mdl_t *mdl, fst_t *fst, int nth) {
+	const int S = fst->nstates;
+	lvl_t lvl = {.mdl = mdl, .fst = fst, .nth = nth};
+	int *raw = malloc(sizeof(int) * (S * 4 + 2));
+	if (raw == NULL) {
+		grd_fwdbwd(fst);
+		return grd_doupd(mdl, fst);
+	}
+	lvl.fwd  = raw;          lvl.bwd  = raw + S;
+	lvl.fcls = raw + S * 2;  lvl.bcls = raw + S * 3 + 1;
+	lvl.nfwd = fst_toposort(fst, lvl.fwd, lvl.fcls, 0);
+	lvl.nbwd = fst_toposort(fst, lvl.bwd, lvl.bcls, 1);
+	bar_init(&lvl.bar, nth);
+	thread_t  thrd[nth];
+	lvl_arg_t args[nth];
+	for (int n = 0; n < nth; n++) {
+		args[n].lvl = &lvl;
+		args[n].id  = n;
+		thread_spawn(&thrd[n], lvl_worker, &args[n]);
+	}
+	for (int n = 0; n < nth; n++)
+		thread_join(thrd[n]);
+	bar_clear(&lvl.bar);
+	free(raw);
+	return fst->mult * grd_logz(fst);
+}
+
+/* grd_islvl:
+ *   Check if the given FST is big enough to be handled by all the threads with
+ *   the level-synchronous code. All the FSTs of a batch have the same size so
+ *   checking the first one is enough. This mode is not used with the beam.
+ */
+static
+int grd_islvl(const grd_t *grd, const fst_t *fst) {
+	if (grd->beam > 0.0 || fst->path)
+		return 0;
+	return grd->nth > 1 && fst->narcs >= grd->lvl;
+}
+
+/* grd_worker:
+ *   Process the dataset batch by batch. All the FSTs of a batch are prepared
+ *   first so the forward-backward can be done on all of them at once if they
+ *   are linear chains of the same shape. The huge FSTs are skipped as they are
+ *   processed before by all the threads together.
+ *   With a beam, the hypothesis spaces are pruned but the references are kept
+ *   full so the supervision doesn't change, and the path of its reference is
+ *   never pruned from a space so its normalization stay above it.
+ *   Single paths have the same shape only with other single paths, so whole
+ *   batches of them go through the closed-form code.
+ */
 static
 void *grd_worker(void *ud) {
 	grd_t *grd = ud;
+	dat_t *dat = grd->dat;
 	double fx = 0.0;
 	while (1) {
-		int id = atm_add(&grd->idx, 1) - 1;
-		if (id >= grd->dat->nfst)
+		int ib = atm_add(&grd->idx, 1) - 1;
+		if (ib >= dat->nbat)
 			break;
-		fst_t *fst = grd->dat->fst[id];
+		const int n = dat->bat[ib + 1] - dat->bat[ib];
+		fst_t *fst[n];
+		fst[0] = dat->fst[dat->bidx[dat->bat[ib]]];
+		if (grd_islvl(grd, fst[0]))
+			continue;
+		if (fst[0]->path) {
+			for (int i = 0; i < n; i++) {
+				fst[i] = dat->fst[dat->bidx[dat->bat[ib] + i]];
+				fx += grd_dopath(grd->gen, grd->mdl, fst[i]);
+				prg_next(grd->prg);
+			}
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			fst[i] = dat->fst[dat->bidx[dat->bat[ib] + i]];
+			fst_addstates(fst[i]);
+			fst_addsort(fst[i]);
+			gen_addftr(grd->gen, grd->mdl, fst[i]);
+			grd_addspc(fst[i]);
+			grd_dopsi(grd->mdl, fst[i]);
+		}
+		if (grd->beam > 0.0) {
+			for (int i = 0; i < n; i++) {
+				if (fst[i]->mult < 0.0) {
+					grd_fwdbwd(fst[i]);
+					continue;
+				}
+				const int k = dat->bidx[dat->bat[ib] + i];
+				const int r = grd->ref[k];
+				const fst_t *ref = r >= 0 ? dat->fst[r] : NULL;
+				grd_beamfwd(fst[i], ref, grd->beam, &grd->bms,
+					0);
+				grd_beambwd(fst[i]);
+			}
+		} else if (n > 1) {
+			grd_chains(fst, n);
+		} else {
+			grd_fwdbwd(fst[0]);
+		}
+		for (int i = 0; i < n; i++) {
+			fx += grd_doupd(grd->mdl, fst[i]);
+			if (grd->cache < 4)
+				grd_remspc(fst[i]);
+			if (grd->cache < 3)
+				gen_remftr(fst[i]);
+			if (grd->cache < 2)
+				fst_remsort(fst[i]);
+			if (grd->cache < 1)
+				fst_remstates(fst[i]);
+			prg_next(grd->prg);
+		}
+	}
+	atm_inc(&grd->fx, fx);
+	return NULL;
+}
+
+/* grd_run:
+ *   Accumulate the gradient of all the FSTs of the current dataset in the model
+ *   and return the value of the objective, the progress being reported on the
+ *   [prg] of the computer.
+ *   The FSTs bigger than the [lvl] threshold are first processed one at a time
+ *   using all the threads, next the other ones are shared between threads.
+ *   The shared pairs are completed and summed first and their expectations are
+ *   given back to the features at the end. If they were dropped since the last
+ *   pass, the cached features lists are dropped too.
+ *   With a beam, the spaces must be paired with their references so these are
+ *   kept in the beam.
+ */
+static
+double grd_run(grd_t *grd) {
+	if (!dat_addbatch(grd->dat, max(grd->dat->nfst, 1)))
+		pfatal("cannot build batches");
+	if (grd->beam > 0.0) {
+		free(grd->ref);
+		grd->ref = malloc(sizeof(int) * max(grd->dat->nfst, 1));
+		if (grd->ref == NULL)
+			fatal("out of memory");
+		if (!dat_pair(grd->dat, grd->ref))
+			fatal("beam need as many spaces as references");
+	}
+	if (grd->nclr != grd->mdl->nclr) {
+		for (int i = 0; i < grd->dat->nfst; i++)
+			gen_remftr(grd->dat->fst[i]);
+		grd->nclr = grd->mdl->nclr;
+	}
+	gen_pupd(grd->gen, grd->mdl);
+	grd->idx = 0;
+	grd->fx  = 0.0;
+	for (int i = 0; i < grd->dat->nfst; i++) {
+		fst_t *fst = grd->dat->fst[i];
+		if (!grd_islvl(grd, fst))
+			continue;
 		fst_addstates(fst);
 		fst_addsort(fst);
 		gen_addftr(grd->gen, grd->mdl, fst);
 		grd_addspc(fst);
 		grd_dopsi(grd->mdl, fst);
-		grd_fwdbwd(fst);
-		fx += grd_doupd(grd->mdl, fst);
+		grd->fx += lvl_compute(grd->mdl, fst, grd->nth);
 		if (grd->cache < 4)
 			grd_remspc(fst);
 		if (grd->cache < 3)
@@ -2879,8 +5174,17 @@ void *grd_worker(void *ud) {
 			fst_remstates(fst);
 		prg_next(grd->prg);
 	}
-	atm_inc(&grd->fx, fx);
-	return NULL;
+	if (grd->nth == 1) {
+		grd_worker(grd);
+	} else {
+		thread_t thrd[grd->nth];
+		for (int n = 0; n < grd->nth; n++)
+			thread_spawn(&thrd[n], grd_worker, grd);
+		for (int n = 0; n < grd->nth; n++)
+			thread_join(thrd[n]);
+	}
+	mdl_pairacc(grd->mdl);
+	return grd->fx;
 }
 
 /* grd_compute:
@@ -2890,342 +5194,3374 @@ void *grd_worker(void *ud) {
  */
 static
 double grd_compute(grd_t *grd) {
-	grd->prg = prg_new(grd->dat->nfst / 49);
-	grd->idx = 0;
-	grd->fx  = 0.0;
+	grd->prg = prg_new(max(grd->dat->nfst / 49, 1));
+	grd->bms = (bms_t){0.0, 0.0, 0.0, 0.0};
 	prg_start(grd->prg);
-	if (grd->nth == 1) {
-		grd_worker(grd);
+	const double fx = grd_run(grd);
+	prg_end(grd->prg);
+	prg_free(grd->prg);
+	return fx;
+}
+
+/*******************************************************************************
+ * Optimizer
+ *
+ *   Implement the model optimizer using resilient back-propagation [1], this
+ *   use all the previous thing to perform the actual model training in an
+ *   efficient way.
+ *   In order to optimize a model, the optimize function should be called until
+ *   convergence. It is the responsibility of the caller code to determine when
+ *   the model is fully trained.
+ *
+ * [1] A direct adaptive method for faster backpropagation learning: The RPROP
+ *     algorithm, Martin Riedmiller and Heinrich Braun, IEEE International
+ *     Conference on Neural Networks, San Francisco, USA, 586-591, March 1993.
+ ******************************************************************************/
+
+/* rbp_shd_t:
+ *   Partial results of the optimizer over one shard of the features. They are
+ *   reduced in shard order at the end of the step so the results doesn't
+ *   depend on the number of threads.
+ */
+#define RBP_SHARDS 256
+typedef struct rbp_shd_s rbp_shd_t;
+struct rbp_shd_s {
+	double fx, nx, ng, nd;
+	long   tot[128], act[128], dor[128];
+};
+
+typedef struct rbp_s rbp_t;
+struct rbp_s {
+	double rho1[128];
+	double rho2[128];
+	double rho3[128];
+	double stpinc;
+	double stpdec;
+	double stpmin;
+	double stpmax;
+	int    nth;
+	int    act;     // Full sweep period of the active set, 0 if disabled
+	// Working data of the current step shared by the threads
+	mdl_t     *mdl;
+	prg_t     *prg;
+	int        lg, idx;
+	rbp_shd_t *shd;
+	long       cnt[RBP_SHARDS];
+	mtx_t      mtx;
+	ftr_t    **rem;
+	long       nrem, srem;
+};
+
+static
+rbp_t *rbp_new(void) {
+	rbp_t *rbp = malloc(sizeof(rbp_t));
+	if (rbp == NULL)
+		return NULL;
+	rbp->rho1[0] = rbp->rho2[0] = rbp->rho3[0] = 0.0;
+	for (int i = 1; i < 128; i++)
+		rbp->rho1[i] = rbp->rho2[i] = rbp->rho3[i] = -1.0;
+	rbp->stpinc = 1.2;
+	rbp->stpdec = 0.5;
+	rbp->stpmin = 1e-8;
+	rbp->stpmax = 50.0;
+	rbp->nth    = 1;
+	rbp->act    = 0;
+	rbp->rem    = NULL;
+	rbp->nrem   = 0;
+	rbp->srem   = 0;
+	mtx_init(&rbp->mtx);
+	return rbp;
+}
+
+static
+void rbp_free(rbp_t *rbp) {
+	mtx_clear(&rbp->mtx);
+	free(rbp->rem);
+	free(rbp);
+}
+
+/* rbp_update:
+ *   Perform the update of a single feature, accumulating the objective and the
+ *   norms in [shd]. Return true if the feature must be removed from the model,
+ *   in this case nothing else is done. If the active set is enabled, features
+ *   left with a zero weight are marked dormant.
+ */
+static
+int rbp_update(rbp_t *rbp, mdl_t *mdl, ftr_t *ftr, rbp_shd_t *shd) {
+	const int tag = mdl_gettag(ftr);
+	// Dormant features are only seen here during full sweeps. If they were
+	// skipped by some steps, their previous gradient and update are stale
+	// so they are reset, as if the feature started again from zero. This
+	// is an approximation: the skipped steps would have kept updating them,
+	// so the rprop trajectory is not the same as without the active set.
+	if (ftr->dor != 0) {
+		if (ftr->dor < mdl->itr - 1)
+			ftr->gp = ftr->dlt = 0.0;
+		ftr->dor = 0;
+		atm_sub(&mdl->ndor[tag], 1);
+	}
+	// Check if we should remove the feature either for to low freq
+	// or for having a zero weight.
+	// FIXME: Hack Nico : We also want to ignore dense features
+	// that should not be included in the model
+	if (ftr->x == 0.0 && mdl->rem[tag] <= mdl->itr) {
+		return 1;
+	} else if (ftr->frq < mdl->frq) {
+		return 1;
+	} else if (mdl->stt[tag] > mdl->itr) {
+		shd->tot[tag]++;
+		return 0;
+	}
+	// We detect new feature with their step size being zero and
+	// initialize them. The model should have set all fields to zero
+	// so we just have to setup the step size.
+	if (ftr->stp == 0.0)
+		ftr->stp = 0.1;
+	// We retrieve the feature tag and regularization parameter and
+	// update the l1 & l2 norm of the model.
+	const double rho1 = rbp->rho1[tag];
+	const double rho2 = rbp->rho2[tag];
+	const double rho3 = rbp->rho3[tag];
+	ftr->g += rho2 * ftr->x;
+	shd->fx += rho2 * ftr->x * ftr->x / 2.0;
+	shd->fx += rho1 * fabs(ftr->x);
+	shd->fx += rho3 * ftr->frq * fabs(ftr->x);
+	// First step is to project the gradient in the current orthant
+	// to ensure derivability.
+	const double ar = rho1 + rho3 * ftr->frq;
+	double pg = ftr->g;
+	if (ar != 0) {
+		     if (ftr->x < -EPSILON) pg -= ar;
+		else if (ftr->x >  EPSILON) pg += ar;
+		else if (ftr->g < -ar     ) pg += ar;
+		else if (ftr->g >  ar     ) pg -= ar;
+		else                        pg  = 0.0;
+	}
+	// Next we adjust the step depending on the new and previous
+	// gradient sign.
+	const double sgn = ftr->gp * pg;
+	if (sgn < -EPSILON)
+		ftr->stp = max(ftr->stp * rbp->stpdec, rbp->stpmin);
+	else if (sgn > EPSILON)
+		ftr->stp = min(ftr->stp * rbp->stpinc, rbp->stpmax);
+	// And we update the weight. If gradient sign changed, we take
+	// back the previous update, else we make one step in gradient
+	// direction and project back in orthant.
+	if (sgn < 0.0) {
+		ftr->x -= ftr->dlt;
+		ftr->g  = 0.0;
 	} else {
-		thread_t thrd[grd->nth];
-		for (int n = 0; n < grd->nth; n++)
-			thread_spawn(&thrd[n], grd_worker, grd);
-		for (int n = 0; n < grd->nth; n++)
+		     if (pg < -EPSILON) ftr->dlt =  ftr->stp;
+		else if (pg >  EPSILON) ftr->dlt = -ftr->stp;
+		else                    ftr->dlt = 0.0;
+		if (rho1 != 0.0 && ftr->dlt * pg >= 0.0)
+			ftr->dlt = 0.0;
+		ftr->x += ftr->dlt;
+	}
+	// Finally, prepare the feature for the next iteration. We save
+	// the current gradient and clear it.
+	shd->nx += fabs(ftr->x);
+	shd->ng += fabs(ftr->g);
+	shd->nd += fabs(ftr->dlt);
+	shd->tot[tag]++;
+	if (ftr->x != 0.0)
+		shd->act[tag]++;
+	ftr->frq = 0;
+	ftr->gp  = ftr->g;
+	ftr->g   = 0.0;
+	// A feature held at zero by the l1 penalty become dormant: it is
+	// ignored until the next full sweep, assuming its gradient stay small
+	// enough to not move it. This is not done if it must be removed at the
+	// next step, either for frequency or by its tag.
+	if (rbp->act && ftr->x == 0.0 && pg == 0.0 && mdl->frq == 0
+	             && mdl->rem[tag] > mdl->itr + 1) {
+		ftr->dor = mdl->itr;
+		atm_add(&mdl->ndor[tag], 1);
+		shd->dor[tag]++;
+	}
+	return 0;
+}
+
+/* rbp_worker:
+ *   Process shards until none remain. The features to remove are collected
+ *   during the walk and removed once the shard is done, removing them only
+ *   touch the part of the list owned by the shard so this is safe with other
+ *   threads working on their own shards.
+ */
+static
+void *rbp_worker(void *ud) {
+	rbp_t *rbp = ud;
+	mdl_t *mdl = rbp->mdl;
+	ftr_t **rem = NULL, **act = NULL;
+	size_t nrem = 0, srem = 0, nact = 0, sact = 0;
+	while (1) {
+		const int j = atm_add(&rbp->idx, 1) - 1;
+		if (j >= 1 << rbp->lg)
+			break;
+		rbp_shd_t *shd = &rbp->shd[j];
+		map_itr_t itr;
+		map_shard(mdl->ftrs, rbp->lg, j, &itr);
+		for (ftr_t *ftr; (ftr = map_inext(&itr)) != NULL; ) {
+			if (rbp_update(rbp, mdl, ftr, shd)) {
+				if (nrem == srem) {
+					srem = srem * 2 + 1024;
+					rem = realloc(rem,
+						sizeof(ftr_t *) * srem);
+					if (rem == NULL)
+						fatal("out of memory");
+				}
+				rem[nrem++] = ftr;
+			} else if (mdl->act != NULL && ftr->dor == 0) {
+				if (nact == sact) {
+					sact = sact * 2 + 1024;
+					act = realloc(act,
+						sizeof(ftr_t *) * sact);
+					if (act == NULL)
+						fatal("out of memory");
+				}
+				act[nact++] = ftr;
+			}
+			prg_next(rbp->prg);
+		}
+		for (size_t i = 0; i < nrem; i++)
+			free(map_remove(mdl->ftrs, map_gethsh(rem[i])));
+		nrem = 0;
+		mdl_addact(mdl, act, nact);
+		nact = 0;
+	}
+	free(rem);
+	free(act);
+	return NULL;
+}
+
+/* rbp_actworker:
+ *   Same as [rbp_worker] but only for the features of the active set. The set
+ *   is split in fixed ranges, the features still active are compacted at the
+ *   start of their range and the ones to remove are collected for the main
+ *   thread as they can be anywhere in the table.
+ */
+static
+void *rbp_actworker(void *ud) {
+	rbp_t *rbp = ud;
+	mdl_t *mdl = rbp->mdl;
+	const long N = mdl->nlst;
+	while (1) {
+		const int j = atm_add(&rbp->idx, 1) - 1;
+		if (j >= RBP_SHARDS)
+			break;
+		const long lo = N * j / RBP_SHARDS;
+		const long hi = N * (j + 1) / RBP_SHARDS;
+		long k = lo;
+		for (long i = lo; i < hi; i++) {
+			ftr_t *ftr = mdl->act[i];
+			if (rbp_update(rbp, mdl, ftr, &rbp->shd[j])) {
+				mtx_lock(&rbp->mtx);
+				if (rbp->nrem == rbp->srem) {
+					rbp->srem = rbp->srem * 2 + 1024;
+					rbp->rem = realloc(rbp->rem,
+						sizeof(ftr_t *) * rbp->srem);
+					if (rbp->rem == NULL)
+						fatal("out of memory");
+				}
+				rbp->rem[rbp->nrem++] = ftr;
+				mtx_unlock(&rbp->mtx);
+			} else if (ftr->dor == 0) {
+				mdl->act[k++] = ftr;
+			}
+			prg_next(rbp->prg);
+		}
+		rbp->cnt[j] = k - lo;
+	}
+	return NULL;
+}
+
+/* rbp_isfull:
+ *   Return true if the next step must be a full sweep over the model. This is
+ *   the case if the active set is disabled, not yet built, or if features can
+ *   be removed by frequency, and else every [act] iterations. This must be set
+ *   in the model before the gradient computation.
+ */
+static
+int rbp_isfull(const rbp_t *rbp, const mdl_t *mdl) {
+	if (rbp->act == 0 || mdl->act == NULL || mdl->frq != 0)
+		return 1;
+	return mdl->itr % rbp->act == 0;
+}
+
+/* rbp_step:
+ *   Perform one step of the resilient back-propagation algorithm including
+ *   computation of the gradient and applying the regularization. Return the
+ *   value of the objective function before the optimization step. (computing
+ *   the new value would require a second computation which is a lot too costly)
+ *   The features are split in shards following the hash table order which are
+ *   processed in parallel. The features counts of the model are updated at the
+ *   same time so [mdl_stats] doesn't have to walk the model again.
+ *   With the active set enabled, only the full sweeps walk the model and the
+ *   other steps only process the active features, the dormant ones being
+ *   checked again at the next full sweep.
+ */
+static
+void rbp_step(rbp_t *rbp, mdl_t *mdl, double ll) {
+	assert(rbp != NULL && mdl != NULL);
+	// The number of shards is bounded by the number of buckets and kept
+	// fixed otherwise so the reduction order is always the same.
+	int lg = 1;
+	while (lg < 8 && ((size_t)2 << lg) <= mdl->ftrs->size)
+		lg++;
+	// A full sweep walk all the features of the model and build again the
+	// active set if needed.
+	const int full = mdl->full;
+	if (full) {
+		free(mdl->act);
+		mdl->act  = NULL;
+		mdl->nlst = 0;
+		mdl->slst = 0;
+		if (rbp->act && mdl->frq == 0) {
+			mdl->slst = 1024;
+			mdl->act  = malloc(sizeof(ftr_t *) * mdl->slst);
+			if (mdl->act == NULL)
+				fatal("out of memory");
+		}
+	}
+	const int S = full ? 1 << lg : RBP_SHARDS;
+	const long N = full ? (long)mdl->ftrs->count : mdl->nlst;
+	rbp_shd_t *shd = calloc(S, sizeof(rbp_shd_t));
+	if (shd == NULL)
+		fatal("out of memory");
+	void *(*wrk)(void *) = full ? rbp_worker : rbp_actworker;
+	rbp->mdl  = mdl;
+	rbp->prg  = prg_new(max(N / 49, 1));
+	rbp->lg   = lg;
+	rbp->idx  = 0;
+	rbp->shd  = shd;
+	rbp->nrem = 0;
+	const size_t cnt = mdl->ftrs->count;
+	prg_start(rbp->prg);
+	if (rbp->nth == 1) {
+		wrk(rbp);
+	} else {
+		thread_t thrd[rbp->nth];
+		for (int n = 0; n < rbp->nth; n++)
+			thread_spawn(&thrd[n], wrk, rbp);
+		for (int n = 0; n < rbp->nth; n++)
 			thread_join(thrd[n]);
 	}
-	prg_end(grd->prg);
-	return grd->fx;
+	prg_end(rbp->prg);
+	prg_free(rbp->prg);
+	// For the active set, the remaining features of each range are moved
+	// together and the removed ones are taken out of the table now that no
+	// other thread is walking it.
+	if (!full) {
+		long n = 0;
+		for (int j = 0; j < S; j++) {
+			const long lo = N * j / S;
+			memmove(mdl->act + n, mdl->act + lo,
+				sizeof(ftr_t *) * rbp->cnt[j]);
+			n += rbp->cnt[j];
+		}
+		mdl->nlst = n;
+		for (long i = 0; i < rbp->nrem; i++)
+			free(map_remove(mdl->ftrs, map_gethsh(rbp->rem[i])));
+	}
+	if (mdl->ftrs->count != cnt)
+		mdl_pairclr(mdl);
+	double nx = 0.0, ng = 0.0, nd = 0.0;
+	double fx = ll;
+	// The dormant features not processed in this step are still part of
+	// the model, so they have to be added to the counts.
+	for (int i = 0; i < 128; i++) {
+		mdl->ntot[i] = full ? 0 : mdl->ndor[i];
+		mdl->nact[i] = 0;
+	}
+	for (int j = 0; j < S; j++) {
+		fx += shd[j].fx;
+		nx += shd[j].nx;
+		ng += shd[j].ng;
+		nd += shd[j].nd;
+		for (int i = 0; i < 128; i++) {
+			mdl->ntot[i] += shd[j].tot[i];
+			mdl->nact[i] += shd[j].act[i];
+			if (!full)
+				mdl->ntot[i] -= shd[j].dor[i];
+		}
+	}
+	mdl->nval = 1;
+	free(shd);
+	fprintf(stderr, "\tll=%.2f", -ll);
+	fprintf(stderr, " fx=%.2f",  fx);
+	fprintf(stderr, " |x|=%.2f",   nx);
+	fprintf(stderr, " |g|=%.2f",   ng);
+	fprintf(stderr, " |d|=%.2f\n", nd);
+}
+
+/*******************************************************************************
+ * Stochastic optimizer
+ *
+ *   Alternative to the resilient back-propagation which update the model after
+ *   each mini-batch of samples instead of after a full pass over the data. The
+ *   step size of each feature follow the AdaGrad rule [1] so rare features get
+ *   bigger steps than the frequent ones.
+ *   Only the features used by a mini-batch are updated, the regularization of
+ *   the steps where a feature was not used is applied lazily at its next update
+ *   using the cumulative penalty of [2] for the l1 part. At the end of an epoch
+ *   all the features are brought up to date so the model can be used.
+ *
+ *   A sample is a space FST and its reference, they are paired in loading order
+ *   so the train spaces and references must be given in the same order.
+ *
+ * [1] Adaptive subgradient methods for online learning and stochastic
+ *     optimization, John Duchi, Elad Hazan and Yoram Singer, Journal of Machine
+ *     Learning Research 12, 2121-2159, 2011.
+ * [2] Stochastic gradient descent training for L1-regularized log-linear models
+ *     with cumulative penalty, Yoshimasa Tsuruoka, Jun'ichi Tsujii and Sophia
+ *     Ananiadou, Proceedings of ACL-IJCNLP, 477-485, 2009.
+ ******************************************************************************/
+
+/* sgd_acc_t:
+ *   Accumulators of a feature for the stochastic optimizer. They need double
+ *   precision over long runs so they are kept in a table of the optimizer
+ *   instead of in the features shared with the other optimizers.
+ */
+typedef struct sgd_acc_s sgd_acc_t;
+struct sgd_acc_s {
+	lst_t  lst;
+	double gsq;  // Sum of the squared gradients
+	double pen;  // l1 penalty the feature could have received
+	double got;  // l1 penalty it actually received
+};
+
+typedef struct sgd_s sgd_t;
+struct sgd_s {
+	double   rho1[128];
+	double   rho2[128];
+	double   rho3[128];
+	double   eta;    // Base learning rate
+	int      bsz;    // Number of samples per mini-batch
+	grd_t   *grd;
+	int      nsmp;   // Number of samples
+	int     *smp;    // [2N] Space and reference FST index of the samples
+	int     *ord;    // [N] Order of the samples in the current epoch
+	uint64_t rnd;    // State of the shuffling generator
+	dat_t    bat;    // View on the FSTs of the current mini-batch
+	double   fx3;    // l3 part of the objective over the current epoch
+	map_t   *acc;    // Accumulators of the features by hash
+};
+
+/* sgd_new:
+ *   Create a new stochastic optimizer working on the dataset of the gradient
+ *   computer, with the regularization parameters taken from [rbp]. On error,
+ *   return NULL and set errno, EINVAL meaning that spaces and references can
+ *   not be paired.
+ *   Features lists can not be kept in memory across mini-batches as the used
+ *   features are collected when they are generated, so the cache level of the
+ *   computer is limited to 2.
+ */
+static
+sgd_t *sgd_new(grd_t *grd, const rbp_t *rbp, int bsz, double eta) {
+	const dat_t *dat = grd->dat;
+	sgd_t *sgd = malloc(sizeof(sgd_t));
+	if (sgd == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(sgd->rho1, rbp->rho1, sizeof(sgd->rho1));
+	memcpy(sgd->rho2, rbp->rho2, sizeof(sgd->rho2));
+	memcpy(sgd->rho3, rbp->rho3, sizeof(sgd->rho3));
+	sgd->eta  = eta;
+	sgd->bsz  = bsz;
+	sgd->grd  = grd;
+	sgd->rnd  = 0x9E3779B97F4A7C15ULL;
+	sgd->fx3  = 0.0;
+	sgd->smp  = malloc(sizeof(int) * 2 * max(dat->nfst, 1));
+	sgd->ord  = malloc(sizeof(int) * max(dat->nfst, 1));
+	sgd->bat  = (dat_t){.nfst = 0, .fst = NULL, .bat = NULL, .bidx = NULL};
+	sgd->bat.fst = malloc(sizeof(fst_t *) * 2 * bsz);
+	sgd->acc  = map_new();
+	if (sgd->smp == NULL || sgd->ord == NULL || sgd->bat.fst == NULL
+	 || sgd->acc == NULL) {
+		free(sgd->smp); free(sgd->ord); free(sgd->bat.fst);
+		map_free(sgd->acc, NULL);
+		free(sgd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	// The i-th space is paired with the i-th reference whatever the files
+	// they come from.
+	int ns = 0, nr = 0;
+	for (int i = 0; i < dat->nfst; i++) {
+		if (dat->fst[i]->mult > 0.0)
+			sgd->smp[2 * ns++] = i;
+		else
+			sgd->smp[2 * nr++ + 1] = i;
+	}
+	if (ns == 0 || ns != nr) {
+		free(sgd->smp); free(sgd->ord); free(sgd->bat.fst);
+		map_free(sgd->acc, NULL);
+		free(sgd);
+		errno = EINVAL;
+		return NULL;
+	}
+	sgd->nsmp = ns;
+	for (int i = 0; i < ns; i++)
+		sgd->ord[i] = i;
+	grd->cache = min(grd->cache, 2);
+	return sgd;
+}
+
+/* sgd_free:
+ *   Free the optimizer, the FSTs of the dataset are left untouched.
+ */
+static
+void sgd_free(sgd_t *sgd) {
+	free(sgd->bat.fst);
+	free(sgd->bat.bat);
+	free(sgd->bat.bidx);
+	free(sgd->smp);
+	free(sgd->ord);
+	map_free(sgd->acc, free);
+	free(sgd);
+}
+
+/* sgd_rand:
+ *   Small xorshift generator used to shuffle the samples. It is local to the
+ *   optimizer so the samples order only depend on the number of epochs done.
+ */
+static
+uint64_t sgd_rand(sgd_t *sgd) {
+	uint64_t x = sgd->rnd;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sgd->rnd = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* sgd_update:
+ *   Update a single feature at the current step of the model. Its gradient is
+ *   the one accumulated over the mini-batch and the regularization is applied
+ *   for all the steps since its last update. Each step is given 1/[nstp] of the
+ *   l1 and l2 penalties of the full objective, and the l3 one is proportional
+ *   to the frequency of the feature in the mini-batch. This l3 penalty at the
+ *   point where the gradient was computed is summed in [fx3] for the report.
+ */
+static
+void sgd_update(sgd_t *sgd, mdl_t *mdl, ftr_t *ftr, int nstp) {
+	const int    tag = mdl_gettag(ftr);
+	const int    lst = ftr->stm < 0 ? ~ftr->stm : ftr->stm;
+	const double dlt = (double)(mdl->stp - lst) / nstp;
+	const double g   = ftr->g;
+	const int    frq = ftr->frq;
+	ftr->stm = mdl->stp;
+	ftr->g   = 0.0;
+	ftr->frq = 0;
+	if (mdl->stt[tag] > mdl->itr)
+		return;
+	sgd->fx3 += sgd->rho3[tag] * frq * fabs(ftr->x);
+	// The sum of the squared gradients give the step size. A feature
+	// without any gradient yet cannot have moved so it doesn't get its
+	// accumulators before its first one.
+	const hsh_t hsh = map_gethsh(ftr);
+	sgd_acc_t *acc = map_find(sgd->acc, hsh);
+	if (acc == NULL) {
+		if (g == 0.0)
+			return;
+		acc = calloc(1, sizeof(sgd_acc_t));
+		if (acc == NULL)
+			fatal("out of memory");
+		map_insert(sgd->acc, hsh, acc);
+	}
+	acc->gsq += g * g;
+	if (acc->gsq == 0.0)
+		return;
+	const double eta = sgd->eta / sqrt(acc->gsq);
+	double x = ftr->x - eta * g;
+	x /= 1.0 + eta * sgd->rho2[tag] * dlt;
+	// The weight is moved toward zero by the difference between the l1
+	// penalty it could have received and the one it actually received,
+	// without crossing it.
+	acc->pen += eta * (sgd->rho1[tag] * dlt + sgd->rho3[tag] * frq);
+	const double u = acc->pen, q = acc->got, z = x;
+	if (x > 0.0)
+		x = max(0.0, x - (u + q));
+	else if (x < 0.0)
+		x = min(0.0, x + (u - q));
+	acc->got += x - z;
+	ftr->x    = x;
+}
+
+/* sgd_epoch:
+ *   Do one pass over the training samples in a new random order, updating the
+ *   model after each mini-batch. At the end all the features are brought up to
+ *   date, the ones of removed tags are taken out of the model, and the model
+ *   counts and objective are computed.
+ */
+static
+void sgd_epoch(sgd_t *sgd, mdl_t *mdl) {
+	grd_t *grd = sgd->grd;
+	dat_t *dat = grd->dat;
+	const int N = sgd->nsmp, B = sgd->bsz;
+	const int nstp = (N + B - 1) / B;
+	for (int i = N - 1; i > 0; i--) {
+		const int j = sgd_rand(sgd) % (uint64_t)(i + 1);
+		const int t = sgd->ord[i];
+		sgd->ord[i] = sgd->ord[j];
+		sgd->ord[j] = t;
+	}
+	// The features used by each mini-batch are collected in the active set
+	// of the model by the feature generator.
+	if (mdl->act == NULL) {
+		mdl->slst = 1024;
+		mdl->act  = malloc(sizeof(ftr_t *) * mdl->slst);
+		if (mdl->act == NULL)
+			fatal("out of memory");
+	}
+	grd->prg = prg_new(max(dat->nfst / 49, 1));
+	grd->bms = (bms_t){0.0, 0.0, 0.0, 0.0};
+	grd->dat = &sgd->bat;
+	prg_start(grd->prg);
+	double ll = 0.0;
+	sgd->fx3 = 0.0;
+	for (int b = 0; b < N; b += B) {
+		const int n = min(B, N - b);
+		for (int i = 0; i < n; i++) {
+			const int *smp = &sgd->smp[2 * sgd->ord[b + i]];
+			sgd->bat.fst[2 * i    ] = dat->fst[smp[0]];
+			sgd->bat.fst[2 * i + 1] = dat->fst[smp[1]];
+		}
+		sgd->bat.nfst = 2 * n;
+		sgd->bat.bwin = 0;
+		mdl->stp++;
+		mdl->nlst = 0;
+		ll += grd_run(grd);
+		for (long i = 0; i < mdl->nlst; i++)
+			sgd_update(sgd, mdl, mdl->act[i], nstp);
+	}
+	grd->dat = dat;
+	prg_end(grd->prg);
+	prg_free(grd->prg);
+	mdl->nlst = 0;
+	// Final pass over the full model to apply the pending regularization
+	// and remove features, this is done by the main thread only so the
+	// model can be modified safely.
+	double fx = ll, nx = 0.0;
+	for (int i = 0; i < 128; i++)
+		mdl->ntot[i] = mdl->nact[i] = 0;
+	const size_t cnt = mdl->ftrs->count;
+	ftr_t *ftr = mdl_next(mdl, NULL);
+	while (ftr != NULL) {
+		const int tag = mdl_gettag(ftr);
+		if (ftr->stm != mdl->stp)
+			sgd_update(sgd, mdl, ftr, nstp);
+		if (ftr->x == 0.0 && mdl->rem[tag] <= mdl->itr) {
+			free(map_remove(sgd->acc, map_gethsh(ftr)));
+			ftr = mdl_remove(mdl, ftr);
+			continue;
+		}
+		fx += sgd->rho2[tag] * ftr->x * ftr->x / 2.0;
+		fx += sgd->rho1[tag] * fabs(ftr->x);
+		nx += fabs(ftr->x);
+		mdl->ntot[tag]++;
+		if (ftr->x != 0.0)
+			mdl->nact[tag]++;
+		ftr = mdl_next(mdl, ftr);
+	}
+	if (mdl->ftrs->count != cnt)
+		mdl_pairclr(mdl);
+	fx += sgd->fx3;
+	mdl->nval = 1;
+	fprintf(stderr, "\tll=%.2f", -ll);
+	fprintf(stderr, " fx=%.2f",  fx);
+	fprintf(stderr, " |x|=%.2f\n", nx);
+}
+
+/*******************************************************************************
+ * Quasi-Newton optimizer
+ *
+ *   Second alternative optimizer implementing OWL-QN [1], a variant of L-BFGS
+ *   [2] which handle the l1 penalty by working in one orthant at a time using
+ *   a pseudo-gradient. It use the same gradient computation as rprop and is
+ *   called after each of them, so the line search is done across calls: each
+ *   call either accept the point just evaluated and choose a new direction, or
+ *   backtrack and ask for a new evaluation.
+ *
+ *   The optimizer work on dense vectors indexed by the position of features in
+ *   its own list. New features are appended at the end of the list as they are
+ *   reported by the model through its active set, so the history vectors just
+ *   get zero components for them.
+ *
+ * [1] Scalable training of L1-regularized log-linear models, Galen Andrew and
+ *     Jianfeng Gao, Proceedings of ICML, 33-40, 2007.
+ * [2] On the limited memory BFGS method for large scale optimization, Dong C.
+ *     Liu and Jorge Nocedal, Mathematical Programming 45, 503-528, 1989.
+ ******************************************************************************/
+
+typedef struct owl_s owl_t;
+struct owl_s {
+	double   rho1[128];
+	double   rho2[128];
+	double   rho3[128];
+	int      m;       // Size of the history
+	long     n, sn;   // Number of features and size of the vectors
+	ftr_t  **ftr;     // [N] Features in vectors order
+	double  *x, *g;   // [N] Last accepted point and its smooth gradient
+	double  *c;       // [N] l1 penalty of each feature
+	double  *pg, *d;  // [N] Pseudo-gradient and search direction
+	double **s, **y;  // [M][N] History of the updates
+	double  *rs;      // [M] Inverse of s·y for each history entry
+	int      k, nk;   // Next history entry and number of valid ones
+	double   fx;      // Objective value at the last accepted point
+	double   stp;     // Current step size of the line search
+	int      nls;     // Number of evaluation in the current line search
+};
+
+/* owl_new:
+ *   Create a new optimizer with an history of [m] updates, the regularization
+ *   parameters are taken from [rbp]. The model start to report new features
+ *   to the optimizer from now on.
+ */
+static
+owl_t *owl_new(mdl_t *mdl, const rbp_t *rbp, int m) {
+	owl_t *owl = malloc(sizeof(owl_t));
+	if (owl == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(owl->rho1, rbp->rho1, sizeof(owl->rho1));
+	memcpy(owl->rho2, rbp->rho2, sizeof(owl->rho2));
+	memcpy(owl->rho3, rbp->rho3, sizeof(owl->rho3));
+	owl->m   = m;
+	owl->n   = owl->sn = 0;
+	owl->ftr = NULL;
+	owl->x   = owl->g = owl->c = owl->pg = owl->d = NULL;
+	owl->s   = calloc(m, sizeof(double *));
+	owl->y   = calloc(m, sizeof(double *));
+	owl->rs  = calloc(m, sizeof(double));
+	owl->k   = owl->nk = 0;
+	owl->fx  = 0.0;
+	owl->stp = 0.0;
+	owl->nls = 0;
+	if (owl->s == NULL || owl->y == NULL || owl->rs == NULL) {
+		free(owl->s); free(owl->y); free(owl->rs);
+		free(owl);
+		errno = ENOMEM;
+		return NULL;
+	}
+	// The features already in the model are put in the active set so they
+	// will be picked up with the new ones at the first step.
+	free(mdl->act);
+	mdl->act  = NULL;
+	mdl->nlst = 0;
+	mdl->slst = 1024;
+	mdl->act  = malloc(sizeof(ftr_t *) * mdl->slst);
+	if (mdl->act == NULL)
+		fatal("out of memory");
+	for (ftr_t *ftr = mdl_next(mdl, NULL); ftr; ftr = mdl_next(mdl, ftr))
+		mdl_addact(mdl, &ftr, 1);
+	return owl;
+}
+
+/* owl_free:
+ *   Free all memory used by the optimizer.
+ */
+static
+void owl_free(owl_t *owl) {
+	for (int i = 0; i < owl->m; i++) {
+		free(owl->s[i]);
+		free(owl->y[i]);
+	}
+	free(owl->s);
+	free(owl->y);
+	free(owl->rs);
+	free(owl->ftr);
+	free(owl->x);  free(owl->g);  free(owl->c);
+	free(owl->pg); free(owl->d);
+	free(owl);
+}
+
+/* owl_grow:
+ *   Append the features reported by the model since the last call to the
+ *   optimizer list, growing all the vectors if needed. The new components are
+ *   all zero so the current point and history are unchanged.
+ */
+static
+void owl_grow(owl_t *owl, mdl_t *mdl) {
+	const long n = owl->n + mdl->nlst;
+	if (n > owl->sn) {
+		const long sn = max(owl->sn * 2, n);
+		double **vec[5 + 2 * owl->m];
+		int nv = 0;
+		vec[nv++] = &owl->x;  vec[nv++] = &owl->g;  vec[nv++] = &owl->c;
+		vec[nv++] = &owl->pg; vec[nv++] = &owl->d;
+		for (int i = 0; i < owl->m; i++) {
+			vec[nv++] = &owl->s[i];
+			vec[nv++] = &owl->y[i];
+		}
+		for (int i = 0; i < nv; i++) {
+			double *tmp = realloc(*vec[i], sizeof(double) * sn);
+			if (tmp == NULL)
+				fatal("out of memory");
+			memset(tmp + owl->n, 0, sizeof(double) * (sn - owl->n));
+			*vec[i] = tmp;
+		}
+		ftr_t **tmp = realloc(owl->ftr, sizeof(ftr_t *) * sn);
+		if (tmp == NULL)
+			fatal("out of memory");
+		owl->ftr = tmp;
+		owl->sn  = sn;
+	}
+	memcpy(owl->ftr + owl->n, mdl->act, sizeof(ftr_t *) * mdl->nlst);
+	owl->n    = n;
+	mdl->nlst = 0;
+}
+
+/* owl_dot:
+ *   Dot product of two vectors of the optimizer.
+ */
+static
+double owl_dot(const owl_t *owl, const double *a, const double *b) {
+	double r = 0.0;
+	for (long i = 0; i < owl->n; i++)
+		r += a[i] * b[i];
+	return r;
+}
+
+/* owl_move:
+ *   Set the model at the point x + stp·d projected on the orthant of x, or of
+ *   the pseudo-gradient descent direction for the zero components.
+ */
+static
+void owl_move(owl_t *owl) {
+	for (long i = 0; i < owl->n; i++) {
+		double o = owl->x[i];
+		if (o == 0.0)
+			o = -owl->pg[i];
+		double v = owl->x[i] + owl->stp * owl->d[i];
+		if (v * o <= 0.0)
+			v = 0.0;
+		owl->ftr[i]->x = v;
+	}
+}
+
+/* owl_direction:
+ *   Compute the pseudo-gradient at the accepted point and the new direction
+ *   using the two-loop recursion over the history. The direction is restricted
+ *   to the components where it agree with the pseudo-gradient. Return the norm
+ *   of the pseudo-gradient.
+ */
+static
+double owl_direction(owl_t *owl) {
+	const long n = owl->n;
+	double npg = 0.0;
+	for (long i = 0; i < n; i++) {
+		const double x = owl->x[i], g = owl->g[i], c = owl->c[i];
+		double pg = g;
+		     if (x < 0.0)   pg = g - c;
+		else if (x > 0.0)   pg = g + c;
+		else if (g < -c)    pg = g + c;
+		else if (g >  c)    pg = g - c;
+		else                pg = 0.0;
+		owl->pg[i] = pg;
+		owl->d[i]  = -pg;
+		npg += pg * pg;
+	}
+	double a[owl->m];
+	for (int j = 0, i = owl->k; j < owl->nk; j++) {
+		i = (i + owl->m - 1) % owl->m;
+		a[i] = owl->rs[i] * owl_dot(owl, owl->s[i], owl->d);
+		for (long f = 0; f < n; f++)
+			owl->d[f] -= a[i] * owl->y[i][f];
+	}
+	if (owl->nk != 0) {
+		const int i = (owl->k + owl->m - 1) % owl->m;
+		const double yy = owl_dot(owl, owl->y[i], owl->y[i]);
+		const double scl = 1.0 / (owl->rs[i] * yy);
+		for (long f = 0; f < n; f++)
+			owl->d[f] *= scl;
+	}
+	for (int j = 0, i = owl->k - owl->nk; j < owl->nk; j++, i++) {
+		const int h = (i + owl->m) % owl->m;
+		const double b = owl->rs[h] * owl_dot(owl, owl->y[h], owl->d);
+		for (long f = 0; f < n; f++)
+			owl->d[f] += owl->s[h][f] * (a[h] - b);
+	}
+	for (long i = 0; i < n; i++)
+		if (owl->d[i] * owl->pg[i] >= 0.0)
+			owl->d[i] = 0.0;
+	return sqrt(npg);
+}
+
+/* owl_remove:
+ *   Remove from the model and from all the vectors of the optimizer the
+ *   features marked in [del]. The history is kept on the remaining components
+ *   but its entries which are no longer a descent pair are dropped with all the
+ *   older ones. The history must not be full, as the next entry hold the point
+ *   being processed by owl_step.
+ */
+static
+void owl_remove(owl_t *owl, mdl_t *mdl, const char del[]) {
+	double *vec[5 + 2 * owl->m];
+	int nv = 0;
+	vec[nv++] = owl->x;  vec[nv++] = owl->g;  vec[nv++] = owl->c;
+	vec[nv++] = owl->pg; vec[nv++] = owl->d;
+	for (int i = 0; i < owl->m; i++) {
+		vec[nv++] = owl->s[i];
+		vec[nv++] = owl->y[i];
+	}
+	long n = 0;
+	for (long i = 0; i < owl->n; i++) {
+		if (del[i]) {
+			free(map_remove(mdl->ftrs, map_gethsh(owl->ftr[i])));
+			continue;
+		}
+		owl->ftr[n] = owl->ftr[i];
+		for (int v = 0; v < nv; v++)
+			vec[v][n] = vec[v][i];
+		n++;
+	}
+	owl->n = n;
+	mdl_pairclr(mdl);
+	for (int j = 0, i = owl->k; j < owl->nk; j++) {
+		i = (i + owl->m - 1) % owl->m;
+		const double sy = owl_dot(owl, owl->s[i], owl->y[i]);
+		if (sy <= 0.0) {
+			owl->nk = j;
+			break;
+		}
+		owl->rs[i] = 1.0 / sy;
+	}
+}
+
+/* owl_step:
+ *   Process the result of a gradient computation at the current point of the
+ *   model. If the point satisfy the sufficient decrease condition along the
+ *   current direction it is accepted, the history is updated and a new search
+ *   direction is chosen, else the step is reduced. In both case, the model is
+ *   set to the next point to evaluate.
+ *   If the line search fail, the history is cleared and the search restart
+ *   along the pseudo-gradient.
+ *   Features are removed like with rprop, by their tag or frequency. If one of
+ *   them was not null at the current or accepted point, the objective is no
+ *   longer comparable so the line search restart from the current point.
+ */
+static
+void owl_step(owl_t *owl, mdl_t *mdl, double ll) {
+	owl_grow(owl, mdl);
+	long n = owl->n;
+	// The next history entry is used as scratch space below, so if the
+	// history is full its oldest pair is dropped before being overwritten.
+	owl->nk = min(owl->nk, owl->m - 1);
+	double *xc = owl->s[owl->k], *gc = owl->y[owl->k];
+	char *del = malloc(max(n, 1));
+	if (del == NULL)
+		fatal("out of memory");
+	// Collect the point and its gradient in the next history entry so if
+	// it is accepted the differences can be computed in place. The l2 part
+	// is smooth so it is added to the gradient.
+	double fx = ll, nx = 0.0;
+	long nrem = 0;
+	int live = 0;
+	for (long i = 0; i < n; i++) {
+		ftr_t *ftr = owl->ftr[i];
+		const int tag = mdl_gettag(ftr);
+		const double x = ftr->x;
+		del[i] = (x == 0.0 && mdl->rem[tag] <= mdl->itr)
+		      || ftr->frq < mdl->frq;
+		if (del[i]) {
+			live |= x != 0.0 || owl->x[i] != 0.0;
+			nrem++;
+			continue;
+		}
+		xc[i] = x;
+		gc[i] = ftr->g + owl->rho2[tag] * x;
+		owl->c[i] = owl->rho1[tag] + owl->rho3[tag] * ftr->frq;
+		if (mdl->stt[tag] > mdl->itr)
+			gc[i] = owl->c[i] = 0.0;
+		fx += owl->rho2[tag] * x * x / 2.0;
+		fx += owl->c[i] * fabs(x);
+		nx += fabs(x);
+		ftr->g   = 0.0;
+		ftr->frq = 0;
+	}
+	if (nrem != 0) {
+		owl_remove(owl, mdl, del);
+		n = owl->n;
+		if (live)
+			owl->nls = 0;
+	}
+	free(del);
+	// Check the sufficient decrease condition with the pseudo-gradient of
+	// the last accepted point. The first point is always accepted.
+	int acc = owl->nls == 0;
+	if (!acc) {
+		double dec = 0.0;
+		for (long i = 0; i < n; i++)
+			dec += owl->pg[i] * (xc[i] - owl->x[i]);
+		acc = fx <= owl->fx + 1e-4 * dec;
+	}
+	if (acc) {
+		if (owl->nls != 0) {
+			double sy = 0.0;
+			for (long i = 0; i < n; i++) {
+				xc[i] -= owl->x[i];
+				gc[i] -= owl->g[i];
+				sy += xc[i] * gc[i];
+				owl->x[i] = xc[i] + owl->x[i];
+				owl->g[i] = gc[i] + owl->g[i];
+			}
+			if (sy > 0.0) {
+				owl->rs[owl->k] = 1.0 / sy;
+				owl->k  = (owl->k + 1) % owl->m;
+				owl->nk = owl->nk + 1;
+			}
+		} else {
+			memcpy(owl->x, xc, sizeof(double) * n);
+			memcpy(owl->g, gc, sizeof(double) * n);
+		}
+		owl->fx = fx;
+		const double npg = owl_direction(owl);
+		owl->stp = owl->nk != 0 ? 1.0 : 1.0 / max(npg, 1.0);
+		owl->nls = 1;
+	} else if (owl->nls < 20) {
+		owl->stp /= 2.0;
+		owl->nls++;
+	} else {
+		owl->k   = owl->nk = 0;
+		const double npg = owl_direction(owl);
+		owl->stp = 1.0 / max(npg, 1.0);
+		owl->nls = 1;
+	}
+	owl_move(owl);
+	double ng = 0.0, nd = 0.0;
+	for (long i = 0; i < n; i++) {
+		ng += fabs(owl->pg[i]);
+		nd += fabs(owl->stp * owl->d[i]);
+	}
+	fprintf(stderr, "\tll=%.2f", -ll);
+	fprintf(stderr, " fx=%.2f",  fx);
+	fprintf(stderr, " |x|=%.2f",   nx);
+	fprintf(stderr, " |g|=%.2f",   ng);
+	fprintf(stderr, " |d|=%.2f",   nd);
+	fprintf(stderr, " %s\n", acc ? "accept" : "backtrack");
+}
+
+/*******************************************************************************
+ * Distributed training
+ *
+ *   Several processes, each one owning a shard of the training data, can work
+ *   together on the same model. Each of them compute the gradient on its own
+ *   shard and the partial results are summed over all processes before the
+ *   optimizer step, so every process do exactly the same step and keep the
+ *   same model.
+ *   The processes are connected in a star through a Unix socket: the process
+ *   of rank 0 gather the partial gradients of the others in rank order, sum
+ *   them, and send back the total. Only the features with a non-zero gradient
+ *   or frequency are exchanged, as well as the ones not yet seen by the
+ *   optimizer so the model of each process contain all of them.
+ *
+ *   A cheaper alternative is the iterative parameter mixing [1] where each
+ *   process train its own model on its shard for several iterations and next
+ *   the models are averaged, weighted by the size of the shards, through the
+ *   same star. Only the non-zero weights are exchanged in this case.
+ *
+ * [1] Distributed training strategies for the structured perceptron, Ryan
+ *     McDonald, Keith Hall and Gideon Mann, Proceedings of NAACL-HLT, 456-464,
+ *     2010.
+ ******************************************************************************/
+
+typedef struct dst_s dst_t;
+struct dst_s {
+	int     rank, size;
+	int    *fd;         // [size] Sockets, only fd[0] is used on workers
+	char   *buf;        // Message buffer
+	size_t  sbuf;
+	double  tcom;       // Time spent in the last exchange
+	long    nsnd, nrcv; // Bytes sent and received in the last exchange
+};
+
+#define DST_ENTRY (sizeof(hsh_t) + sizeof(double) + sizeof(int))
+#define DST_HEADER (sizeof(long) + sizeof(double))
+
+/* dst_now:
+ *   Return the value of a monotonic clock in seconds.
+ */
+static
+double dst_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* dst_write:
+ *   Write the full buffer to a socket. Return 0 and set errno on failure.
+ */
+static
+int dst_write(int fd, const void *buf, size_t size) {
+	const char *ptr = buf;
+	while (size != 0) {
+		const ssize_t n = write(fd, ptr, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		ptr += n, size -= n;
+	}
+	return 1;
+}
+
+/* dst_read:
+ *   Read exactly [size] bytes from a socket. Return 0 and set errno on failure
+ *   or if the connection is closed early.
+ */
+static
+int dst_read(int fd, void *buf, size_t size) {
+	char *ptr = buf;
+	while (size != 0) {
+		const ssize_t n = read(fd, ptr, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0)
+			errno = EPIPE;
+		if (n <= 0)
+			return 0;
+		ptr += n, size -= n;
+	}
+	return 1;
+}
+
+/* dst_new:
+ *   Connect the process [rank] out of [size] to the others through the Unix
+ *   socket [path]. The process of rank 0 create the socket and wait for all
+ *   the others, which retry for about a minute if it is not yet ready. Return
+ *   NULL and set errno on failure.
+ */
+static
+dst_t *dst_new(const char *path, int rank, int size) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	dst_t *dst = malloc(sizeof(dst_t));
+	if (dst == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	dst->rank = rank;
+	dst->size = size;
+	dst->buf  = NULL;
+	dst->sbuf = 0;
+	dst->tcom = 0.0;
+	dst->nsnd = dst->nrcv = 0;
+	dst->fd   = malloc(sizeof(int) * size);
+	if (dst->fd == NULL) {
+		free(dst);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (int i = 0; i < size; i++)
+		dst->fd[i] = -1;
+	if (rank == 0) {
+		// The root accept the connections in any order, each worker
+		// start by sending its rank.
+		const int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (srv < 0)
+			goto error;
+		unlink(path);
+		if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) != 0
+		 || listen(srv, size) != 0) {
+			close(srv);
+			goto error;
+		}
+		for (int i = 1; i < size; i++) {
+			int fd = accept(srv, NULL, NULL), r;
+			if (fd < 0 || !dst_read(fd, &r, sizeof(int))) {
+				close(srv);
+				goto error;
+			}
+			if (r <= 0 || r >= size || dst->fd[r] != -1) {
+				close(srv);
+				errno = EINVAL;
+				goto error;
+			}
+			dst->fd[r] = fd;
+		}
+		close(srv);
+		unlink(path);
+	} else {
+		for (int t = 0; ; t++) {
+			const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0)
+				goto error;
+			struct sockaddr *sa = (struct sockaddr *)&addr;
+			if (connect(fd, sa, sizeof(addr)) == 0) {
+				dst->fd[0] = fd;
+				break;
+			}
+			close(fd);
+			if (t == 600)
+				goto error;
+			const struct timespec ts = {0, 100000000};
+			nanosleep(&ts, NULL);
+		}
+		if (!dst_write(dst->fd[0], &rank, sizeof(int)))
+			goto error;
+	}
+	return dst;
+    error:;
+	const int err = errno;
+	for (int i = 0; i < size; i++)
+		if (dst->fd[i] != -1)
+			close(dst->fd[i]);
+	free(dst->fd);
+	free(dst);
+	errno = err;
+	return NULL;
+}
+
+/* dst_free:
+ *   Close the connections and free the object.
+ */
+static
+void dst_free(dst_t *dst) {
+	for (int i = 0; i < dst->size; i++)
+		if (dst->fd[i] != -1)
+			close(dst->fd[i]);
+	free(dst->fd);
+	free(dst->buf);
+	free(dst);
+}
+
+/* dst_reserve:
+ *   Ensure the message buffer can hold [n] entries.
+ */
+static
+void dst_reserve(dst_t *dst, long n) {
+	const size_t size = DST_HEADER + DST_ENTRY * n;
+	if (size <= dst->sbuf)
+		return;
+	char *tmp = realloc(dst->buf, max(size, dst->sbuf * 2));
+	if (tmp == NULL)
+		fatal("out of memory");
+	dst->buf  = tmp;
+	dst->sbuf = max(size, dst->sbuf * 2);
+}
+
+/* dst_pack:
+ *   Build a message with the gradient and frequency of the features of the
+ *   model that have to be exchanged and the value [fx]. If [mix] is true, the
+ *   weights of the features are sent instead. Return the size of the message.
+ */
+static
+size_t dst_pack(dst_t *dst, mdl_t *mdl, double fx, int mix) {
+	long n = 0;
+	dst_reserve(dst, 1024);
+	for (ftr_t *ftr = mdl_next(mdl, NULL); ftr; ftr = mdl_next(mdl, ftr)) {
+		if (mix && ftr->x == 0.0)
+			continue;
+		if (!mix && ftr->g == 0.0 && ftr->frq == 0 && ftr->stp != 0.0)
+			continue;
+		dst_reserve(dst, n + 1);
+		char *ptr = dst->buf + DST_HEADER + DST_ENTRY * n++;
+		const hsh_t hsh = map_gethsh(ftr);
+		memcpy(ptr, &hsh, sizeof(hsh_t));
+		ptr += sizeof(hsh_t);
+		memcpy(ptr, mix ? &ftr->x : &ftr->g, sizeof(double));
+		ptr += sizeof(double);
+		memcpy(ptr, &ftr->frq, sizeof(int));
+	}
+	memcpy(dst->buf, &n, sizeof(long));
+	memcpy(dst->buf + sizeof(long), &fx, sizeof(double));
+	return DST_HEADER + DST_ENTRY * n;
+}
+
+/* dst_recv:
+ *   Receive a message from [fd] and add its entries to the model, creating
+ *   the features not yet present. Return the value of the message. If [mix]
+ *   is true, the message hold weights which are added scaled by its value.
+ */
+static
+double dst_recv(dst_t *dst, mdl_t *mdl, int fd, int mix) {
+	long n; double fx;
+	char hdr[DST_HEADER];
+	if (!dst_read(fd, hdr, DST_HEADER))
+		pfatal("cannot receive gradient");
+	memcpy(&n,  hdr, sizeof(long));
+	memcpy(&fx, hdr + sizeof(long), sizeof(double));
+	dst_reserve(dst, n);
+	if (!dst_read(fd, dst->buf, DST_ENTRY * n))
+		pfatal("cannot receive gradient");
+	dst->nrcv += DST_HEADER + DST_ENTRY * n;
+	for (long i = 0; i < n; i++) {
+		const char *ptr = dst->buf + DST_ENTRY * i;
+		hsh_t hsh; double g; int frq;
+		memcpy(&hsh, ptr, sizeof(hsh_t));
+		ptr += sizeof(hsh_t);
+		memcpy(&g, ptr, sizeof(double));
+		ptr += sizeof(double);
+		memcpy(&frq, ptr, sizeof(int));
+		ftr_t *ftr = mdl_getftr(mdl, hsh);
+		if (ftr == NULL)
+			fatal("out of memory");
+		if (mix) {
+			ftr->x += fx * g;
+		} else {
+			ftr->g   += g;
+			ftr->frq += frq;
+		}
+	}
+	return fx;
+}
+
+/* dst_reduce:
+ *   Sum the gradient, the frequencies and the objective value [fx] over all
+ *   the processes. On return, the model of each process hold the same values
+ *   and the total objective is returned.
+ */
+static
+double dst_reduce(dst_t *dst, mdl_t *mdl, double fx) {
+	const double t0 = dst_now();
+	dst->nsnd = dst->nrcv = 0;
+	if (dst->rank != 0) {
+		const size_t size = dst_pack(dst, mdl, fx, 0);
+		if (!dst_write(dst->fd[0], dst->buf, size))
+			pfatal("cannot send gradient");
+		dst->nsnd += size;
+		// The local values are replaced by the totals, including the
+		// features not sent back as they sum to zero.
+		ftr_t *ftr = mdl_next(mdl, NULL);
+		for ( ; ftr != NULL; ftr = mdl_next(mdl, ftr))
+			ftr->g = 0.0, ftr->frq = 0;
+		fx = dst_recv(dst, mdl, dst->fd[0], 0);
+	} else {
+		for (int r = 1; r < dst->size; r++)
+			fx += dst_recv(dst, mdl, dst->fd[r], 0);
+		const size_t size = dst_pack(dst, mdl, fx, 0);
+		for (int r = 1; r < dst->size; r++) {
+			if (!dst_write(dst->fd[r], dst->buf, size))
+				pfatal("cannot send gradient");
+			dst->nsnd += size;
+		}
+	}
+	dst->tcom = dst_now() - t0;
+	return fx;
+}
+
+/* dst_mix:
+ *   Replace the weights of the model by their average over all processes, the
+ *   model of each process being weighted by [wgh]. The optimizer is restarted
+ *   from the new point: the step sizes are kept but the previous gradient and
+ *   update are cleared as they refer to the local model.
+ */
+static
+void dst_mix(dst_t *dst, mdl_t *mdl, double wgh) {
+	const double t0 = dst_now();
+	dst->nsnd = dst->nrcv = 0;
+	if (dst->rank != 0) {
+		const size_t size = dst_pack(dst, mdl, wgh, 1);
+		if (!dst_write(dst->fd[0], dst->buf, size))
+			pfatal("cannot send model");
+		dst->nsnd += size;
+		ftr_t *ftr = mdl_next(mdl, NULL);
+		for ( ; ftr != NULL; ftr = mdl_next(mdl, ftr))
+			ftr->x = 0.0;
+		dst_recv(dst, mdl, dst->fd[0], 1);
+	} else {
+		ftr_t *ftr = mdl_next(mdl, NULL);
+		for ( ; ftr != NULL; ftr = mdl_next(mdl, ftr))
+			ftr->x *= wgh;
+		double tot = wgh;
+		for (int r = 1; r < dst->size; r++)
+			tot += dst_recv(dst, mdl, dst->fd[r], 1);
+		ftr = mdl_next(mdl, NULL);
+		for ( ; ftr != NULL; ftr = mdl_next(mdl, ftr))
+			ftr->x /= tot;
+		const size_t size = dst_pack(dst, mdl, 1.0, 1);
+		for (int r = 1; r < dst->size; r++) {
+			if (!dst_write(dst->fd[r], dst->buf, size))
+				pfatal("cannot send model");
+			dst->nsnd += size;
+		}
+	}
+	// The weights changed so the dormant features are woken up and the
+	// active set and counts have to be computed again.
+	ftr_t *ftr = mdl_next(mdl, NULL);
+	for ( ; ftr != NULL; ftr = mdl_next(mdl, ftr))
+		ftr->gp = ftr->dlt = 0.0, ftr->dor = 0;
+	memset(mdl->ndor, 0, sizeof(mdl->ndor));
+	free(mdl->act);
+	mdl->act  = NULL;
+	mdl->nlst = 0;
+	mdl->slst = 0;
+	mdl->nval = 0;
+	dst->tcom = dst_now() - t0;
+}
+
+/*******************************************************************************
+ * Checkpoints
+ *
+ *   A checkpoint store the full state of a training so it can be resumed later
+ *   exactly as if it was never interrupted: the string pool, all the fields of
+ *   the features used by the optimizers, the active set, the position in the
+ *   training, and the state of the stochastic optimizer if any. Each value is
+ *   written separately on 64 bits in the host byte order, so the format does
+ *   not depend on the layout of the structures, but it is only meant to be read
+ *   back on the same kind of host.
+ *
+ *   In distributed mode only the root save the checkpoints. With model mixing
+ *   the ranks models differ between two mixings, so on resume all the ranks
+ *   start again from the root one, as if a mixing was just done.
+ ******************************************************************************/
+#define CKP_MAGIC "LOSTCKP3"
+
+/* ckp_put/ckp_get:
+ *   Write or read a block of data, return true on success.
+ */
+static
+int ckp_put(FILE *file, const void *ptr, size_t size) {
+	return fwrite(ptr, size, 1, file) == 1;
+}
+static
+int ckp_get(FILE *file, void *ptr, size_t size) {
+	return fread(ptr, size, 1, file) == 1;
+}
+
+/* ckp_put[iud]/ckp_get[iud]:
+ *   Write or read a single signed integer, unsigned integer, or double value
+ *   with a fixed width of 64 bits. Return true on success.
+ */
+static
+int ckp_puti(FILE *file, int64_t val) {
+	return ckp_put(file, &val, sizeof(int64_t));
+}
+static
+int ckp_putu(FILE *file, uint64_t val) {
+	return ckp_put(file, &val, sizeof(uint64_t));
+}
+static
+int ckp_putd(FILE *file, double val) {
+	return ckp_put(file, &val, sizeof(double));
+}
+static
+int ckp_geti(FILE *file, int64_t *val) {
+	return ckp_get(file, val, sizeof(int64_t));
+}
+static
+int ckp_getu(FILE *file, uint64_t *val) {
+	return ckp_get(file, val, sizeof(uint64_t));
+}
+static
+int ckp_getd(FILE *file, double *val) {
+	return ckp_get(file, val, sizeof(double));
+}
+
+/* ckp_putftr/ckp_getftr:
+ *   Write or read all the fields of a feature except its hash and list node.
+ */
+static
+int ckp_putftr(FILE *file, const ftr_t *ftr) {
+	int ok = ckp_putd(file, ftr->x);
+	ok = ok && ckp_putd(file, ftr->g);
+	ok = ok && ckp_putd(file, ftr->stp);
+	ok = ok && ckp_putd(file, ftr->dlt);
+	ok = ok && ckp_putd(file, ftr->gp);
+	ok = ok && ckp_puti(file, ftr->frq);
+	ok = ok && ckp_puti(file, ftr->dor);
+	ok = ok && ckp_puti(file, ftr->stm);
+	return ok;
+}
+static
+int ckp_getftr(FILE *file, ftr_t *ftr) {
+	double stp, dlt, gp; int64_t frq, dor, stm;
+	int ok = ckp_getd(file, &ftr->x);
+	ok = ok && ckp_getd(file, &ftr->g);
+	ok = ok && ckp_getd(file, &stp);
+	ok = ok && ckp_getd(file, &dlt);
+	ok = ok && ckp_getd(file, &gp);
+	ok = ok && ckp_geti(file, &frq);
+	ok = ok && ckp_geti(file, &dor);
+	ok = ok && ckp_geti(file, &stm);
+	if (!ok)
+		return 0;
+	if (frq < 0 || frq > INT_MAX || dor < 0 || dor > INT_MAX
+	 || stm < -INT_MAX || stm > INT_MAX) {
+		errno = EZEPFMT;
+		return 0;
+	}
+	ftr->stp = stp;
+	ftr->dlt = dlt;
+	ftr->gp  = gp;
+	ftr->frq = frq;
+	ftr->dor = dor;
+	ftr->stm = stm;
+	return 1;
+}
+
+/* ckp_save:
+ *   Save a checkpoint of the model and the stochastic optimizer [sgd] which may
+ *   be NULL. The file is first written under a temporary name and renamed once
+ *   complete so a crash during the save leave the previous one intact. Return
+ *   true on success.
+ */
+static
+int ckp_save(const char *fn, mdl_t *mdl, const sgd_t *sgd) {
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+	FILE *file = fopen(tmp, "wb");
+	if (file == NULL)
+		return 0;
+	int ok = ckp_put(file, CKP_MAGIC, 8);
+	ok = ok && ckp_puti(file, mdl->itr);
+	ok = ok && ckp_puti(file, mdl->stp);
+	ok = ok && ckp_putu(file, mdl->ftrs->size);
+	// The string pool, each string with its hash and length, the hash is
+	// checked on load to catch corrupted files.
+	ok = ok && ckp_puti(file, mdl->ssp->map->count);
+	ist_t *str = map_next(mdl->ssp->map, NULL);
+	for ( ; ok && str != NULL; str = map_next(mdl->ssp->map, str)) {
+		const size_t len = strlen(str->str);
+		ok = ok && ckp_putu(file, map_gethsh(str));
+		ok = ok && ckp_putu(file, len);
+		ok = ok && ckp_put(file, str->str, len);
+	}
+	// The features with all their fields except the list node.
+	ok = ok && ckp_puti(file, mdl->ftrs->count);
+	ftr_t *ftr = mdl_next(mdl, NULL);
+	for ( ; ok && ftr != NULL; ftr = mdl_next(mdl, ftr)) {
+		ok = ok && ckp_putu(file, map_gethsh(ftr));
+		ok = ok && ckp_putftr(file, ftr);
+	}
+	// The active set in its current order, or -1 if not used.
+	const long n = mdl->act != NULL ? mdl->nlst : -1;
+	ok = ok && ckp_puti(file, n);
+	for (long i = 0; ok && i < n; i++)
+		ok = ok && ckp_putu(file, map_gethsh(mdl->act[i]));
+	// The shuffling state and the accumulators of the stochastic optimizer,
+	// or -1.
+	ok = ok && ckp_puti(file, sgd != NULL ? sgd->nsmp : -1);
+	if (ok && sgd != NULL) {
+		ok = ok && ckp_putu(file, sgd->rnd);
+		for (int i = 0; ok && i < sgd->nsmp; i++)
+			ok = ok && ckp_puti(file, sgd->ord[i]);
+		ok = ok && ckp_puti(file, sgd->acc->count);
+		sgd_acc_t *acc = map_next(sgd->acc, NULL);
+		for ( ; ok && acc != NULL; acc = map_next(sgd->acc, acc)) {
+			ok = ok && ckp_putu(file, map_gethsh(acc));
+			ok = ok && ckp_putd(file, acc->gsq);
+			ok = ok && ckp_putd(file, acc->pen);
+			ok = ok && ckp_putd(file, acc->got);
+		}
+	}
+	if (fclose(file) != 0)
+		ok = 0;
+	if (ok && rename(tmp, fn) != 0)
+		ok = 0;
+	return ok;
+}
+
+/* ckp_load:
+ *   Restore the state saved by [ckp_save] in the model and the stochastic
+ *   optimizer. The checkpoint must have been saved with the same optimizer
+ *   and dataset. Return true on success, on failure errno is set, EZEPFMT if
+ *   the file is invalid or doesn't match the current training.
+ */
+static
+int ckp_load(const char *fn, mdl_t *mdl, sgd_t *sgd) {
+	FILE *file = fopen(fn, "rb");
+	if (file == NULL)
+		return 0;
+	errno = 0;
+	char mgc[8]; int64_t itr, stp, n; uint64_t size;
+	int ok = ckp_get(file, mgc, 8) && !memcmp(mgc, CKP_MAGIC, 8);
+	ok = ok && ckp_geti(file, &itr) && itr >= 0 && itr <= INT_MAX;
+	ok = ok && ckp_geti(file, &stp) && stp >= 0 && stp <= INT_MAX;
+	ok = ok && ckp_getu(file, &size);
+	if (ok) {
+		mdl->itr = itr;
+		mdl->stp = stp;
+	}
+	ok = ok && ckp_geti(file, &n);
+	for (int64_t i = 0; ok && i < n; i++) {
+		uint64_t hsh, len;
+		ok = ok && ckp_getu(file, &hsh);
+		ok = ok && ckp_getu(file, &len) && len < INT_MAX;
+		char *buf = ok ? malloc(len + 1) : NULL;
+		ok = ok && buf != NULL && ckp_get(file, buf, len);
+		ok = ok && hsh_buffer(buf, len) == hsh;
+		if (ok) {
+			buf[len] = '\0';
+			ssp_buffer(mdl->ssp, buf, len, 1);
+		}
+		free(buf);
+	}
+	// The bucket table is given back its size as the optimizer split the
+	// work in shards according to it.
+	if (ok && size > mdl->ftrs->size && !(size & (size - 1)))
+		mdl->ftrs->size = size;
+	memset(mdl->ndor, 0, sizeof(mdl->ndor));
+	ok = ok && ckp_geti(file, &n);
+	for (int64_t i = 0; ok && i < n; i++) {
+		uint64_t hsh;
+		ok = ok && ckp_getu(file, &hsh);
+		ftr_t *ftr = ok ? mdl_getftr(mdl, hsh) : NULL;
+		ok = ok && ftr != NULL;
+		ok = ok && ckp_getftr(file, ftr);
+		if (ok && ftr->dor != 0)
+			mdl->ndor[mdl_gettag(ftr)]++;
+	}
+	ok = ok && ckp_geti(file, &n);
+	if (ok) {
+		free(mdl->act);
+		mdl->act  = NULL;
+		mdl->nlst = 0;
+		mdl->slst = 0;
+	}
+	if (ok && n >= 0) {
+		mdl->slst = max(n, 1024);
+		mdl->act  = malloc(sizeof(ftr_t *) * mdl->slst);
+		ok = mdl->act != NULL;
+	}
+	for (int64_t i = 0; ok && i < n; i++) {
+		uint64_t hsh;
+		ok = ok && ckp_getu(file, &hsh);
+		ftr_t *ftr = ok ? map_find(mdl->ftrs, hsh) : NULL;
+		ok = ok && ftr != NULL;
+		if (ok)
+			mdl->act[mdl->nlst++] = ftr;
+	}
+	ok = ok && ckp_geti(file, &n);
+	if (ok && n >= 0) {
+		ok = sgd != NULL && sgd->nsmp == n;
+		ok = ok && ckp_getu(file, &sgd->rnd);
+		for (int i = 0; ok && i < n; i++) {
+			int64_t v;
+			ok = ckp_geti(file, &v) && v >= 0 && v < n;
+			if (ok)
+				sgd->ord[i] = v;
+		}
+		ok = ok && ckp_geti(file, &n);
+		for (int64_t i = 0; ok && i < n; i++) {
+			uint64_t hsh;
+			sgd_acc_t *acc = calloc(1, sizeof(sgd_acc_t));
+			ok = acc != NULL && ckp_getu(file, &hsh);
+			ok = ok && ckp_getd(file, &acc->gsq);
+			ok = ok && ckp_getd(file, &acc->pen);
+			ok = ok && ckp_getd(file, &acc->got);
+			if (ok && map_insert(sgd->acc, hsh, acc) == acc)
+				continue;
+			free(acc);
+			ok = 0;
+		}
+	} else if (ok && sgd != NULL) {
+		ok = 0;
+	}
+	if (!ok && errno == 0)
+		errno = EZEPFMT;
+	fclose(file);
+	return ok;
+}
+
+/*******************************************************************************
+ * Scorer
+ *
+ *   Evaluate the decoded paths against references paths without going through
+ *   the output files. A reference is a single path which is followed in the
+ *   decoded lattice in order to find the span of each of its segments, so this
+ *   work both for tagging and for segmentation. A segment is correct if the
+ *   best path go through the same span with the same output label, and the
+ *   token accuracy is the fraction of correct reference segments.
+ ******************************************************************************/
+
+typedef struct scr_s scr_t;
+struct scr_s {
+	dat_t   *ref;      // Reference paths in the decoding order
+	int      nlbl;     // Number of output labels seen
+	int      slbl;     // Size of the labels arrays
+	lbl_t  **lbl;      // [L] Output labels
+	long   (*cnt)[3];  // [L] Count in reference, in hypothesis and correct
+	long     nref;     // Total number of reference segments
+	long     nhyp;     // Total number of hypothesis segments
+	long     nok;      // Total number of correct segments
+};
+
+/* scr_new:
+ *   Create a new scorer for the given reference dataset. On error, return NULL
+ *   and set errno.
+ */
+static
+scr_t *scr_new(dat_t *ref) {
+	scr_t *scr = malloc(sizeof(scr_t));
+	if (scr == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	scr->ref  = ref;
+	scr->nlbl = 0;
+	scr->slbl = 0;
+	scr->lbl  = NULL;
+	scr->cnt  = NULL;
+	scr->nref = scr->nhyp = scr->nok = 0;
+	return scr;
+}
+
+/* scr_free:
+ *   Free a scorer object, the reference dataset is not freed.
+ */
+static
+void scr_free(scr_t *scr) {
+	free(scr->lbl);
+	free(scr->cnt);
+	free(scr);
+}
+
+/* scr_reset:
+ *   Clear all the counts before a new evaluation.
+ */
+static
+void scr_reset(scr_t *scr) {
+	for (int i = 0; i < scr->nlbl; i++)
+		scr->cnt[i][0] = scr->cnt[i][1] = scr->cnt[i][2] = 0;
+	scr->nref = scr->nhyp = scr->nok = 0;
+}
+
+/* scr_getlbl:
+ *   Return the counts of the given output label, adding it if needed. There is
+ *   only a few output labels so a linear search is enough.
+ */
+static
+long *scr_getlbl(scr_t *scr, const lbl_t *lbl) {
+	for (int i = 0; i < scr->nlbl; i++)
+		if (scr->lbl[i] == lbl)
+			return scr->cnt[i];
+	if (scr->nlbl == scr->slbl) {
+		const int size = scr->slbl == 0 ? 16 : scr->slbl * 2;
+		lbl_t **lbl = realloc(scr->lbl, sizeof(lbl_t *) * size);
+		if (lbl == NULL)
+			fatal("out of memory");
+		scr->lbl = lbl;
+		long (*cnt)[3] = realloc(scr->cnt, sizeof(long[3]) * size);
+		if (cnt == NULL)
+			fatal("out of memory");
+		scr->cnt  = cnt;
+		scr->slbl = size;
+	}
+	const int i = scr->nlbl++;
+	scr->lbl[i] = (lbl_t *)lbl;
+	scr->cnt[i][0] = scr->cnt[i][1] = scr->cnt[i][2] = 0;
+	return scr->cnt[i];
+}
+
+/* scr_add:
+ *   Score the best path [pth] of length [cnt], as returned by dec_backtrack,
+ *   for the [idx]-th FST of the decoded dataset. The states lists of [fst] must
+ *   still be available. If a reference segment cannot be found in the lattice,
+ *   the remaining of the reference are counted as errors.
+ */
+static
+void scr_add(scr_t *scr, int idx, const fst_t *fst, const int pth[], int cnt) {
+	const fst_t *ref = scr->ref->fst[idx];
+	int hyp[fst->nstates];
+	for (int s = 0; s < fst->nstates; s++)
+		hyp[s] = -1;
+	for (int i = 0; i < cnt; i++) {
+		const arc_t *arc = &fst->arcs[pth[i]];
+		hyp[arc->src] = pth[i];
+		scr_getlbl(scr, arc->olbl)[1]++;
+	}
+	scr->nhyp += cnt;
+	int s = 0;
+	for (int i = 0; i < ref->narcs; i++) {
+		const arc_t *rarc = &ref->arcs[i];
+		long *lbl = scr_getlbl(scr, rarc->olbl);
+		lbl[0]++, scr->nref++;
+		if (s < 0)
+			continue;
+		// Look for the same segment in the lattice, if only the output
+		// label is missing, the span is still known so we can go on.
+		const state_t *st = &fst->states[s];
+		int trg = -1;
+		for (int n = 0; n < st->ocnt; n++) {
+			const arc_t *arc = &fst->arcs[st->olst[n]];
+			if (arc->ilbl != rarc->ilbl)
+				continue;
+			trg = arc->trg;
+			if (arc->olbl == rarc->olbl)
+				break;
+		}
+		const int h = hyp[s];
+		if (trg != -1 && h != -1 && fst->arcs[h].trg == trg
+		 && fst->arcs[h].olbl == rarc->olbl)
+			lbl[2]++, scr->nok++;
+		s = trg;
+	}
+}
+
+/* scr_acc:
+ *   Return the token accuracy of the evaluation.
+ */
+static
+double scr_acc(const scr_t *scr) {
+	if (scr->nref == 0)
+		return 0.0;
+	return (double)scr->nok / scr->nref;
+}
+
+/* scr_print:
+ *   Print the overall accuracy followed, if [full] is true, by the precision,
+ *   recall and f-measure of each output label.
+ */
+static
+void scr_print(const scr_t *scr, ssp_t *ssp, int full) {
+	fprintf(stderr, "	acc=%.2f%% ref=%ld hyp=%ld ok=%ld\n",
+		100.0 * scr_acc(scr), scr->nref, scr->nhyp, scr->nok);
+	if (!full)
+		return;
+	for (int i = 0; i < scr->nlbl; i++) {
+		const long *c = scr->cnt[i];
+		const double p = c[1] == 0 ? 0.0 : (double)c[2] / c[1];
+		const double r = c[0] == 0 ? 0.0 : (double)c[2] / c[0];
+		const double f = p + r == 0.0 ? 0.0 : 2.0 * p * r / (p + r);
+		const char *str = ssp_get(ssp, map_gethsh(scr->lbl[i]));
+		fprintf(stderr, "	%-12s p=%6.2f%% r=%6.2f%% f=%6.2f%%\n",
+			str, 100.0 * p, 100.0 * r, 100.0 * f);
+	}
+}
+
+/*******************************************************************************
+ * Output writer
+ *
+ *   Decoding results are written in big chunks: the outputs are appended to a
+ *   large buffer owned by a single thread and sent to the file only when it is
+ *   full or explicitly flushed, so the stream lock and the format parsing of
+ *   the stdio functions are not paid for each token. Strings and integers are
+ *   copied directly, only the floating point values still go through snprintf
+ *   to keep the exact same output.
+ ******************************************************************************/
+
+#define WRT_SIZE (1 << 20)
+
+typedef struct wrt_s wrt_t;
+struct wrt_s {
+	FILE *file;  // Output stream of the writer
+	int   len;   // Number of bytes waiting in the buffer
+	char  buf[WRT_SIZE];
+};
+
+/* wrt_new:
+ *   Create a new writer sending its output to [file].
+ */
+static
+wrt_t *wrt_new(FILE *file) {
+	wrt_t *wrt = malloc(sizeof(wrt_t));
+	if (wrt == NULL)
+		fatal("out of memory");
+	wrt->file = file;
+	wrt->len  = 0;
+	return wrt;
+}
+
+/* wrt_flush:
+ *   Send all the buffered output to the file.
+ */
+static
+void wrt_flush(wrt_t *wrt) {
+	if (wrt->len != 0)
+		fwrite(wrt->buf, 1, wrt->len, wrt->file);
+	wrt->len = 0;
+}
+
+/* wrt_free:
+ *   Flush and free a writer, the file is left open.
+ */
+static
+void wrt_free(wrt_t *wrt) {
+	wrt_flush(wrt);
+	free(wrt);
+}
+
+/* wrt_raw:
+ *   Append [len] bytes to the output. Data too large for the buffer is written
+ *   directly after a flush.
+ */
+static
+void wrt_raw(wrt_t *wrt, const char *str, int len) {
+	if (wrt->len + len > WRT_SIZE) {
+		wrt_flush(wrt);
+		if (len > WRT_SIZE) {
+			fwrite(str, 1, len, wrt->file);
+			return;
+		}
+	}
+	memcpy(wrt->buf + wrt->len, str, len);
+	wrt->len += len;
+}
+
+/* wrt_str:
+ *   Append a NUL-terminated string to the output.
+ */
+static
+void wrt_str(wrt_t *wrt, const char *str) {
+	wrt_raw(wrt, str, strlen(str));
+}
+
+/* wrt_chr:
+ *   Append a single character to the output.
+ */
+static
+void wrt_chr(wrt_t *wrt, char chr) {
+	if (wrt->len == WRT_SIZE)
+		wrt_flush(wrt);
+	wrt->buf[wrt->len++] = chr;
+}
+
+/* wrt_int:
+ *   Append the decimal representation of an integer to the output.
+ */
+static
+void wrt_int(wrt_t *wrt, long val) {
+	char tmp[24];
+	int pos = sizeof(tmp);
+	unsigned long v = val < 0 ? -(unsigned long)val : (unsigned long)val;
+	do {
+		tmp[--pos] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	if (val < 0)
+		tmp[--pos] = '-';
+	wrt_raw(wrt, tmp + pos, sizeof(tmp) - pos);
+}
+
+/* wrt_dbl:
+ *   Append a floating point value formatted with [fmt] to the output, this is
+ *   the same as the printf formatting of a single double.
+ */
+static
+void wrt_dbl(wrt_t *wrt, const char *fmt, double val) {
+	char tmp[512];
+	const int len = snprintf(tmp, sizeof(tmp), fmt, val);
+	wrt_raw(wrt, tmp, min(len, (int)sizeof(tmp) - 1));
+}
+
+/*******************************************************************************
+ * Decoder
+ ******************************************************************************/
+
+/* dec_chain:
+ *   Dense version of the Viterbi forward step for linear chains. This is the
+ *   same as the gradient one but in the tropical semi-ring, so a single pass
+ *   over the rows of the Ψ blocks is enough to get both the maximum and the
+ *   back-pointer of each label.
+ */
+static
+void dec_chain(fst_t *fst) {
+	const int A = fst->narcs, P = fst->nstates - 1;
+	const int *cpos = fst->cpos;
+	double *alp = fst->raw_cval + A;
+	for (int ia = cpos[0]; ia < cpos[1]; ia++)
+		alp[ia] = fst->arcs[ia].psi;
+	for (int ip = 1; ip < P; ip++) {
+		const state_t *st = &fst->states[fst->arcs[cpos[ip]].src];
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		const double *ai = alp + cpos[ip - 1];
+		double *ao = alp + cpos[ip];
+		int bk[NO];
+		for (int no = 0; no < NO; no++)
+			ao[no] = -DBL_MAX, bk[no] = 0;
+		for (int ni = 0; ni < NI; ni++) {
+			const double *psi = st->psi[ni];
+			for (int no = 0; no < NO; no++) {
+				const double v = ai[ni] + psi[no];
+				if (v > ao[no])
+					ao[no] = v, bk[no] = ni;
+			}
+		}
+		for (int no = 0; no < NO; no++) {
+			arc_t *a = &fst->arcs[cpos[ip] + no];
+			ao[no] += a->psi;
+			a->eback = cpos[ip - 1] + bk[no];
+			a->yback = 0;
+		}
+	}
+	for (int ia = 0; ia < A; ia++)
+		fst->arcs[ia].alpha = alp[ia];
+}
+
+/* dec_forward:
+ *   The Viterbi forward step. This is the same than the gradient forward step
+ *   with the difference that we work in the tropical semi-ring instead of the
+ *   log one. Linear chains are handled by the dense version above.
+ */
+static
+void dec_forward(fst_t *fst) {
+	if (fst->raw_cval != NULL) {
+		dec_chain(fst);
+		return;
+	}
+	int *s2t = fst->s2t;
+	for (int io = 0, o = s2t[0]; io < fst->narcs; o = s2t[++io]) {
+		arc_t   *ao = &fst->arcs[o];
+		state_t *nd = &fst->states[ao->src];
+		// We first handle the case where there is no incoming arc in
+		// the source state. This is the initial case of the recursion
+		// so we just copy the local psi array to alpha.
+		if (ao->src == 0) {
+			ao->alpha = ao->psi;
+			continue;
+		}
+		// Else, there is some incomming arcs so we have to perform the
+		// sum of all incomming arcs combined with the current one. The
+		// first step is to find the index of the current arc in the
+		// outgoing list of the state and to initialize the alpha array
+		// to "log(0)" for the sum.
+		int no = 0;
+		for ( ; no < nd->ocnt; no++)
+			if (nd->olst[no] == o)
+				break;
+		// Next we process all incoming arcs and search the one with
+		// the maximum score. This is the main difference with the
+		// gradient forward step where we sum over all of them.
+		ao->alpha = -DBL_MAX;
+		for (int ni = 0; ni < nd->icnt; ni++) {
+			const arc_t *ai = &fst->arcs[nd->ilst[ni]];
+			double v = ao->psi + nd->psi[ni][no] + ai->alpha;
+			if (v > ao->alpha) {
+				ao->alpha = v;
+				ao->eback = nd->ilst[ni];
+				ao->yback = 0;
+			}
+		}
+	}
+}
+
+/* dec_chains:
+ *   Batched version of [dec_chain] for up to [DAT_LANES] linear chains of the
+ *   same shape, with the same lane-major layout than [grd_chains].
+ */
+static
+void dec_chains(fst_t *fst[], int n) {
+	assert(n > 0 && n <= DAT_LANES);
+	const int L = DAT_LANES;
+	const int A = fst[0]->narcs, P = fst[0]->nstates - 1;
+	const int *cpos = fst[0]->cpos;
+	double *alp = malloc(sizeof(double) * L * A);
+	int    *bck = malloc(sizeof(int   ) * L * A);
+	if (alp == NULL || bck == NULL) {
+		free(alp); free(bck);
+		for (int i = 0; i < n; i++)
+			dec_forward(fst[i]);
+		return;
+	}
+	fst_t *lf[L];
+	for (int l = 0; l < L; l++)
+		lf[l] = fst[l < n ? l : 0];
+	for (int ia = cpos[0]; ia < cpos[1]; ia++)
+		for (int l = 0; l < L; l++)
+			alp[ia * L + l] = lf[l]->arcs[ia].psi;
+	for (int ip = 1; ip < P; ip++) {
+		const int NI = cpos[ip] - cpos[ip - 1];
+		const int NO = cpos[ip + 1] - cpos[ip];
+		const double *ai = alp + cpos[ip - 1] * L;
+		double *ao = alp + cpos[ip] * L;
+		int    *bo = bck + cpos[ip] * L;
+		double **psi[L];
+		for (int l = 0; l < L; l++)
+			psi[l] = lf[l]->states[lf[l]->arcs[cpos[ip]].src].psi;
+		for (int i = 0; i < NO * L; i++)
+			ao[i] = -DBL_MAX, bo[i] = 0;
+		for (int ni = 0; ni < NI; ni++) {
+			for (int no = 0; no < NO; no++) {
+				for (int l = 0; l < L; l++) {
+					const int i = no * L + l;
+					const double v = ai[ni * L + l]
+					               + psi[l][ni][no];
+					if (v > ao[i])
+						ao[i] = v, bo[i] = ni;
+				}
+			}
+		}
+		for (int no = 0; no < NO; no++) {
+			const int ia = cpos[ip] + no;
+			for (int l = 0; l < L; l++)
+				ao[no * L + l] += lf[l]->arcs[ia].psi;
+		}
+	}
+	for (int l = 0; l < n; l++) {
+		for (int ip = 0; ip < P; ip++) {
+			for (int ia = cpos[ip]; ia < cpos[ip + 1]; ia++) {
+				arc_t *a = &fst[l]->arcs[ia];
+				a->alpha = alp[ia * L + l];
+				a->yback = 0;
+				if (ip != 0)
+					a->eback = cpos[ip - 1]
+					         + bck[ia * L + l];
+			}
+		}
+	}
+	free(alp);
+	free(bck);
+}
+
+/* dec_backtrack:
+ *   The equivalent of the backward step of the gradient for Viterbi decoding.
+ *   Here we don't have to compute the scores, we just follow the best path
+ *   found in the previous step to find the full path. The path is stored in
+ *   reverse order in the array [out] which receive the arc numbers, and its
+ *   length is returned.
+ */
+static
+int dec_backtrack(fst_t *fst, int out[]) {
+	const int E = fst->narcs;
+	// First find the end point of the best path. We search the label with
+	// the best score in all the edge pointing to the final node.
+	double bst = -DBL_MAX;
+	int ei = 0;
+	for (int e = 0; e < E; e++) {
+		const arc_t *ed = &fst->arcs[e];
+		if (ed->trg != fst->final)
+			continue;
+		if (ed->alpha > bst) {
+			bst = ed->alpha;
+			ei  = e;
+		}
+	}
+	int pos = 0;
+	out[pos++] = ei;
+	// Next we follow the backtrack pointers until we reach the starting
+	// point of the lattice filling the output array as we go.
+	arc_t *ed = &fst->arcs[ei];
+	while (ed->src != 0) {
+		ei = ed->eback;
+		out[pos++] = ei;
+		ed = &fst->arcs[ei];
+	}
+	return pos;
+}
+
+/* dec_kmerge:
+ *   Merge the [cnt] lists of k-best partial paths of the arcs [lst], each one
+ *   shifted by [add], and store the [K] best of them in [ov] with the arc and
+ *   rank they come from in [oe] and [oy]. The lists being sorted, a heap of
+ *   their heads is enough to pop the candidates in order, so only O(K) of
+ *   them are looked at. Return the number of paths found.
+ */
+static
+int dec_kmerge(const double *val, int K, int cnt, const int lst[],
+		const double add[], double ov[], int oe[], int oy[]) {
+	int hn[cnt], hr[cnt], nh = 0;
+	#define dec_key(i) (add[hn[i]] + val[lst[hn[i]] * K + hr[i]])
+	#define dec_swp(i, j) do {                         \
+		const int tn = hn[i]; hn[i] = hn[j]; hn[j] = tn; \
+		const int tr = hr[i]; hr[i] = hr[j]; hr[j] = tr; \
+	} while (0)
+	// Sift down the element at [i] to restore the heap property.
+	#define dec_down(i) do {                                          \
+		int p = (i), c = 2 * p + 1;                               \
+		for ( ; c < nh; p = c, c = 2 * p + 1) {                   \
+			if (c + 1 < nh && dec_key(c + 1) > dec_key(c))    \
+				c++;                                      \
+			if (dec_key(p) >= dec_key(c))                     \
+				break;                                    \
+			dec_swp(p, c);                                    \
+		}                                                         \
+	} while (0)
+	for (int n = 0; n < cnt; n++)
+		if (val[lst[n] * K] != -DBL_MAX)
+			hn[nh] = n, hr[nh] = 0, nh++;
+	for (int i = nh / 2 - 1; i >= 0; i--)
+		dec_down(i);
+	int k = 0;
+	for ( ; k < K && nh != 0; k++) {
+		ov[k] = dec_key(0);
+		oe[k] = lst[hn[0]];
+		oy[k] = hr[0];
+		// Replace the head by the next path of the same list, or by
+		// the last element if this list is exhausted.
+		const double *nxt = val + lst[hn[0]] * K;
+		if (hr[0] + 1 < K && nxt[hr[0] + 1] != -DBL_MAX)
+			hr[0]++;
+		else if (--nh != 0)
+			hn[0] = hn[nh], hr[0] = hr[nh];
+		dec_down(0);
+	}
+	#undef dec_key
+	#undef dec_swp
+	#undef dec_down
+	for (int i = k; i < K; i++)
+		ov[i] = -DBL_MAX, oe[i] = oy[i] = 0;
+	return k;
+}
+
+/* dec_nbest:
+ *   The k-best version of the Viterbi forward step. Each arc keep the [K] best
+ *   partial paths ending with it, sorted by decreasing score, in [val], with
+ *   the previous arc and its rank for each of them in [eb] and [yb]. Missing
+ *   paths have a -DBL_MAX score. This follow the same order than dec_forward
+ *   but is not specialized for linear chains.
+ */
+static
+void dec_nbest(fst_t *fst, int K, double *val, int *eb, int *yb) {
+	int *s2t = fst->s2t;
+	for (int io = 0, o = s2t[0]; io < fst->narcs; o = s2t[++io]) {
+		const arc_t *ao = &fst->arcs[o];
+		const state_t *nd = &fst->states[ao->src];
+		double *vo = val + o * K;
+		if (ao->src == 0) {
+			vo[0] = ao->psi;
+			for (int k = 1; k < K; k++)
+				vo[k] = -DBL_MAX;
+			eb[o * K] = yb[o * K] = 0;
+			continue;
+		}
+		int no = 0;
+		for ( ; no < nd->ocnt; no++)
+			if (nd->olst[no] == o)
+				break;
+		double add[nd->icnt];
+		for (int ni = 0; ni < nd->icnt; ni++)
+			add[ni] = ao->psi + nd->psi[ni][no];
+		dec_kmerge(val, K, nd->icnt, nd->ilst, add,
+			vo, eb + o * K, yb + o * K);
+	}
+}
+
+/* dec_dumppath:
+ *   Output the path [out] of length [cnt] found by dec_backtrack on a single
+ *   line as space separated pairs of input and output labels. If the arcs
+ *   posteriors [post] are given, the ones of the path are added in the same
+ *   order after a tabulation.
+ */
+static
+void dec_dumppath(fst_t *fst, ssp_t *ssp, const int out[], int cnt,
+		const double post[], wrt_t *wrt) {
+	for (int n = cnt - 1; n >= 0; n--) {
+		const arc_t *arc = &fst->arcs[out[n]];
+		wrt_str(wrt, mdl_lblstr(ssp, arc->ilbl));
+		wrt_chr(wrt, '@');
+		wrt_str(wrt, mdl_lblstr(ssp, arc->olbl));
+		wrt_chr(wrt, ' ');
+	}
+	if (post != NULL) {
+		wrt_chr(wrt, '\t');
+		for (int n = cnt - 1; n >= 0; n--) {
+			wrt_dbl(wrt, "%.4f", post[out[n]]);
+			if (n != 0)
+				wrt_chr(wrt, ' ');
+		}
+	}
+	wrt_chr(wrt, '\n');
+}
+
+/* dec_dumpnbest:
+ *   Search the [K] best paths of the FST and output them one per line, each
+ *   preceded by its rank and score, followed by an empty line. The FST must
+ *   have its arc scores computed.
+ */
+static
+void dec_dumpnbest(fst_t *fst, ssp_t *ssp, int K, wrt_t *wrt) {
+	const int A = fst->narcs;
+	double *val = malloc(sizeof(double) * A * K);
+	int    *bck = malloc(sizeof(int) * A * K * 2);
+	if (val == NULL || bck == NULL)
+		fatal("out of memory");
+	int *eb = bck, *yb = bck + A * K;
+	dec_nbest(fst, K, val, eb, yb);
+	// The final merge is done on the arcs reaching the final state without
+	// any additional score.
+	const state_t *stf = &fst->states[fst->final];
+	double add[stf->icnt], fv[K];
+	int fe[K], fy[K];
+	for (int ni = 0; ni < stf->icnt; ni++)
+		add[ni] = 0.0;
+	const int cnt = dec_kmerge(val, K, stf->icnt, stf->ilst, add,
+		fv, fe, fy);
+	int out[A];
+	for (int k = 0; k < cnt; k++) {
+		int pos = 0, e = fe[k], r = fy[k];
+		while (1) {
+			out[pos++] = e;
+			if (fst->arcs[e].src == 0)
+				break;
+			const int i = e * K + r;
+			e = eb[i], r = yb[i];
+		}
+		wrt_int(wrt, k + 1);
+		wrt_chr(wrt, '\t');
+		wrt_dbl(wrt, "%f", fv[k]);
+		wrt_chr(wrt, '\t');
+		dec_dumppath(fst, ssp, out, pos, NULL, wrt);
+	}
+	wrt_chr(wrt, '\n');
+	free(val);
+	free(bck);
+}
+
+/* dec_dumparc:
+ *   Output a single arc of a dumped search space with its score.
+ */
+static
+void dec_dumparc(wrt_t *wrt, ssp_t *ssp, int src, int trg, arc_t *arc,
+		double sc) {
+	wrt_int(wrt, src);
+	wrt_chr(wrt, '\t');
+	wrt_int(wrt, trg);
+	wrt_chr(wrt, '\t');
+	wrt_str(wrt, mdl_lblstr(ssp, arc->ilbl));
+	wrt_chr(wrt, '\t');
+	wrt_str(wrt, mdl_lblstr(ssp, arc->olbl));
+	wrt_chr(wrt, '\t');
+	wrt_dbl(wrt, "%f", sc);
+	wrt_chr(wrt, '\n');
+}
+
+/* dec_dumpspc:
+ *   Output the full search space of an FST with the scores of the model. The
+ *   transitions scores depend on the previous arc, so each arc of the FST
+ *   become a state of the dumped one, numbered from its index as 0 and 1 are
+ *   taken by the initial and final states.
+ */
+static
+void dec_dumpspc(fst_t *fst, ssp_t *ssp, wrt_t *wrt) {
+	state_t *sti = &fst->states[0];
+	for (int no = 0; no < sti->ocnt; no++) {
+		const int eo = sti->olst[no];
+		arc_t *ed = &fst->arcs[eo];
+		dec_dumparc(wrt, ssp, 0, eo + 2, ed, ed->psi);
+	}
+	const int S = fst->nstates;
+	for (int s = 0; s < S; s++) {
+		const state_t *nd = &fst->states[s];
+		for (int ni = 0; ni < nd->icnt; ni++) {
+		for (int no = 0; no < nd->ocnt; no++) {
+			const int ei = nd->ilst[ni];
+			const int eo = nd->olst[no];
+			arc_t *ed = &fst->arcs[eo];
+			const double sc = nd->psi[ni][no] + ed->psi;
+			dec_dumparc(wrt, ssp, ei + 2, eo + 2, ed, sc);
+		}
+		}
+	}
+	state_t *stf = &fst->states[fst->final];
+	for (int ni = 0; ni < stf->icnt; ni++) {
+		wrt_int(wrt, stf->ilst[ni] + 2);
+		wrt_str(wrt, "\t1\t<eps>\t0.0\n");
+	}
+	wrt_str(wrt, "1\nEOS\n");
+}
+
+/* dec_dumpbin:
+ *   Output the same search space as dec_dumpspc in the binary format read by
+ *   dat_readbin. The labels get their ids from [voc], shared by all the FSTs
+ *   of the file, and the ones not seen before are defined first. The arcs
+ *   reaching the final state are followed by an epsilon arc.
+ */
+static
+void dec_dumpbin(fst_t *fst, ssp_t *ssp, voc_t *voc, wrt_t *wrt) {
+	const int A = fst->narcs;
+	const uint32_t S = (uint32_t)A + 2;
+	uint32_t *lid = malloc(sizeof(uint32_t) * (A * 2 + 1));
+	uint32_t *pos = malloc(sizeof(uint32_t) * (A + S + 1));
+	if (lid == NULL || pos == NULL)
+		fatal("out of memory");
+	uint32_t *off = pos + A;
+	// First map the labels, the new ones are written as they are found
+	// so we have to count them first.
+	const int old = voc->count;
+	for (int a = 0; a < A; a++) {
+		const arc_t *arc = &fst->arcs[a];
+		lid[a * 2 + 0] = voc_str2id(voc, mdl_lblstr(ssp, arc->ilbl));
+		lid[a * 2 + 1] = voc_str2id(voc, mdl_lblstr(ssp, arc->olbl));
+	}
+	lid[A * 2] = voc_str2id(voc, "<eps>");
+	const uint32_t nlb = voc->count - old;
+	wrt_raw(wrt, (const char *)&nlb, sizeof(uint32_t));
+	for (int i = old; i < voc->count; i++) {
+		const char *str = voc_id2str(voc, i);
+		const uint32_t len = strlen(str);
+		wrt_raw(wrt, (const char *)&len, sizeof(uint32_t));
+		wrt_raw(wrt, str, len);
+	}
+	// Next, compute the rows offsets. State 0 has the arcs leaving the
+	// initial state and each arc state has either the arcs following it
+	// or the epsilon one. We also need the position of each arc in the
+	// list of its target state to find the transition scores.
+	for (int s = 0; s < fst->nstates; s++) {
+		const state_t *st = &fst->states[s];
+		for (int ni = 0; ni < st->icnt; ni++)
+			pos[st->ilst[ni]] = ni;
+	}
+	off[0] = 0;
+	off[1] = off[2] = fst->states[0].ocnt;
+	for (int a = 0; a < A; a++) {
+		const arc_t *arc = &fst->arcs[a];
+		const int cnt = arc->trg == fst->final
+			? 1 : fst->states[arc->trg].ocnt;
+		off[a + 3] = off[a + 2] + cnt;
+	}
+	const uint32_t hdr[3] = {S, off[S], 1};
+	wrt_raw(wrt, (const char *)hdr, sizeof(hdr));
+	wrt_raw(wrt, (const char *)off, sizeof(uint32_t) * (S + 1));
+	// And finally the arcs themselves, row by row.
+	for (int s = -1; s < A; s++) {
+		const state_t *st = &fst->states[s < 0 ? 0 : fst->arcs[s].trg];
+		if (s >= 0 && fst->arcs[s].trg == fst->final) {
+			const float sc = 0.0;
+			uint32_t rec[4] = {1, lid[A * 2], lid[A * 2], 0};
+			memcpy(&rec[3], &sc, sizeof(float));
+			wrt_raw(wrt, (const char *)rec, sizeof(rec));
+			continue;
+		}
+		for (int no = 0; no < st->ocnt; no++) {
+			const int eo = st->olst[no];
+			const arc_t *ed = &fst->arcs[eo];
+			double psi = ed->psi;
+			if (s >= 0)
+				psi += st->psi[pos[s]][no];
+			const float sc = psi;
+			uint32_t rec[4] = {(uint32_t)eo + 2, lid[eo * 2],
+			                   lid[eo * 2 + 1], 0};
+			memcpy(&rec[3], &sc, sizeof(float));
+			wrt_raw(wrt, (const char *)rec, sizeof(rec));
+		}
+	}
+	free(lid);
+	free(pos);
+}
+
+/* dec_fwdbwd:
+ *   Run the forward-backward of the gradient on the [n] FSTs of a batch
+ *   prepared by dec_batch with only the arcs scores, so their alpha and beta
+ *   give the posteriors. If [beam] is positive, the same pruned passes as for
+ *   training are used and the pruned arcs get a null posterior.
+ */
+static
+void dec_fwdbwd(fst_t *fst[], int n, double beam, bms_t *bms) {
+	if (beam > 0.0) {
+		for (int i = 0; i < n; i++) {
+			grd_beamfwd(fst[i], NULL, beam, bms, 0);
+			grd_beambwd(fst[i]);
+		}
+	} else if (n > 1) {
+		grd_chains(fst, n);
+	} else {
+		grd_fwdbwd(fst[0]);
+	}
+}
+
+/* dec_mbr:
+ *   Search the path maximizing the sum of the gains [post]-0.5 of its arcs,
+ *   which is the minimum Bayes risk path for the arc loss counting both the
+ *   wrong arcs of the path and the missed reference arcs. An arc only adds
+ *   to the gain if its posterior is above one half, so paths with more arcs
+ *   are not favored on segmentation lattices. This is a Viterbi without the
+ *   transition scores done in topological order, it stores the scores and
+ *   backtrack pointers of the arcs like dec_forward so the path is extracted
+ *   with dec_backtrack.
+ */
+static
+void dec_mbr(fst_t *fst, const double post[]) {
+	const int A = fst->narcs;
+	int *s2t = fst->s2t;
+	for (int io = 0, o = s2t[0]; io < A; o = s2t[++io]) {
+		arc_t *ao = &fst->arcs[o];
+		if (ao->src == 0) {
+			ao->alpha = post[o] - 0.5;
+			continue;
+		}
+		const state_t *st = &fst->states[ao->src];
+		double bst = -DBL_MAX;
+		for (int ni = 0; ni < st->icnt; ni++) {
+			const arc_t *ai = &fst->arcs[st->ilst[ni]];
+			if (ai->alpha > bst) {
+				bst = ai->alpha;
+				ao->eback = st->ilst[ni];
+			}
+		}
+		ao->alpha = bst + post[o] - 0.5;
+	}
+}
+
+/* dec_posterior:
+ *   Compute in [post] the posterior probability of each arc of an FST after
+ *   dec_fwdbwd, and next prepare it for dec_backtrack either with the usual
+ *   Viterbi or, if [mbr] is true, with the minimum risk path.
+ */
+static
+void dec_posterior(fst_t *fst, double post[], int mbr) {
+	const int A = fst->narcs;
+	const double Z = grd_logz(fst);
+	for (int a = 0; a < A; a++) {
+		const arc_t *arc = &fst->arcs[a];
+		post[a] = arc->alpha + arc->beta - Z;
+	}
+	vec_exp(post, post, A);
+	for (int a = 0; a < A; a++) {
+		const arc_t *arc = &fst->arcs[a];
+		if (arc->alpha == -DBL_MAX || arc->beta == -DBL_MAX)
+			post[a] = 0.0;
+		post[a] = min(post[a], 1.0);
+	}
+	if (mbr)
+		dec_mbr(fst, post);
+	else
+		dec_forward(fst);
+}
+
+/* dec_batch:
+ *   Prepare the [n] FSTs of a batch, as built by dat_addbatch, and run the
+ *   Viterbi on them so the best paths can be extracted with dec_backtrack. If
+ *   [spc] is true, only the arcs scores are computed.
+ */
+static
+void dec_batch(mdl_t *mdl, gen_t *gen, fst_t *fst[], int n, int spc,
+		double beam, bms_t *bms) {
+	for (int i = 0; i < n; i++) {
+		fst_addstates(fst[i]);
+		fst_addsort(fst[i]);
+		gen_addftr(gen, mdl, fst[i]);
+		grd_addspc(fst[i]);
+		grd_dopsi(mdl, fst[i]);
+	}
+	if (spc != 0)
+		return;
+	if (beam > 0.0)
+		for (int i = 0; i < n; i++)
+			grd_beamfwd(fst[i], NULL, beam, bms, 1);
+	else if (n > 1)
+		dec_chains(fst, n);
+	else
+		dec_forward(fst[0]);
+}
+
+/* dec_clean:
+ *   Remove all the data added to an FST by dec_batch.
+ */
+static
+void dec_clean(fst_t *fst) {
+	grd_remspc(fst);
+	gen_remftr(fst);
+	fst_remsort(fst);
+	fst_remstates(fst);
+}
+
+/* dec_decode:
+ *   Decode a full dataset and output the results in order. The FSTs are
+ *   handled by windows of [DEC_WINDOW], inside which they are decoded batch
+ *   by batch before the output is done in the input order through a writer.
+ *   If [beam] is positive, the Viterbi is beam-pruned and the fraction of arcs
+ *   kept is reported. If [quiet] is true, nothing is reported at all so this
+ *   can run in the background.
+ *   If a scorer is given, the best paths are also evaluated with it and the
+ *   [file] can be NULL to only score them.
+ *   If [spc] is not zero, the full search spaces are dumped instead of the
+ *   best paths, as text if it is 1 or in binary if it is 2.
+ *   If [nbest] is more than one, the k-best paths are output instead of the
+ *   best one without beam pruning.
+ *   If [pst] is not zero, the forward-backward is run instead of the Viterbi,
+ *   with DEC_POST the posterior of each arc of the path is output with it, and
+ *   with DEC_MBR the minimum risk path replace the best one.
+ */
+#define DEC_WINDOW 256
+#define DEC_POST   1
+#define DEC_MBR    2
+static
+void dec_decode(mdl_t *mdl, ssp_t *ssp, gen_t *gen, dat_t *dat, FILE *file,
+		int spc, int nbest, int pst, double beam, scr_t *scr,
+		int quiet) {
+	bms_t bms = {0.0, 0.0, 0.0, 0.0};
+	if (!dat_addbatch(dat, DEC_WINDOW))
+		pfatal("cannot build batches");
+	mdl_pairupd(mdl);
+	wrt_t *wrt = file != NULL ? wrt_new(file) : NULL;
+	voc_t *voc = NULL;
+	if (spc == 2) {
+		voc = voc_new();
+		wrt_str(wrt, DAT_MAGIC);
+	}
+	prg_t *prg = prg_new(1000);
+	if (!quiet)
+		prg_start(prg);
+	for (int ib = 0, w = 0; w < dat->nfst; w += DEC_WINDOW) {
+		const int W = min(dat->nfst - w, DEC_WINDOW);
+		for ( ; ib < dat->nbat && dat->bat[ib] < w + W; ib++) {
+			const int n = dat->bat[ib + 1] - dat->bat[ib];
+			fst_t *fst[n];
+			for (int i = 0; i < n; i++)
+				fst[i] = dat->fst[dat->bidx[dat->bat[ib] + i]];
+			const int psi = spc || nbest > 1 || pst != 0;
+			dec_batch(mdl, gen, fst, n, psi, beam, &bms);
+			if (spc == 0 && pst != 0)
+				dec_fwdbwd(fst, n, beam, &bms);
+		}
+		for (int i = w; i < w + W; i++) {
+			fst_t *fst = dat->fst[i];
+			if (spc == 0 && nbest > 1) {
+				dec_dumpnbest(fst, ssp, nbest, wrt);
+			} else if (spc == 0) {
+				double post[pst != 0 ? fst->narcs : 1];
+				if (pst != 0)
+					dec_posterior(fst, post, pst & DEC_MBR);
+				int out[fst->narcs];
+				int cnt = dec_backtrack(fst, out);
+				if (scr != NULL)
+					scr_add(scr, i, fst, out, cnt);
+				if (wrt != NULL)
+					dec_dumppath(fst, ssp, out, cnt,
+						pst & DEC_POST ? post : NULL,
+						wrt);
+			} else if (spc == 2) {
+				dec_dumpbin(fst, ssp, voc, wrt);
+			} else {
+				dec_dumpspc(fst, ssp, wrt);
+			}
+			dec_clean(fst);
+			if (!quiet)
+				prg_next(prg);
+		}
+	}
+	if (wrt != NULL)
+		wrt_free(wrt);
+	if (voc != NULL)
+		voc_free(voc);
+	if (!quiet)
+		prg_end(prg);
+	prg_free(prg);
+	if (bms.arcs != 0.0 && !quiet)
+		fprintf(stderr, "    beam: arcs=%.2f%%\n",
+			100.0 * bms.kept / bms.arcs);
+}
+
+/* dec_serve:
+ *   Decode the lattices read from [in] one by one and write the best path of
+ *   each to [out] as soon as it is found, so this can be used as a filter by
+ *   another process. The model is frozen first. An invalid lattice give an
+ *   empty output line so the outputs always match the inputs.
+ */
+static
+void dec_serve(mdl_t *mdl, ssp_t *ssp, gen_t *gen, FILE *in, FILE *out,
+		double beam) {
+	bms_t bms = {0.0, 0.0, 0.0, 0.0};
+	mdl_freeze(mdl);
+	wrt_t *wrt = wrt_new(out);
+	long cnt = 0;
+	double tot = 0.0;
+	while (!feof(in)) {
+		char **lns = str_readeos(in);
+		if (lns == NULL && feof(in))
+			break;
+		const double t0 = dst_now();
+		fst_t *fst = NULL;
+		if (lns != NULL) {
+			fst = dat_parse(lns, mdl);
+			for (int i = 0; lns[i] != NULL; i++)
+				free(lns[i]);
+			free(lns);
+		}
+		if (fst == NULL) {
+			fprintf(stderr, "warning: invalid lattice %ld\n",
+				cnt + 1);
+			fprintf(out, "\n");
+			fflush(out);
+			cnt++;
+			continue;
+		}
+		dec_batch(mdl, gen, &fst, 1, 0, beam, &bms);
+		int pth[fst->narcs];
+		const int len = dec_backtrack(fst, pth);
+		dec_dumppath(fst, ssp, pth, len, NULL, wrt);
+		wrt_flush(wrt);
+		fflush(out);
+		dec_clean(fst);
+		fst_free(fst);
+		tot += dst_now() - t0;
+		cnt++;
+	}
+	wrt_free(wrt);
+	fprintf(stderr, "    served=%ld avg=%.3fms\n", cnt,
+		cnt == 0 ? 0.0 : 1000.0 * tot / cnt);
+}
+
+/* dec_job_t:
+ *   A decoding running in its own thread, used to decode the devel set on a
+ *   snapshot of the model while the training goes on. If the job have a
+ *   scorer, the snapshot with the best score is kept aside with its scores.
+ */
+typedef struct dec_job_s dec_job_t;
+struct dec_job_s {
+	mdl_t   *mdl;
+	ssp_t   *ssp;
+	gen_t   *gen;
+	dat_t   *dat;
+	double   beam;
+	char     fname[4096]; // Output file, empty to only score the output
+	int      itr;
+	int      run;         // True if the thread is running or not joined
+	thread_t thrd;
+	scr_t   *scr;         // Scorer or NULL
+	mdl_t   *best;        // Snapshot with the best score or NULL
+	scr_t   *bscr;        // Scores of the best snapshot
+	int      bitr;        // Iteration of the best snapshot
+	int      wait;        // Evaluations since the last improvement
+};
+
+static
+void *dec_jobworker(void *ud) {
+	dec_job_t *job = ud;
+	FILE *file = NULL;
+	if (job->fname[0] != '\0') {
+		file = fopen(job->fname, "w");
+		if (file == NULL)
+			pfatal("cannot open file %s", job->fname);
+	}
+	if (job->scr != NULL)
+		scr_reset(job->scr);
+	dec_decode(job->mdl, job->ssp, job->gen, job->dat, file, 0, 1, 0,
+		job->beam, job->scr, 1);
+	if (file != NULL)
+		fclose(file);
+	return NULL;
+}
+
+/* dec_jobstart:
+ *   Start decoding in the background the dataset of the job with its model
+ *   to the given file, which can be NULL if the job have a scorer.
+ */
+static
+void dec_jobstart(dec_job_t *job, const char *fname, int itr) {
+	assert(!job->run);
+	snprintf(job->fname, sizeof(job->fname), "%s", fname ? fname : "");
+	job->itr = itr;
+	job->run = 1;
+	thread_spawn(&job->thrd, dec_jobworker, job);
+}
+
+/* dec_jobwait:
+ *   Wait for the end of the job if one is running and report its score. If
+ *   it is the best one, the snapshot and scorer are swapped with the best
+ *   ones so they are kept, and fresh ones are made for the next job.
+ */
+static
+void dec_jobwait(dec_job_t *job) {
+	if (!job->run)
+		return;
+	thread_join(job->thrd);
+	job->run = 0;
+	fprintf(stderr, "  - Devel of iteration %d decoded\n", job->itr);
+	if (job->scr == NULL)
+		return;
+	scr_print(job->scr, job->ssp, 0);
+	if (job->best != NULL && scr_acc(job->scr) <= scr_acc(job->bscr)) {
+		job->wait++;
+		return;
+	}
+	mdl_t *mdl = job->best; job->best = job->mdl; job->mdl = mdl;
+	scr_t *scr = job->bscr; job->bscr = job->scr; job->scr = scr;
+	job->bitr = job->itr;
+	job->wait = 0;
+	if (job->mdl == NULL && (job->mdl = mdl_new(job->ssp)) == NULL)
+		pfatal("cannot create devel model");
+	if (job->scr == NULL && (job->scr = scr_new(job->bscr->ref)) == NULL)
+		pfatal("cannot create devel scorer");
+}
+
+/*******************************************************************************
+ * Decode server
+ *
+ *   A daemon which decode the lattices sent by many clients through a Unix
+ *   socket. Each connection is served by its own thread which parse the
+ *   lattices and queue them, one at a time, as requests. The decoding workers
+ *   take all the pending requests at once, up to the batch size, so under load
+ *   requests coming from different clients are grouped and chains of the same
+ *   shape are decoded together. Features generation is done by the workers so
+ *   it run in parallel. Outputs are the same than for --serve-stdin and a
+ *   request made of the single line "STATS" return the server statistics.
+ *
+ *   The model is versioned so it can be replaced without stopping: a request
+ *   made of the single line "RELOAD" load the model files again in the
+ *   connection thread while the others keep being served. The new version is
+ *   then published by swapping the current version pointer, and the old one
+ *   is freed when the last request using it is done.
+ ******************************************************************************/
+
+#define SRV_HIST 4096
+
+typedef struct srv_ver_s srv_ver_t;
+struct srv_ver_s {
+	mdl_t *mdl;
+	int    num;   // Version number
+	int    ref;   // Number of users, the server count for the current one
+};
+
+typedef struct srv_req_s srv_req_t;
+struct srv_req_s {
+	srv_ver_t *ver;   // Model version the lattice was parsed with
+	fst_t     *fst;
+	int       *pth;   // [A] Best path found by the worker
+	int        cnt;   // Length of the best path
+	int        done;  // True once decoded
+	srv_req_t *next;
+};
+
+typedef struct srv_s srv_t;
+struct srv_s {
+	srv_ver_t *cur;            // Current model version
+	char     **mdl_inp;        // Model files to reload
+	char     **str_inp;        // String pool files to reload
+	int        busy;           // True while a reload is in progress
+	ssp_t     *ssp;
+	gen_t     *gen;
+	double     beam;
+	int        bsz;            // Maximum number of requests in a batch
+	mtx_t      mtx;
+	cond_t     cnd;            // Signal new pending requests
+	cond_t     fin;            // Signal finished requests
+	srv_req_t *head, *tail;    // Queue of pending requests
+	double     start;          // Time the server was started
+	long       nreq, nbat;     // Number of requests and batches done
+	double     lat[SRV_HIST];  // Latency of the last requests
+};
+
+/* srv_acquire:
+ *   Return the current model version, which is guaranteed to stay alive until
+ *   it is released.
+ */
+static
+srv_ver_t *srv_acquire(srv_t *srv) {
+	mtx_lock(&srv->mtx);
+	srv_ver_t *ver = srv->cur;
+	ver->ref++;
+	mtx_unlock(&srv->mtx);
+	return ver;
+}
+
+/* srv_release:
+ *   Release a model version, the last user free it.
+ */
+static
+void srv_release(srv_t *srv, srv_ver_t *ver) {
+	mtx_lock(&srv->mtx);
+	const int ref = --ver->ref;
+	mtx_unlock(&srv->mtx);
+	if (ref == 0) {
+		fprintf(stderr, "    [srv] model version %d freed\n", ver->num);
+		mdl_free(ver->mdl);
+		free(ver);
+	}
+}
+
+/* srv_reload:
+ *   Load the model files in a new version and publish it if all is ok. The
+ *   result is reported on [file] with the load time and the time the swap
+ *   took.
+ */
+static
+void srv_reload(srv_t *srv, FILE *file) {
+	if (srv->mdl_inp == NULL) {
+		fprintf(file, "error: no model file to reload\n");
+		return;
+	}
+	mtx_lock(&srv->mtx);
+	const int busy = srv->busy;
+	srv->busy = 1;
+	mtx_unlock(&srv->mtx);
+	if (busy) {
+		fprintf(file, "error: reload in progress\n");
+		return;
+	}
+	const double t0 = dst_now();
+	for (int i = 0; srv->str_inp != NULL && srv->str_inp[i] != NULL; i++)
+		if (!ssp_load(srv->ssp, srv->str_inp[i]))
+			goto error;
+	mdl_t *mdl = mdl_new(srv->ssp);
+	if (mdl == NULL)
+		goto error;
+	for (int i = 0; srv->mdl_inp[i] != NULL; i++) {
+		if (!mdl_load(mdl, srv->mdl_inp[i])) {
+			mdl_free(mdl);
+			goto error;
+		}
+	}
+	mdl_freeze(mdl);
+	srv_ver_t *ver = malloc(sizeof(srv_ver_t));
+	if (ver == NULL) {
+		mdl_free(mdl);
+		goto error;
+	}
+	ver->mdl = mdl;
+	ver->ref = 1;
+	const double t1 = dst_now();
+	mtx_lock(&srv->mtx);
+	srv_ver_t *old = srv->cur;
+	ver->num  = old->num + 1;
+	srv->cur  = ver;
+	srv->busy = 0;
+	mtx_unlock(&srv->mtx);
+	const double t2 = dst_now();
+	fprintf(stderr, "    [srv] model version %d published\n", ver->num);
+	srv_release(srv, old);
+	fprintf(file, "version=%d load=%.3fms swap=%.3fus\n",
+		ver->num, 1000.0 * (t1 - t0), 1000000.0 * (t2 - t1));
+	return;
+    error:
+	fprintf(file, "error: cannot reload model <%s>\n", strerror(errno));
+	mtx_lock(&srv->mtx);
+	srv->busy = 0;
+	mtx_unlock(&srv->mtx);
+}
+
+/* srv_worker:
+ *   Decoding thread, take pending requests by batches, decode them and wake
+ *   up the connections waiting for them. Only requests for the same model
+ *   version are put in a batch.
+ */
+static
+void *srv_worker(void *ud) {
+	srv_t *srv = ud;
+	bms_t bms = {0.0, 0.0, 0.0, 0.0};
+	srv_req_t *req[srv->bsz];
+	fst_t     *fst[srv->bsz];
+	while (1) {
+		mtx_lock(&srv->mtx);
+		while (srv->head == NULL)
+			cond_wait(&srv->cnd, &srv->mtx);
+		srv_ver_t *ver = srv->head->ver;
+		int n = 0;
+		while (srv->head != NULL && srv->head->ver == ver
+		    && n < srv->bsz) {
+			req[n] = srv->head;
+			fst[n] = req[n]->fst;
+			srv->head = srv->head->next;
+			n++;
+		}
+		if (srv->head == NULL)
+			srv->tail = NULL;
+		mtx_unlock(&srv->mtx);
+		// The requests are grouped by shape the same way than a dataset
+		// so the decoding of chains can be batched.
+		dat_t dat = {.nfst = n, .sfst = n, .fst = fst};
+		if (!dat_addbatch(&dat, n))
+			pfatal("cannot build batches");
+		for (int ib = 0; ib < dat.nbat; ib++) {
+			const int m = dat.bat[ib + 1] - dat.bat[ib];
+			fst_t *bat[m];
+			for (int i = 0; i < m; i++)
+				bat[i] = fst[dat.bidx[dat.bat[ib] + i]];
+			dec_batch(ver->mdl, srv->gen, bat, m, 0, srv->beam,
+				&bms);
+		}
+		free(dat.bat);
+		free(dat.bidx);
+		for (int i = 0; i < n; i++) {
+			req[i]->pth = malloc(sizeof(int) * fst[i]->narcs);
+			if (req[i]->pth == NULL)
+				fatal("out of memory");
+			req[i]->cnt = dec_backtrack(fst[i], req[i]->pth);
+		}
+		mtx_lock(&srv->mtx);
+		for (int i = 0; i < n; i++)
+			req[i]->done = 1;
+		srv->nbat++;
+		cond_broadcast(&srv->fin);
+		mtx_unlock(&srv->mtx);
+	}
+	return NULL;
 }
 
-/*******************************************************************************
- * Optimizer
- *
- *   Implement the model optimizer using resilient back-propagation [1], this
- *   use all the previous thing to perform the actual model training in an
- *   efficient way.
- *   In order to optimize a model, the optimize function should be called until
- *   convergence. It is the responsibility of the caller code to determine when
- *   the model is fully trained.
- *
- * [1] A direct adaptive method for faster backpropagation learning: The RPROP
- *     algorithm, Martin Riedmiller and Heinrich Braun, IEEE International
- *     Conference on Neural Networks, San Francisco, USA, 586-591, March 1993.
- ******************************************************************************/
-
-typedef struct rbp_s rbp_t;
-struct rbp_s {
-	double rho1[128];
-	double rho2[128];
-	double rho3[128];
-	double stpinc;
-	double stpdec;
-	double stpmin;
-	double stpmax;
-};
-
 static
-rbp_t *rbp_new(void) {
-	rbp_t *rbp = malloc(sizeof(rbp_t));
-	if (rbp == NULL)
-		return NULL;
-	rbp->rho1[0] = rbp->rho2[0] = rbp->rho3[0] = 0.0;
-	for (int i = 1; i < 128; i++)
-		rbp->rho1[i] = rbp->rho2[i] = rbp->rho3[i] = -1.0;
-	rbp->stpinc = 1.2;
-	rbp->stpdec = 0.5;
-	rbp->stpmin = 1e-8;
-	rbp->stpmax = 50.0;
-	return rbp;
+int srv_cmpdbl(const void *a, const void *b) {
+	const double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
 }
 
+/* srv_stats:
+ *   Write the server statistics on a single line: the number of requests and
+ *   batches done, the throughput since start, and the latency percentiles of
+ *   the last [SRV_HIST] requests.
+ */
 static
-void rbp_free(rbp_t *rbp) {
-	free(rbp);
+void srv_stats(srv_t *srv, FILE *file) {
+	double lat[SRV_HIST];
+	mtx_lock(&srv->mtx);
+	const long nreq = srv->nreq, nbat = srv->nbat;
+	const int n = min(nreq, SRV_HIST);
+	memcpy(lat, srv->lat, sizeof(double) * n);
+	mtx_unlock(&srv->mtx);
+	qsort(lat, n, sizeof(double), srv_cmpdbl);
+	const double up = dst_now() - srv->start;
+	#define srv_pct(p) (n == 0 ? 0.0 : 1000.0 * lat[(int)((n - 1) * p)])
+	fprintf(file, "reqs=%ld bats=%ld avg-bat=%.2f rate=%.1f/s "
+		"p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms\n",
+		nreq, nbat, nbat == 0 ? 0.0 : (double)nreq / nbat,
+		nreq / up, srv_pct(0.50), srv_pct(0.90), srv_pct(0.99),
+		srv_pct(1.00));
+	#undef srv_pct
 }
 
-/* rbp_step:
- *   Perform one step of the resilient back-propagation algorithm including
- *   computation of the gradient and applying the regularization. Return the
- *   value of the objective function before the optimization step. (computing
- *   the new value would require a second computation which is a lot too costly)
+typedef struct srv_con_s srv_con_t;
+struct srv_con_s {
+	srv_t *srv;
+	int    fd;
+};
+
+/* srv_connection:
+ *   Connection thread, read the lattices from the client, queue them for the
+ *   workers and write back the results in order.
  */
 static
-void rbp_step(rbp_t *rbp, mdl_t *mdl, double ll) {
-	assert(rbp != NULL && mdl != NULL);
-	prg_t *prg = prg_new(mdl->ftrs->count / 49);
-	double nx  = 0.0, ng  = 0.0, nd = 0.0;
-	double fx  = ll;
-	ftr_t *ftr = NULL;
-	prg_start(prg);
-	while (1) {
-		ftr = mdl_next(mdl, ftr);
-	    next:
-		if (ftr == NULL)
+void *srv_connection(void *ud) {
+	srv_con_t *con = ud;
+	srv_t *srv = con->srv;
+	const int fd = con->fd;
+	free(con);
+	const int wfd = dup(fd);
+	FILE *in  = fdopen(fd, "r");
+	FILE *out = wfd < 0 ? NULL : fdopen(wfd, "w");
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "warning: cannot open connection\n");
+		if (in != NULL) fclose(in); else close(fd);
+		if (out != NULL) fclose(out); else if (wfd >= 0) close(wfd);
+		return NULL;
+	}
+	wrt_t *wrt = wrt_new(out);
+	while (!feof(in) && !ferror(out)) {
+		char **lns = str_readeos(in);
+		if (lns == NULL && feof(in))
 			break;
-		const int tag = mdl_gettag(ftr);
-		// Check if we should remove the feature either for to low freq
-		// or for having a zero weight.
-		// FIXME: Hack Nico : We also want to ignore dense features
-		// that should not be included in the model
-		if (ftr->x == 0.0 && mdl->rem[tag] <= mdl->itr) {
-			ftr = mdl_remove(mdl, ftr);
-			goto next;
-		} else if (ftr->frq < mdl->frq) {
-			ftr = mdl_remove(mdl, ftr);
-			goto next;
-		} else if (mdl->stt[tag] > mdl->itr) {
-			ftr = mdl_next(mdl, ftr);
-			goto next;
-		}
-		// We detect new feature with their step size being zero and
-		// initialize them. The model should have set all fields to zero
-		// so we just have to setup the step size.
-		if (ftr->stp == 0.0)
-			ftr->stp = 0.1;
-		// We retrieve the feature tag and regularization parameter and
-		// update the l1 & l2 norm of the model.
-		const double rho1 = rbp->rho1[tag];
-		const double rho2 = rbp->rho2[tag];
-		const double rho3 = rbp->rho3[tag];
-		ftr->g += rho2 * ftr->x;
-		fx += rho2 * ftr->x * ftr->x / 2.0;
-		fx += rho1 * fabs(ftr->x);
-		fx += rho3 * ftr->frq * fabs(ftr->x);
-		// First step is to project the gradient in the current orthant
-		// to ensure derivability.
-		const double ar = rho1 + rho3 * ftr->frq;
-		double pg = ftr->g;
-		if (ar != 0) {
-			     if (ftr->x < -EPSILON) pg -= ar;
-			else if (ftr->x >  EPSILON) pg += ar;
-			else if (ftr->g < -ar     ) pg += ar;
-			else if (ftr->g >  ar     ) pg -= ar;
-			else                        pg  = 0.0;
-		}
-		// Next we adjust the step depending on the new and previous
-		// gradient sign.
-		const double sgn = ftr->gp * pg;
-		if (sgn < -EPSILON)
-			ftr->stp = max(ftr->stp * rbp->stpdec, rbp->stpmin);
-		else if (sgn > EPSILON)
-			ftr->stp = min(ftr->stp * rbp->stpinc, rbp->stpmax);
-		// And we update the weight. If gradient sign changed, we take
-		// back the previous update, else we make one step in gradient
-		// direction and project back in orthant.
-		if (sgn < 0.0) {
-			ftr->x -= ftr->dlt;
-			ftr->g  = 0.0;
+		const double t0 = dst_now();
+		fst_t *fst = NULL;
+		srv_ver_t *ver = NULL;
+		if (lns != NULL && lns[1] == NULL && !strcmp(lns[0], "STATS")) {
+			srv_stats(srv, out);
+		} else if (lns != NULL && lns[1] == NULL
+		        && !strcmp(lns[0], "RELOAD")) {
+			srv_reload(srv, out);
+		} else if (lns != NULL) {
+			ver = srv_acquire(srv);
+			fst = dat_parse(lns, ver->mdl);
+			if (fst == NULL) {
+				srv_release(srv, ver);
+				fprintf(out, "\n");
+			}
 		} else {
-			     if (pg < -EPSILON) ftr->dlt =  ftr->stp;
-			else if (pg >  EPSILON) ftr->dlt = -ftr->stp;
-			else                    ftr->dlt = 0.0;
-			if (rho1 != 0.0 && ftr->dlt * pg >= 0.0)
-				ftr->dlt = 0.0;
-			ftr->x += ftr->dlt;
-		}
-		// Finally, prepare the feature for the next iteration. We save
-		// the current gradient and clear it.
-		nx += fabs(ftr->x);
-		ng += fabs(ftr->g);
-		nd += fabs(ftr->dlt);
-		ftr->frq = 0;
-		ftr->gp  = ftr->g;
-		ftr->g   = 0.0;
-		prg_next(prg);
+			fprintf(out, "\n");
+		}
+		for (int i = 0; lns != NULL && lns[i] != NULL; i++)
+			free(lns[i]);
+		free(lns);
+		if (fst == NULL) {
+			fflush(out);
+			continue;
+		}
+		srv_req_t req = {ver, fst, NULL, 0, 0, NULL};
+		mtx_lock(&srv->mtx);
+		if (srv->tail != NULL)
+			srv->tail->next = &req;
+		else
+			srv->head = &req;
+		srv->tail = &req;
+		cond_signal(&srv->cnd);
+		while (!req.done)
+			cond_wait(&srv->fin, &srv->mtx);
+		mtx_unlock(&srv->mtx);
+		dec_dumppath(fst, srv->ssp, req.pth, req.cnt, NULL, wrt);
+		wrt_flush(wrt);
+		fflush(out);
+		free(req.pth);
+		dec_clean(fst);
+		fst_free(fst);
+		srv_release(srv, ver);
+		const double lat = dst_now() - t0;
+		mtx_lock(&srv->mtx);
+		srv->lat[srv->nreq++ % SRV_HIST] = lat;
+		mtx_unlock(&srv->mtx);
 	}
-	prg_end(prg);
-	fprintf(stderr, "\tll=%.2f", -ll);
-	fprintf(stderr, " fx=%.2f",  fx);
-	fprintf(stderr, " |x|=%.2f",   nx);
-	fprintf(stderr, " |g|=%.2f",   ng);
-	fprintf(stderr, " |d|=%.2f\n", nd);
+	wrt_free(wrt);
+	fclose(in);
+	fclose(out);
+	return NULL;
 }
 
-/*******************************************************************************
- * Decoder
- ******************************************************************************/
-
-/* dec_forward:
- *   The Viterbi forward step. This is the same than the gradient forward step
- *   with the difference that we work in the tropical semi-ring instead of the
- *   log one.
+/* srv_run:
+ *   Start [nth] decoding workers and serve the clients connecting to the Unix
+ *   socket [path] with the given model. The model is frozen first, and when
+ *   reloaded, it is from the [mdl_inp] and [str_inp] files. This return only
+ *   on failure of the listening socket with errno set, transient errors when
+ *   accepting a client are retried after a growing delay.
  */
 static
-void dec_forward(fst_t *fst) {
-	int *s2t = fst->s2t;
-	for (int io = 0, o = s2t[0]; io < fst->narcs; o = s2t[++io]) {
-		arc_t   *ao = &fst->arcs[o];
-		state_t *nd = &fst->states[ao->src];
-		// We first handle the case where there is no incoming arc in
-		// the source state. This is the initial case of the recursion
-		// so we just copy the local psi array to alpha.
-		if (ao->src == 0) {
-			ao->alpha = ao->psi;
+int srv_run(mdl_t *mdl, ssp_t *ssp, gen_t *gen, const char *path, int nth,
+		int bsz, double beam, char **mdl_inp, char **str_inp) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	 || listen(fd, 64) != 0) {
+		close(fd);
+		return 0;
+	}
+	// A client closing its connection early must not kill the server.
+	signal(SIGPIPE, SIG_IGN);
+	mdl_freeze(mdl);
+	srv_t *srv = malloc(sizeof(srv_t));
+	srv_ver_t *ver = malloc(sizeof(srv_ver_t));
+	if (srv == NULL || ver == NULL) {
+		free(srv);
+		free(ver);
+		close(fd);
+		errno = ENOMEM;
+		return 0;
+	}
+	ver->mdl = mdl;
+	ver->num = 0;
+	ver->ref = 1;
+	srv->cur     = ver;
+	srv->mdl_inp = mdl_inp;
+	srv->str_inp = str_inp;
+	srv->busy    = 0;
+	srv->ssp     = ssp;
+	srv->gen     = gen;
+	srv->beam    = beam;
+	srv->bsz     = max(bsz, 1);
+	srv->head    = srv->tail = NULL;
+	srv->start   = dst_now();
+	srv->nreq    = srv->nbat = 0;
+	mtx_init(&srv->mtx);
+	cond_init(&srv->cnd);
+	cond_init(&srv->fin);
+	thread_t thrd;
+	for (int i = 0; i < nth; i++) {
+		thread_spawn(&thrd, srv_worker, srv);
+		thread_detach(thrd);
+	}
+	// Running out of descriptors or memory, or a client aborting before
+	// being accepted, is not fatal for the server. So we wait a bit to let
+	// the current connections end, longer each time it fail again, and
+	// only give up on errors of the socket itself.
+	long wait = 0;
+	while (1) {
+		const int cfd = accept(fd, NULL, NULL);
+		if (cfd < 0 && errno == EINTR)
+			continue;
+		if (cfd < 0 && (errno == EBADF || errno == EINVAL
+		             || errno == ENOTSOCK || errno == EOPNOTSUPP))
+			break;
+		if (cfd < 0) {
+			wait = min(max(wait * 2, 1000000L), 1000000000L);
+			fprintf(stderr, "warning: accept failed <%s>\n",
+				strerror(errno));
+			const struct timespec ts = {wait / 1000000000L,
+			                            wait % 1000000000L};
+			nanosleep(&ts, NULL);
 			continue;
 		}
-		// Else, there is some incomming arcs so we have to perform the
-		// sum of all incomming arcs combined with the current one. The
-		// first step is to find the index of the current arc in the
-		// outgoing list of the state and to initialize the alpha array
-		// to "log(0)" for the sum.
-		int no = 0;
-		for ( ; no < nd->ocnt; no++)
-			if (nd->olst[no] == o)
-				break;
-		// Next we process all incoming arcs and search the one with
-		// the maximum score. This is the main difference with the
-		// gradient forward step where we sum over all of them.
-		ao->alpha = -DBL_MAX;
-		for (int ni = 0; ni < nd->icnt; ni++) {
-			const arc_t *ai = &fst->arcs[nd->ilst[ni]];
-			double v = ao->psi + nd->psi[ni][no] + ai->alpha;
-			if (v > ao->alpha) {
-				ao->alpha = v;
-				ao->eback = nd->ilst[ni];
-				ao->yback = 0;
-			}
+		wait = 0;
+		srv_con_t *con = malloc(sizeof(srv_con_t));
+		if (con == NULL) {
+			close(cfd);
+			continue;
 		}
+		con->srv = srv;
+		con->fd  = cfd;
+		thread_spawn(&thrd, srv_connection, con);
+		thread_detach(thrd);
 	}
+	close(fd);
+	return 0;
 }
 
-/* dec_backtrack:
- *   The equivalent of the backward step of the gradient for Viterbi decoding.
- *   Here we don't have to compute the scores, we just follow the best path
- *   found in the previous step to find the full path. The path is stored in
- *   reverse order in the arrays [eds] and [lbl]. The former receive the edge
- *   number of the path, while the second receive the hypothesis number for each
- *   edge.
+/*******************************************************************************
+ * Library interface
+ *
+ *   The functions exported by liblost, see lost.h for their documentation.
+ *   They are thin wrappers around the decoder which keep the same error
+ *   reporting through errno.
+ ******************************************************************************/
+
+struct lost_s {
+	ssp_t *ssp;
+	mdl_t *mdl;
+	gen_t *gen;
+};
+
+struct lost_fst_s {
+	fst_t *fst;
+	int   *idx;  // [A] Index given by the caller of each arc
+};
+
+/* lost_vecinit:
+ *   Select the vector kernels for the library with the accurate exponential.
+ *   This is run only once whatever the number of decoders created.
  */
+static pthread_once_t lost_once = PTHREAD_ONCE_INIT;
+
 static
-int dec_backtrack(fst_t *fst, lbl_t *out[][2]) {
-	const int E = fst->narcs;
-	// First find the end point of the best path. We search the label with
-	// the best score in all the edge pointing to the final node.
-	double bst = -DBL_MAX;
-	int ei = 0;
-	for (int e = 0; e < E; e++) {
-		const arc_t *ed = &fst->arcs[e];
-		if (ed->trg != fst->final)
-			continue;
-		if (ed->alpha > bst) {
-			bst = ed->alpha;
-			ei  = e;
-		}
+void lost_vecinit(void) {
+	vec_init(0);
+}
+
+lost_t *lost_new(void) {
+	pthread_once(&lost_once, lost_vecinit);
+	lost_t *lst = malloc(sizeof(lost_t));
+	if (lst == NULL) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	int pos = 1;
-	out[0][0] = fst->arcs[ei].ilbl;
-	out[0][1] = fst->arcs[ei].olbl;
-	// Next we follow the backtrack pointers until we reach the starting
-	// point of the lattice filling the output array as we go.
-	arc_t *ed = &fst->arcs[ei];
-	while (ed->src != 0) {
-		ei = ed->eback;
-		out[pos  ][0] = fst->arcs[ei].ilbl;
-		out[pos++][1] = fst->arcs[ei].olbl;
-		ed = &fst->arcs[ei];
+	// All the strings are kept as the caller may need the input labels
+	// back from the decoded paths.
+	lst->ssp = ssp_new(1);
+	lst->mdl = lst->ssp == NULL ? NULL : mdl_new(lst->ssp);
+	lst->gen = lst->mdl == NULL ? NULL : gen_new(lst->ssp, 0);
+	if (lst->gen == NULL) {
+		if (lst->mdl != NULL)
+			mdl_free(lst->mdl);
+		if (lst->ssp != NULL)
+			ssp_free(lst->ssp);
+		free(lst);
+		errno = ENOMEM;
+		return NULL;
 	}
-	return pos;
+	mdl_freeze(lst->mdl);
+	return lst;
 }
 
-static
-int dec_dsmap(voc_t *voc, int n1, int n2) {
-	char buffer[64];
-	snprintf(buffer, sizeof(buffer), "%d-%d", n1, n2);
-	return voc_str2id(voc, buffer) + 2;
+void lost_free(lost_t *lst) {
+	gen_free(lst->gen);
+	mdl_free(lst->mdl);
+	ssp_free(lst->ssp);
+	free(lst);
 }
 
-static
-void dec_dumpspc(fst_t *fst, ssp_t *ssp, FILE *file) {
-	voc_t *voc = voc_new();
-	state_t *sti = &fst->states[0];
-	for (int no = 0; no < sti->ocnt; no++) {
-		const int eo = sti->olst[no];
-		const arc_t *ed = &fst->arcs[eo];
-		hsh_t hi = fst->arcs[eo].ilbl->raw;
-		hsh_t ho = fst->arcs[eo].olbl->raw;
-		const char *ilbl = ssp_get(ssp, hi);
-		const char *olbl = ssp_get(ssp, ho);
-		const double sc  = ed->psi;
-		const int    trg = dec_dsmap(voc, eo, 0);
-		fprintf(file, "0\t%d\t", trg);
-		fprintf(file, "%s\t%s\t", ilbl, olbl);
-		fprintf(file, "%f\n", sc);
+int lost_addpattern(lost_t *lst, const char *pat) {
+	if (!gen_addpat(lst->gen, pat)) {
+		errno = EINVAL;
+		return 0;
 	}
-	const int S = fst->nstates;
-	for (int s = 0; s < S; s++) {
-		const state_t *nd = &fst->states[s];
-		for (int ni = 0; ni < nd->icnt; ni++) {
-		for (int no = 0; no < nd->ocnt; no++) {
-			const int ei = nd->ilst[ni];
-			const int eo = nd->olst[no];
-			const arc_t *ed = &fst->arcs[eo];
-			hsh_t hi = fst->arcs[eo].ilbl->raw;
-			hsh_t ho = fst->arcs[eo].olbl->raw;
-			const char *ilbl = ssp_get(ssp, hi);
-			const char *olbl = ssp_get(ssp, ho);
-			const double sc  = nd->psi[ni][no] + ed->psi;
-			const int src = dec_dsmap(voc, ei, 0);
-			const int trg = dec_dsmap(voc, eo, 0);
-			fprintf(file, "%d\t%d\t", src, trg);
-			fprintf(file, "%s\t%s\t", ilbl, olbl);
-			fprintf(file, "%f\n", sc);
-		}
-		}
+	return 1;
+}
+
+int lost_loadstr(lost_t *lst, const char *fname) {
+	return ssp_load(lst->ssp, fname);
+}
+
+int lost_loadmodel(lost_t *lst, const char *fname) {
+	return mdl_load(lst->mdl, fname);
+}
+
+lost_fst_t *lost_fst_new(lost_t *lst, int narcs,
+		const int src[], const int trg[],
+		const char *const ilbl[], const char *const olbl[], int final) {
+	if (narcs <= 0 || final <= 0) {
+		errno = EINVAL;
+		return NULL;
 	}
-	state_t *stf = &fst->states[fst->final];
-	for (int ni = 0; ni < stf->icnt; ni++) {
-		const int ei = stf->ilst[ni];
-			const int src = dec_dsmap(voc, ei, 0);
-			fprintf(file, "%d\t1\t<eps>\t0.0\n", src);
+	lost_fst_t *res = malloc(sizeof(lost_fst_t));
+	if (res == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	fst_t *fst = fst_new();
+	if (fst == NULL) {
+		free(res);
+		return NULL;
 	}
-	fprintf(file, "1\nEOS\n");
-	voc_free(voc);
+	res->fst  = fst;
+	res->idx  = malloc(sizeof(int) * narcs);
+	fst->arcs = malloc(sizeof(arc_t) * narcs);
+	if (res->idx == NULL || fst->arcs == NULL)
+		goto nomem;
+	fst->mult    = 0.0;
+	fst->final   = final;
+	fst->nstates = final + 1;
+	for (int i = 0; i < narcs; i++) {
+		if (src[i] < 0 || trg[i] <= 0 || src[i] == final
+		 || *ilbl[i] == '\0' || *olbl[i] == '\0') {
+			errno = EINVAL;
+			goto error;
+		}
+		fst->nstates = max(fst->nstates, src[i] + 1);
+		fst->nstates = max(fst->nstates, trg[i] + 1);
+		arc_t *arc = &fst->arcs[fst->narcs++];
+		memset(arc, 0, sizeof(arc_t));
+		arc->src  = src[i];
+		arc->trg  = trg[i];
+		arc->ilbl = mdl_lookup(lst->mdl, lst->mdl->src, ilbl[i], 0,
+			&fst->unk);
+		arc->olbl = mdl_lookup(lst->mdl, lst->mdl->trg, olbl[i], 1,
+			&fst->unk);
+		if (arc->ilbl == NULL || arc->olbl == NULL)
+			goto nomem;
+		// The back pointer is only used by the decoder, so it carry
+		// the caller index through the reordering of the chains.
+		arc->eback = i;
+	}
+	if (fst_addchain(fst))
+		fst->path = fst->narcs == fst->nstates - 1;
+	for (int i = 0; i < narcs; i++)
+		res->idx[i] = fst->arcs[i].eback;
+	return res;
+    nomem:
+	errno = ENOMEM;
+    error:
+	fst_free(fst);
+	free(res->idx);
+	free(res);
+	return NULL;
+}
+
+void lost_fst_free(lost_fst_t *fst) {
+	fst_free(fst->fst);
+	free(fst->idx);
+	free(fst);
 }
 
+/* lost_best:
+ *   Decode the FST and store its best path in [pth] as returned by
+ *   dec_backtrack. The arcs are left untouched by the cleanup so the path
+ *   stay usable.
+ */
 static
-void dec_decode(mdl_t *mdl, ssp_t *ssp, gen_t *gen, dat_t *dat, FILE *file,
-		int spc) {
-	prg_t *prg = prg_new(1000);
-	prg_start(prg);
-	for (int i = 0; i < dat->nfst; i++) {
-		fst_t *fst = dat->fst[i];
-		fst_addstates(fst);
-		fst_addsort(fst);
-		gen_addftr(gen, mdl, fst);
-		grd_addspc(fst);
-		grd_dopsi(mdl, fst);
-		if (spc == 0) {
-			dec_forward(fst);
-			lbl_t *out[fst->narcs][2];
-			int cnt = dec_backtrack(fst, out);
-			for (int i = cnt - 1; i >= 0; i--) {
-				hsh_t ihsh = map_gethsh(out[i][0]);
-				hsh_t ohsh = map_gethsh(out[i][1]);
-				fprintf(file, "%s@", ssp_get(ssp, ihsh));
-				fprintf(file, "%s ", ssp_get(ssp, ohsh));
-			}
-			fprintf(file, "\n");
-		} else {
-			dec_dumpspc(fst, ssp, file);
-		}
-		grd_remspc(fst);
-		gen_remftr(fst);
-		fst_remsort(fst);
-		fst_remstates(fst);
-		prg_next(prg);
+int lost_best(lost_t *lst, lost_fst_t *fst, int pth[]) {
+	bms_t bms = {0.0, 0.0, 0.0, 0.0};
+	dec_batch(lst->mdl, lst->gen, &fst->fst, 1, 0, 0.0, &bms);
+	const int cnt = dec_backtrack(fst->fst, pth);
+	dec_clean(fst->fst);
+	return cnt;
+}
+
+int lost_decode(lost_t *lst, lost_fst_t *fst, int out[], int size) {
+	int pth[fst->fst->narcs];
+	const int cnt = lost_best(lst, fst, pth);
+	for (int i = 0; i < cnt && i < size; i++)
+		out[i] = fst->idx[pth[cnt - 1 - i]];
+	return cnt;
+}
+
+int lost_decode_str(lost_t *lst, lost_fst_t *fst, char *buf, size_t size) {
+	int pth[fst->fst->narcs];
+	const int cnt = lost_best(lst, fst, pth);
+	size_t len = 0;
+	if (size != 0)
+		buf[0] = '\0';
+	for (int i = cnt - 1; i >= 0; i--) {
+		const arc_t *arc = &fst->fst->arcs[pth[i]];
+		const char *is = mdl_lblstr(lst->ssp, arc->ilbl);
+		const char *os = mdl_lblstr(lst->ssp, arc->olbl);
+		char *ptr = len < size ? buf + len : NULL;
+		len += snprintf(ptr, ptr == NULL ? 0 : size - len, "%s@%s%s",
+			is, os, i == 0 ? "" : " ");
 	}
-	prg_end(prg);
-	prg_free(prg);
+	return len;
 }
 
 /*******************************************************************************
@@ -3374,12 +8710,15 @@ void help(void *ud, char *cmd) {
     " \t   | --version             Display version informations",
     " \t-v | --verbose             Display more informations",
     " \t   | --nthreads     INT    Number of compute threads",
+    "$\t   | --bench-vec           Benchmark the math kernels and exit",
     " ",
     " Model options:",
     " \t   | --mdl-load     FILE   Model file to load",
     " \t   | --mdl-save     FILE   File to store the model",
     " \t   | --mdl-save-otf FILE   File to store the model at each iter",
     " \t   | --mdl-compact         Compact model before saving",
+    " \t   | --ckpt-load    FILE   Resume training from a checkpoint",
+    " \t   | --ckpt-save    FILE   Save a checkpoint at each iteration",
     "$\t   | --ftr-dump     FILE   File to dump features hash list",
     " ",
     " Data files:",
@@ -3387,9 +8726,17 @@ void help(void *ud, char *cmd) {
     " \t   | --train-ref    FILE   Load train references FSTs from file",
     " \t   | --devel-spc    FILE   Load devel FSTs from file",
     " \t   | --devel-out    FILE   Save devel results to file",
+    " \t   | --devel-ref    FILE   Score devel against references",
     " \t   | --test-spc     FILE   Load test FSTs from file",
     " \t   | --test-out     FILE   Save test results to file",
     " \t   | --test-fst     FILE   Save full test space to file",
+    " \t   | --test-bin            Save the test space in binary",
+    " \t   | --nbest        INT    Output the N best test paths",
+    " \t   | --posterior           Add arcs posteriors to test paths",
+    " \t   | --mbr                 Output minimum risk test paths",
+    " \t   | --serve-stdin         Decode lattices from stdin to stdout",
+    " \t   | --serve-sock   FILE   Decode lattices for clients of a socket",
+    "$\t   | --serve-batch  INT    Maximum number of lattices in a batch",
     " ",
     " Features:",
     " \t   | --pattern      T:STR  Add a pattern for feature extraction",
@@ -3403,11 +8750,30 @@ void help(void *ud, char *cmd) {
     " ",
     " Optimization:",
     "$\t   | --cache-lvl    INT    Amount of data to keep in mem (0-4)",
+    "$\t   | --lvl-arcs     INT    Arcs count for intra-FST parallelism",
+    " \t   | --beam         FLOAT  Beam width for pruning (0 to disable)",
+    " \t   | --prune-model  FILE   First-pass model for spaces pruning",
+    " \t   | --prune-post   FLOAT  Drop arcs with lower posterior",
+    " \t   | --prune-rank   INT    Keep N best arcs out of each state",
     " \t   | --iterations   INT    Number of optimization step to do",
+    " \t   | --patience     INT    Stop if devel don't improve for N iters",
+    " \t   | --time-limit   INT    Stop training after N seconds",
     "$\t   | --rbp-stpinc   FLOAT  Step increment factor",
     "$\t   | --rbp-stpdec   FLOAT  Step decrement factor",
     "$\t   | --rbp-stpmin   FLOAT  Minimum step value",
     "$\t   | --rbp-stpmax   FLOAT  Maximum step value",
+    "$\t   | --rbp-sweep    INT    Skip zero features, inexact, sweep period",
+    " \t   | --sgd-batch    INT    Stochastic training with this batch size",
+    "$\t   | --sgd-eta      FLOAT  Stochastic training learning rate",
+    " \t   | --owl-qn              Use OWL-QN instead of rprop",
+    "$\t   | --owl-hist     INT    Size of the OWL-QN history",
+    " ",
+    " Distributed training:",
+    " \t   | --dist-sock    FILE   Unix socket used to join the processes",
+    " \t   | --dist-rank    INT    Rank of this process (0 is the root)",
+    " \t   | --dist-size    INT    Total number of processes",
+    " \t   | --dist-mix     INT    Average models every N iterations",
+    "$\t   | --fast-exp            Use the fast exp approximation",
     "$",
     "$String pool:",
     "$\t   | --str-load     FILE   String pool file to preload",
@@ -3436,6 +8802,7 @@ void version(void *ud, char *cmd) {
 	(void)(cmd && ud);
 }
 
+#ifndef LOST_LIB
 int main(int argc, char *argv[argc]) {
 	int    verbose     = 0;
 	int    nthreads    = 1;
@@ -3444,9 +8811,13 @@ int main(int argc, char *argv[argc]) {
 	char **mdl_inp     = NULL,  *mdl_outp   = NULL, *mdl_outp_otf = NULL;
 	int    mdl_compact = 0,      ref_freq   = 0;
 	char  *ftr_dump    = NULL;
+	char  *ckp_inp     = NULL,  *ckp_outp   = NULL;
 	char **pos_train   = NULL, **neg_train  = NULL;
 	char  *spc_test    = NULL,  *out_test   = NULL, *fst_test     = NULL;
-	char  *spc_devel   = NULL,  *out_devel  = NULL;
+	int    serve_stdin = 0,      serve_bsz  = 32, fst_bin      = 0;
+	int    nbest       = 1,      posterior  = 0, mbr          = 0;
+	char  *serve_sock  = NULL;
+	char  *spc_devel   = NULL,  *out_devel  = NULL, *ref_devel    = NULL;
 	double rbp_stpinc  = 1.2,    rbp_stpdec = 0.5;
 	double rbp_stpmin  = 1e-8,   rbp_stpmax = 50.0;
 	char **tag_start   = NULL, **tag_remove = NULL;
@@ -3454,7 +8825,21 @@ int main(int argc, char *argv[argc]) {
 	int    min_freq    = 0;
 	char **pattern     = NULL;
 	int    iters       = 15,     cachelvl   = 0;
+	int    patience    = 0,      time_limit = 0;
+	int    lvl_arcs    = 50000;
+	double beam        = 0.0;
+	char  *prn_mdl     = NULL;
+	double prn_post    = 0.0;
+	int    prn_rank    = 0;
 	int    tick_dat    = 1000;
+	int    fast_exp    = 0,      bench_vec  = 0;
+	int    rbp_sweep   = 0;
+	int    sgd_batch   = 0;
+	double sgd_eta     = 0.3;
+	int    owl_qn      = 0,      owl_hist   = 6;
+	char  *dst_sock    = NULL;
+	int    dst_rank    = 0,      dst_size   = 1;
+	int    dst_mixing  = 0;
 	if (argc <= 1)
 		help(NULL, NULL);
 	argc--, argv++;
@@ -3464,18 +8849,29 @@ int main(int argc, char *argv[argc]) {
 		{'0', "  ", "--version",      (void *)&version,      NULL},
 		{'b', "-v", "--verbose",      (void *)&verbose,      NULL},
 		{'u', "  ", "--nthreads",     (void *)&nthreads,     NULL},
+		{'b', "  ", "--bench-vec",    (void *)&bench_vec,    NULL},
 		{'S', "  ", "--mdl-load",     (void *)&mdl_inp,      NULL},
 		{'s', "  ", "--mdl-save",     (void *)&mdl_outp,     NULL},
 		{'s', "  ", "--mdl-save-otf", (void *)&mdl_outp_otf, NULL},
 		{'b', "  ", "--mdl-compact",  (void *)&mdl_compact,  NULL},
+		{'s', "  ", "--ckpt-load",    (void *)&ckp_inp,      NULL},
+		{'s', "  ", "--ckpt-save",    (void *)&ckp_outp,     NULL},
 		{'s', "  ", "--ftr-dump",     (void *)&ftr_dump,     NULL},
 		{'S', "  ", "--train-spc",    (void *)&pos_train,    NULL},
 		{'S', "  ", "--train-ref",    (void *)&neg_train,    NULL},
 		{'s', "  ", "--devel-spc",    (void *)&spc_devel,    NULL},
 		{'s', "  ", "--devel-out",    (void *)&out_devel,    NULL},
+		{'s', "  ", "--devel-ref",    (void *)&ref_devel,    NULL},
 		{'s', "  ", "--test-spc",     (void *)&spc_test,     NULL},
 		{'s', "  ", "--test-out",     (void *)&out_test,     NULL},
 		{'s', "  ", "--test-fst",     (void *)&fst_test,     NULL},
+		{'b', "  ", "--test-bin",     (void *)&fst_bin,      NULL},
+		{'u', "  ", "--nbest",        (void *)&nbest,        NULL},
+		{'b', "  ", "--posterior",    (void *)&posterior,    NULL},
+		{'b', "  ", "--mbr",          (void *)&mbr,          NULL},
+		{'b', "  ", "--serve-stdin",  (void *)&serve_stdin,  NULL},
+		{'s', "  ", "--serve-sock",   (void *)&serve_sock,   NULL},
+		{'u', "  ", "--serve-batch",  (void *)&serve_bsz,    NULL},
 		{'S', "  ", "--pattern",      (void *)&pattern,      NULL},
 		{'S', "  ", "--tag-start",    (void *)&tag_start,    NULL},
 		{'S', "  ", "--tag-remove",   (void *)&tag_remove,   NULL},
@@ -3488,14 +8884,36 @@ int main(int argc, char *argv[argc]) {
 		{'s', "  ", "--str-save",     (void *)&str_save,     NULL},
 		{'b', "  ", "--str-all",      (void *)&str_all,      NULL},
 		{'u', "  ", "--iterations",   (void *)&iters,        NULL},
+		{'u', "  ", "--patience",     (void *)&patience,     NULL},
+		{'u', "  ", "--time-limit",   (void *)&time_limit,   NULL},
 		{'u', "  ", "--cache-lvl",    (void *)&cachelvl,     NULL},
+		{'u', "  ", "--lvl-arcs",     (void *)&lvl_arcs,     NULL},
+		{'p', "  ", "--beam",         (void *)&beam,         NULL},
+		{'s', "  ", "--prune-model",  (void *)&prn_mdl,      NULL},
+		{'p', "  ", "--prune-post",   (void *)&prn_post,     NULL},
+		{'u', "  ", "--prune-rank",   (void *)&prn_rank,     NULL},
 		{'p', "  ", "--rbp-stpinc",   (void *)&rbp_stpinc,   NULL},
 		{'p', "  ", "--rbp-stpdec",   (void *)&rbp_stpdec,   NULL},
 		{'p', "  ", "--rbp-stpmin",   (void *)&rbp_stpmin,   NULL},
 		{'p', "  ", "--rbp-stpmax",   (void *)&rbp_stpmax,   NULL},
+		{'u', "  ", "--rbp-sweep",    (void *)&rbp_sweep,    NULL},
+		{'u', "  ", "--sgd-batch",    (void *)&sgd_batch,    NULL},
+		{'p', "  ", "--sgd-eta",      (void *)&sgd_eta,      NULL},
+		{'b', "  ", "--owl-qn",       (void *)&owl_qn,       NULL},
+		{'u', "  ", "--owl-hist",     (void *)&owl_hist,     NULL},
+		{'s', "  ", "--dist-sock",    (void *)&dst_sock,     NULL},
+		{'u', "  ", "--dist-rank",    (void *)&dst_rank,     NULL},
+		{'u', "  ", "--dist-size",    (void *)&dst_size,     NULL},
+		{'u', "  ", "--dist-mix",     (void *)&dst_mixing,   NULL},
+		{'b', "  ", "--fast-exp",     (void *)&fast_exp,     NULL},
 		{0, NULL, NULL, NULL, NULL}
 	};
 	arg_parse(arg_def, &argc, argv);
+	vec_init(fast_exp);
+	if (bench_vec) {
+		vec_bench();
+		return EXIT_SUCCESS;
+	}
 	// System initialization:
 	//   Here we do the system preparation common to all modes of operation
 	//   like preparing the string pool and tuple table.
@@ -3544,6 +8962,18 @@ int main(int argc, char *argv[argc]) {
 		if (dat_load(dat_devel, spc_devel, mdl, 0, t))
 			pfatal("cannot load file %s", spc_devel);
 	}
+	dat_t *dat_dref = NULL;
+	if (ref_devel != NULL) {
+		int t = tick_dat;
+		if (dat_devel == NULL)
+			fatal("devel references without devel spaces");
+		dat_dref = dat_new();
+		fprintf(stderr, "    [ref] %s\n", ref_devel);
+		if (dat_load(dat_dref, ref_devel, mdl, 0, t))
+			pfatal("cannot load file %s", ref_devel);
+		if (dat_dref->nfst != dat_devel->nfst)
+			fatal("devel spaces and references don't match");
+	}
 	dat_t *dat_test = NULL;
 	if (spc_test != NULL) {
 		int t = tick_dat;
@@ -3552,6 +8982,28 @@ int main(int argc, char *argv[argc]) {
 		if (dat_load(dat_test, spc_test, mdl, 0, t))
 			pfatal("cannot load file %s", spc_test);
 	}
+	const int pst = (posterior ? DEC_POST : 0) | (mbr ? DEC_MBR : 0);
+	if (pst != 0 && nbest > 1)
+		fatal("n-best decoding don't support posteriors");
+	// Distributed mode:
+	//   Each process keep its own shard of the training data and all of
+	//   them must be connected before the training start.
+	dst_t *dst = NULL;
+	if (dst_size > 1) {
+		if (dst_sock == NULL || dst_rank >= dst_size)
+			fatal("distributed mode need a socket and a rank");
+		if (sgd_batch != 0 || owl_qn)
+			fatal("distributed mode only support rprop");
+		if (patience != 0 || time_limit != 0)
+			fatal("distributed mode don't support early stopping");
+		if (dat_train != NULL)
+			dat_shard(dat_train, dst_rank, dst_size);
+		fprintf(stderr, "  - Connect to the other processes\n");
+		dst = dst_new(dst_sock, dst_rank, dst_size);
+		if (dst == NULL)
+			pfatal("cannot connect through %s", dst_sock);
+	}
+	const int root = dst == NULL || dst->rank == 0;
 	if (dat_train != NULL)
 		fprintf(stderr, "        %d train FSTs\n", dat_train->nfst);
 	if (dat_devel != NULL)
@@ -3601,16 +9053,44 @@ int main(int argc, char *argv[argc]) {
 				pfatal("cannot load file %s", mdl_inp[i]);
 		}
 	}
+	// Pruning:
+	//   The spaces are pruned with the first-pass model or the loaded one
+	//   before any feature is generated on them.
+	if (prn_post > 0.0 || prn_rank > 0) {
+		fprintf(stderr, "  - Prune the search spaces\n");
+		prn_t prn = {.mdl = mdl, .gen = gen, .post = prn_post,
+		             .rank = prn_rank, .nth = nthreads};
+		if (prn_mdl != NULL) {
+			fprintf(stderr, "    [mdl] %s\n", prn_mdl);
+			prn.mdl = mdl_new(ssp);
+			if (prn.mdl == NULL || !mdl_load(prn.mdl, prn_mdl))
+				pfatal("cannot load file %s", prn_mdl);
+		} else if (mdl_inp == NULL) {
+			fatal("pruning need a model to score the arcs");
+		}
+		if (dat_train != NULL)
+			prn_dat(&prn, dat_train, "train");
+		if (dat_devel != NULL)
+			prn_dat(&prn, dat_devel, "devel");
+		if (dat_test != NULL)
+			prn_dat(&prn, dat_test, "test");
+		if (prn.mdl != mdl)
+			mdl_free(prn.mdl);
+	}
 	fprintf(stderr, "  - Initialize the gradient computer\n");
 	grd_t *grd = grd_new(mdl, gen, dat_train);
 	grd->nth   = nthreads;
 	grd->cache = cachelvl;
+	grd->lvl   = lvl_arcs;
+	grd->beam  = beam;
 	fprintf(stderr, "  - Initialize the optimizer\n");
 	rbp_t *rbp = rbp_new();
 	rbp->stpinc = rbp_stpinc;
 	rbp->stpdec = rbp_stpdec;
 	rbp->stpmin = rbp_stpmin;
 	rbp->stpmax = rbp_stpmax;
+	rbp->nth    = nthreads;
+	rbp->act    = rbp_sweep;
 	if (tag_rho1 != NULL) {
 		for (int i = 0; tag_rho1[i] != NULL; i++) {
 			int tag; double val;
@@ -3652,48 +9132,154 @@ int main(int argc, char *argv[argc]) {
 		if (rbp->rho3[i] == -1.0)
 			rbp->rho3[i] = rbp->rho3[0];
 	}
+	sgd_t *sgd = NULL;
+	if (dat_train != NULL && sgd_batch != 0) {
+		sgd = sgd_new(grd, rbp, sgd_batch, sgd_eta);
+		if (sgd == NULL && errno == EINVAL)
+			fatal("train spaces and references don't match");
+		else if (sgd == NULL)
+			pfatal("cannot create stochastic optimizer");
+	}
+	owl_t *owl = NULL;
+	if (dat_train != NULL && sgd == NULL && owl_qn) {
+		owl = owl_new(mdl, rbp, max(owl_hist, 1));
+		if (owl == NULL)
+			pfatal("cannot create quasi-Newton optimizer");
+	}
+	if (ckp_inp != NULL || ckp_outp != NULL) {
+		if (owl != NULL)
+			fatal("checkpoints don't support OWL-QN");
+	}
+	if (ckp_inp != NULL) {
+		fprintf(stderr, "  - Load checkpoint\n");
+		fprintf(stderr, "    [ckp] %s\n", ckp_inp);
+		if (!ckp_load(ckp_inp, mdl, sgd))
+			pfatal("cannot load checkpoint %s", ckp_inp);
+		fprintf(stderr, "        resume after iteration %d\n",
+			mdl->itr);
+	}
+	// The devel set is decoded in the background on a snapshot of the
+	// model taken after each iteration, while the next one run. With
+	// references, it is also scored and the best snapshot is kept.
+	dec_job_t dev = {.ssp = ssp, .gen = gen, .beam = beam};
+	if (dat_train != NULL && dat_devel != NULL && root
+	 && (out_devel != NULL || dat_dref != NULL)) {
+		dev.dat = dat_devel;
+		dev.mdl = mdl_new(ssp);
+		if (dev.mdl == NULL)
+			pfatal("cannot create devel model");
+		if (dat_dref != NULL && (dev.scr = scr_new(dat_dref)) == NULL)
+			pfatal("cannot create devel scorer");
+	}
+	if (patience != 0 && dev.scr == NULL)
+		fatal("patience need devel references");
 	// Optimization:
 	//   Now that all is ready, if a train dataset was provided, we can
-	//   start the optimization.
+	//   start the optimization. In stochastic mode, each iteration is a
+	//   full epoch over the data.
 	if (dat_train != NULL) {
 		fprintf(stderr, "* Optimize the model\n");
-		for (int i = 1; i <= iters; i++) {
+		const time_t start = time(NULL);
+		for (int i = mdl->itr + 1, stop = 0; i <= iters && !stop; i++) {
 			fprintf(stderr, "  [%3d] Start new iteration\n", i);
 			mdl->itr = i;
-			fprintf(stderr, "    - Compute the gradient\n");
-			double fx = grd_compute(grd);/// dat_train->nfst;
-			fprintf(stderr, "    - Apply the update\n");
-			rbp_step(rbp, mdl, fx);
+			if (sgd != NULL) {
+				fprintf(stderr, "    - Stochastic epoch\n");
+				sgd_epoch(sgd, mdl);
+			} else {
+				mdl->full = rbp_isfull(rbp, mdl);
+				fprintf(stderr, "    - Compute the gradient\n");
+				double fx = grd_compute(grd);
+				if (dst != NULL && dst_mixing == 0) {
+					fx = dst_reduce(dst, mdl, fx);
+					fprintf(stderr, "    comm: time=%.3fs "
+						"sent=%ldkB recv=%ldkB\n",
+						dst->tcom, dst->nsnd / 1024,
+						dst->nrcv / 1024);
+				}
+				if (grd->bms.arcs != 0.0) {
+					const bms_t *b = &grd->bms;
+					fprintf(stderr, "    beam: arcs=%.2f%% "
+						"mass=%.2f%%\n",
+						100.0 * b->kept / b->arcs,
+						100.0 * b->mass / b->nfst);
+				}
+				fprintf(stderr, "    - Apply the update\n");
+				if (owl != NULL)
+					owl_step(owl, mdl, fx);
+				else
+					rbp_step(rbp, mdl, fx);
+				if (dst != NULL && dst_mixing != 0
+				 && (i % dst_mixing == 0 || i == iters)) {
+					const double w = dat_train->nfst;
+					dst_mix(dst, mdl, w);
+					fprintf(stderr, "    mix: time=%.3fs "
+						"sent=%ldkB recv=%ldkB\n",
+						dst->tcom, dst->nsnd / 1024,
+						dst->nrcv / 1024);
+				}
+			}
 			fprintf(stderr, "    - Compute stats\n");
 			mdl_stats(mdl, verbose);
-			if (dat_devel != NULL) {
-				fprintf(stderr, "* Decode the devel\n");
-				char buf[4096];
-				sprintf(buf, out_devel, i);
-				FILE *file = fopen(buf, "w");
-				dec_decode(mdl, ssp, gen, dat_devel, file, 0);
-				fclose(file);
+			if (time_limit != 0
+			 && difftime(time(NULL), start) >= time_limit) {
+				fprintf(stderr, "  - Time limit reached\n");
+				stop = 1;
 			}
-			if (mdl_outp_otf != NULL) {
+			if (dev.dat != NULL) {
+				dec_jobwait(&dev);
+				if (patience != 0 && dev.wait >= patience) {
+					fprintf(stderr, "  - No improvement "
+						"since iteration %d\n",
+						dev.bitr);
+					stop = 1;
+				}
+				fprintf(stderr, "  - Decode the devel\n");
+				char buf[4096] = "";
+				if (out_devel != NULL)
+					sprintf(buf, out_devel, i);
+				mdl_snapshot(dev.mdl, mdl);
+				dec_jobstart(&dev, buf, i);
+			}
+			if (mdl_outp_otf != NULL && root) {
 				fprintf(stderr, "  - Save model\n");
 				char buf[4096];
 				sprintf(buf, mdl_outp_otf, i);
 				mdl_save(mdl, buf);
 			}
+			if (ckp_outp != NULL && root) {
+				fprintf(stderr, "  - Save checkpoint\n");
+				if (!ckp_save(ckp_outp, mdl, sgd))
+					pfatal("cannot save checkpoint %s",
+						ckp_outp);
+			}
 		}
 	}
+	dec_jobwait(&dev);
+	// Best model:
+	//   When the devel is scored, the snapshot with the best score replace
+	//   the trained model for decoding the test and saving.
+	mdl_t *fin = mdl;
+	if (dev.best != NULL) {
+		fprintf(stderr, "* Keep model of iteration %d\n", dev.bitr);
+		scr_print(dev.bscr, ssp, 1);
+		fin = dev.best;
+	}
 	// Decoding:
-	if (dat_test != NULL) {
+	if (dat_test != NULL && root) {
 		if (out_test != NULL) {
-			fprintf(stderr, "* Decode the test (viterbi)\n");
+			fprintf(stderr, "* Decode the test (%s)\n",
+				mbr ? "minimum risk" : "viterbi");
 			FILE *file = fopen(out_test, "w");
-			dec_decode(mdl, ssp, gen, dat_test, file, 0);
+			dec_decode(fin, ssp, gen, dat_test, file, 0, nbest,
+				pst, beam, NULL, 0);
 			fclose(file);
 		}
 		if (fst_test != NULL) {
 			fprintf(stderr, "* Decode the test (space)\n");
 			FILE *file = fopen(fst_test, "w");
-			dec_decode(mdl, ssp, gen, dat_test, file, 1);
+			dec_decode(fin, ssp, gen, dat_test, file,
+				fst_bin ? 2 : 1, 1, 0, 0.0, NULL, 0);
 			fclose(file);
 		}
 	}
@@ -3701,22 +9287,46 @@ int main(int argc, char *argv[argc]) {
 	// now, we don't check if user provided name for all produced data so
 	// some valuable things may be lost.
 	fprintf(stderr, "* Generate outputs\n");
-	if (mdl_outp != NULL) {
+	if (mdl_outp != NULL && root) {
 		if (mdl_compact) {
 			fprintf(stderr, "  - Compact model\n");
-			mdl_shrink(mdl);
+			mdl_shrink(fin);
 		}
 		fprintf(stderr, "  - Save model\n");
-		mdl_save(mdl, mdl_outp);
+		mdl_save(fin, mdl_outp);
 	}
-	if (str_save != NULL) {
+	if (str_save != NULL && root) {
 		fprintf(stderr, "  - Dump string pool\n");
 		ssp_save(ssp, str_save);
 	}
+	// Serving:
+	//   Finally, the model stay resident to decode the lattices coming on
+	//   the standard input until its end.
+	if (serve_stdin && root) {
+		fprintf(stderr, "* Serve the standard input\n");
+		dec_serve(fin, ssp, gen, stdin, stdout, beam);
+	}
+	if (serve_sock != NULL && root) {
+		fprintf(stderr, "* Serve the socket %s\n", serve_sock);
+		srv_run(fin, ssp, gen, serve_sock, nthreads, serve_bsz, beam,
+			mdl_inp, str_load);
+		pfatal("cannot serve the socket %s", serve_sock);
+	}
 	fprintf(stderr, "* Cleanup remaining objects\n");
 	if (mdl->dump != NULL)
 		fclose(mdl->dump);
+	if (sgd != NULL)
+		sgd_free(sgd);
+	if (owl != NULL)
+		owl_free(owl);
+	if (dev.scr != NULL)
+		scr_free(dev.scr);
+	if (dev.bscr != NULL)
+		scr_free(dev.bscr);
+	if (dst != NULL)
+		dst_free(dst);
 	dat_free(dat_train);
+	dat_free(dat_dref);
 	rbp_free(rbp);
 	grd_free(grd);
 	gen_free(gen);
@@ -3724,6 +9334,7 @@ int main(int argc, char *argv[argc]) {
 	fprintf(stderr, "* Done\n");
 	return EXIT_SUCCESS;
 }
+#endif
 
 /*******************************************************************************
  * This is the end
@@ -0,0 +1,108 @@
+/*******************************************************************************
+ *      Lost -- A fast toolkit for Log-Linear models
+ *
+ * Copyright (c) 2012-2022  LIMSI-CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+#ifndef lost_h
+#define lost_h
+
+#include <stddef.h>
+
+/*******************************************************************************
+ * Library interface
+ *
+ *   Decoding with a trained model without going through files: the decoder is
+ *   set up with the same patterns than for training, the model and string pool
+ *   are loaded, and the FSTs are built directly from arrays of arcs. A decoder
+ *   can be used by many threads at once as long as each FST is used by a
+ *   single thread at a time.
+ *   On error, the functions return NULL or 0 and set errno.
+ ******************************************************************************/
+
+#if defined(LOST_LIB) && defined(__GNUC__)
+#define LOST_API __attribute__((visibility("default")))
+#else
+#define LOST_API
+#endif
+
+typedef struct lost_s     lost_t;
+typedef struct lost_fst_s lost_fst_t;
+
+/* lost_new:
+ *   Create a new decoder with an empty model.
+ */
+LOST_API lost_t *lost_new(void);
+
+/* lost_free:
+ *   Free a decoder, all the FSTs built with it must have been freed before.
+ */
+LOST_API void lost_free(lost_t *lst);
+
+/* lost_addpattern:
+ *   Add a feature extraction pattern with the same syntax than --pattern.
+ */
+LOST_API int lost_addpattern(lost_t *lst, const char *pat);
+
+/* lost_loadstr:
+ *   Load a string pool file as saved by --str-save.
+ */
+LOST_API int lost_loadstr(lost_t *lst, const char *fname);
+
+/* lost_loadmodel:
+ *   Load a model file as saved by --mdl-save, this can be called many times
+ *   like --mdl-load.
+ */
+LOST_API int lost_loadmodel(lost_t *lst, const char *fname);
+
+/* lost_fst_new:
+ *   Build an FST from its [narcs] arcs, the i-th going from state src[i] to
+ *   state trg[i] with the labels ilbl[i] and olbl[i]. The initial state is 0
+ *   and the final one is [final].
+ */
+LOST_API lost_fst_t *lost_fst_new(lost_t *lst, int narcs,
+		const int src[], const int trg[],
+		const char *const ilbl[], const char *const olbl[], int final);
+
+/* lost_fst_free:
+ *   Free an FST built with lost_fst_new.
+ */
+LOST_API void lost_fst_free(lost_fst_t *fst);
+
+/* lost_decode:
+ *   Find the best path in the FST and store in [out] the index of its arcs, in
+ *   order, as given to lost_fst_new. At most [size] arcs are stored and the
+ *   length of the path is returned, so a larger array is needed if it is more
+ *   than [size].
+ */
+LOST_API int lost_decode(lost_t *lst, lost_fst_t *fst, int out[], int size);
+
+/* lost_decode_str:
+ *   Same as lost_decode, but the best path is written to [buf] as space
+ *   separated "input@output" labels like in the decoder outputs. Like snprintf,
+ *   at most [size] bytes are written and the full length is returned.
+ */
+LOST_API int lost_decode_str(lost_t *lst, lost_fst_t *fst, char *buf,
+		size_t size);
+
+#endif